@@ -0,0 +1,91 @@
+#ifndef _BUCKET_H
+#define _BUCKET_H
+
+#include <time-simulator.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Rate limiters in simulated time.  Neither kind generates refill events,
+ * the level is brought up to date from the time elapsed since it was last
+ * looked at, and the only event is one timer per bucket, armed for the
+ * exact time the first waiter can go.
+ *
+ *	BUCKET_TOKEN	fills at rate tokens per second up to size, starting
+ *			full, so bursts of up to size go through at once.  A
+ *			request waits until its tokens are there.
+ *	BUCKET_LEAKY	requests pour their tokens in and it drains at rate,
+ *			a request goes once everything poured in before it
+ *			drained, so there are no bursts.  A request that
+ *			would overflow size tokens is turned away, size 0
+ *			never overflows.
+ *
+ * Waiters go strictly in arrival order, a request never overtakes an older
+ * one that is still waiting even if its own tokens are there.
+ */
+enum bucket_type {
+	BUCKET_TOKEN,
+	BUCKET_LEAKY,
+};
+
+struct bucket_stats {
+	uint64_t requests;
+	uint64_t tokens;		/* granted */
+	uint64_t immediate;		/* granted without waiting */
+	uint64_t waits;
+	uint64_t wait_time;		/* summed over waits */
+	uint64_t max_wait;
+	uint64_t overflows;
+	unsigned int max_waiters;
+};
+
+/* Lives with the waiting entity, ->e is woken once the tokens are granted. */
+struct bucket_waiter {
+	struct list_head list;
+	struct entity *e;
+	uint64_t tokens;
+	uint64_t start;
+	uint64_t deadline;		/* leaky only */
+};
+
+struct bucket {
+	enum bucket_type type;
+	uint64_t rate;			/* tokens per second */
+	uint64_t size;			/* in tokens */
+	uint64_t level;			/* in tokens * NSEC_PER_SEC */
+	uint64_t last;
+	struct list_head waiters;
+	struct list_head sleepers;
+	unsigned int nr_waiters;
+	struct entity timer;
+	bool timer_armed;
+	struct bucket_stats stats;
+};
+
+/*
+ * @rate must not be 0.  Also how a bucket is reset between runs, after
+ * time_simulator_clear().
+ */
+void bucket_init(struct bucket *b, enum bucket_type type, uint64_t rate,
+		 uint64_t size);
+/*
+ * Ask for @tokens on behalf of @e.  Returns 1 if they were granted right
+ * away, 0 if @e was put to sleep and will be woken with them granted, and
+ * -ENOSPC if a leaky bucket would overflow or -EINVAL if a token bucket can
+ * never hold that many.
+ */
+int bucket_get(struct time_simulator *s, struct bucket *b,
+	       struct bucket_waiter *w, struct entity *e, uint64_t tokens);
+/* Whole tokens available (token) or still queued (leaky) right now. */
+uint64_t bucket_level(struct time_simulator *s, struct bucket *b);
+/*
+ * Save or load the state of a bucket, waiters must live in the same
+ * allocation as their entities.
+ */
+void bucket_checkpoint(struct checkpoint *c, struct bucket *b);
+#ifdef __cplusplus
+}
+#endif
+#endif /* _BUCKET_H */
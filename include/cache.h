@@ -0,0 +1,44 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * On-disk result cache.  Callers describe a run by adding every input to a
+ * cache_key, the entry is stored in dir/<hash of the key> together with the
+ * full key, so a hash collision is a miss and never a wrong result.
+ *
+ * cache_build_id() hashes the executable and every shared object it has
+ * loaded, mixing it into the key invalidates all entries made by any other
+ * build of the model or the library.
+ */
+struct cache_key {
+	unsigned char *buf;
+	size_t len;
+	size_t size;
+	int error;
+};
+
+void cache_key_init(struct cache_key *k);
+void cache_key_free(struct cache_key *k);
+void cache_key_add(struct cache_key *k, const void *data, size_t len);
+void cache_key_add_u64(struct cache_key *k, uint64_t v);
+void cache_key_add_str(struct cache_key *k, const char *str);
+
+uint64_t cache_hash(const void *data, size_t len, uint64_t hash);
+uint64_t cache_build_id(void);
+
+/* Returns 0 and a malloc'ed copy of the data on a hit, -ENOENT on a miss. */
+int cache_load(const char *dir, struct cache_key *k, void **data,
+	       size_t *len);
+int cache_store(const char *dir, struct cache_key *k, const void *data,
+		size_t len);
+#ifdef __cplusplus
+}
+#endif
+#endif /* _CACHE_H */
@@ -0,0 +1,101 @@
+#ifndef _CALENDAR_H
+#define _CALENDAR_H
+
+#include <time-simulator.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Time quantized event queue.  With a quantum every wake time is rounded up
+ * to a multiple of it, so everything due in a quantum ties on time and is
+ * ordered by lane and enqueue order alone.  For the normal lane that is what
+ * appending to a list gives for free, one list in each bucket of a ring a
+ * quantum per bucket wide, sized to cover the horizon the model asked for
+ * and starting at the current quantum.  Enqueue and dispatch are O(1) and
+ * the next non-empty bucket is found with a two level bitmap.  The other
+ * lanes are rare and stay in the simulator's rbtree, as does anything due
+ * past the ring, which is moved over in order when the ring reaches it.
+ *
+ * A ring bucket is a cache miss where a small tree is not, so the ring is
+ * only used once CALENDAR_ON events are queued and handed back to the tree
+ * when fewer than CALENDAR_OFF are.
+ *
+ * Events run up to a quantum late.  Every enqueue measures how late against
+ * the wake time the exact queue would have given it.
+ */
+#define CALENDAR_MIN_SHIFT 6
+#define CALENDAR_MAX_SHIFT 20
+#define CALENDAR_ON 256
+#define CALENDAR_OFF 64
+
+struct calendar_stats {
+	uint64_t events;
+	uint64_t late;			/* summed over events */
+	uint64_t max_late;
+	uint64_t delay;			/* summed requested delays */
+	uint64_t overflows;		/* due past the ring when queued */
+};
+
+/* Linked through entity->cal_next in enqueue order. */
+struct calendar_bucket {
+	struct entity *head;
+	struct entity *tail;
+};
+
+struct calendar {
+	uint64_t quantum;
+	uint64_t horizon;
+	uint64_t base;			/* quantum the ring starts at */
+	uint64_t nr;
+	unsigned int nr_buckets;
+	unsigned int cur_bucket;	/* of the last calendar_first() */
+	bool on;			/* the simulator is queueing here */
+	struct calendar_bucket *buckets;
+	uint64_t *used;			/* a bit per bucket */
+	uint64_t *used_words;		/* a bit per word of used */
+	struct rb_root later;		/* due past the ring, the simulator's */
+	struct calendar_stats stats;
+};
+
+/* A ring of at least @horizon / @quantum buckets, within the shifts above. */
+struct calendar *calendar_alloc(uint64_t quantum, uint64_t horizon);
+void calendar_free(struct calendar *cal);
+/* Empty the ring and start it at the quantum @time is in. */
+void calendar_reset(struct calendar *cal, uint64_t time);
+
+/* The wake time of an event enqueued at @time for @delta, rounded up. */
+static inline uint64_t calendar_wake_time(struct calendar *cal, uint64_t time,
+					  uint64_t delta)
+{
+	uint64_t exact = time + delta;
+	uint64_t wake = (exact + cal->quantum - 1) / cal->quantum *
+		cal->quantum;
+
+	cal->stats.events++;
+	cal->stats.delay += delta;
+	cal->stats.late += wake - exact;
+	if (wake - exact > cal->stats.max_late)
+		cal->stats.max_late = wake - exact;
+	return wake;
+}
+
+/* Queue @e, or return false if it is due past the end of the ring. */
+bool calendar_add(struct calendar *cal, struct entity *e);
+/* The next entity due, only valid with cal->nr. */
+struct entity *calendar_first(struct calendar *cal);
+/* Remove the entity calendar_first() just returned. */
+void calendar_del_first(struct calendar *cal, struct entity *e);
+/* Queued events due at or before @time. */
+uint64_t calendar_nr_due(struct calendar *cal, uint64_t time);
+/* The first queued entity of @event_class, NULL if there is none. */
+struct entity *calendar_earliest(struct calendar *cal,
+				 unsigned int event_class);
+/* Everything queued, in dispatch order. */
+void calendar_for_each(struct calendar *cal,
+		       void (*fn)(struct entity *e, void *priv), void *priv);
+#ifdef __cplusplus
+}
+#endif
+#endif /* _CALENDAR_H */
@@ -0,0 +1,122 @@
+#ifndef _CHECKPOINT_H
+#define _CHECKPOINT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <kernel/list.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct time_simulator;
+struct entity;
+
+/*
+ * Checkpoints.  A checkpoint is taken between two events, when the clock is
+ * about to move past the next multiple of the interval, by a forked child
+ * that writes its copy on write snapshot of the process out while the
+ * parent carries on simulating.  The file is written to <path>.tmp and
+ * renamed over <path> once it is synced, so <path> is always complete.  If
+ * the previous writer is still busy the checkpoint is skipped.
+ *
+ * A checkpoint holds, in order:
+ *
+ *	char     magic[8]		"TSCKPT01"
+ *	uint64_t time, seq, nr_dispatched, nr_queued, nr_sleepers
+ *	uint64_t nr_entities		on the entity list
+ *	ops->prelude()
+ *	every listed entity, its state and then its ops->checkpoint()
+ *	the event queue in dispatch order, a reference and the ordering
+ *	key of every queued entity
+ *	s->sleepers
+ *	the calendar's lateness counters, when time is quantized
+ *	ops->state()
+ *
+ * Everything is saved and loaded by the same functions, c->load says which
+ * way the data goes.  Entities are referred to by their position on the
+ * entity list, so restoring needs the same entities created in the same
+ * order first.  An entity that is not on the list, a device request say,
+ * is referred to by its offset from the closest listed entity below it and
+ * has to live in the same allocation as that one.
+ */
+#define CHECKPOINT_MAGIC "TSCKPT01"
+
+struct checkpoint_ref;
+
+struct checkpoint {
+	FILE *f;
+	bool load;
+	int error;			/* the first one, nothing happens after */
+	struct entity **entities;	/* by position, when loading */
+	struct checkpoint_ref *refs;	/* by address, when saving */
+	uint64_t nr_entities;
+	uint64_t time;
+	uint64_t seq;
+	uint64_t nr_dispatched;
+	uint64_t nr_queued;
+	uint64_t nr_sleepers;
+};
+
+struct checkpoint_ops {
+	/* What the model needs before it can set a run up again. */
+	void (*prelude)(struct time_simulator *s, struct checkpoint *c);
+	/* Everything else the model owns, after the simulator's own state. */
+	void (*state)(struct time_simulator *s, struct checkpoint *c);
+};
+
+/* Per entity type, hung off entity->ops. */
+struct entity_ops {
+	void (*checkpoint)(struct checkpoint *c, struct entity *e);
+};
+
+struct checkpointer {
+	const char *path;
+	uint64_t interval;
+	uint64_t next;
+	const struct checkpoint_ops *ops;
+	pid_t writer;
+	uint64_t taken;
+	uint64_t skipped;
+	uint64_t failed;
+};
+
+void checkpoint_bytes(struct checkpoint *c, void *p, size_t len);
+#define checkpoint_var(c, v) checkpoint_bytes((c), &(v), sizeof(v))
+/* Clock and sleep accounting of an entity, not where it is queued. */
+void checkpoint_entity_state(struct checkpoint *c, struct entity *e);
+void checkpoint_ref(struct checkpoint *c, struct entity **e);
+/*
+ * A list of entities, @offset is where the list_head linking them sits
+ * relative to each entity, CHECKPOINT_ENTITY_LIST for entity->list.
+ */
+void checkpoint_list(struct checkpoint *c, struct list_head *head,
+		     size_t offset);
+#define CHECKPOINT_ENTITY_LIST offsetof(struct entity, list)
+
+/* Called before the clock jumps to @wake_time, past ck->next. */
+void __checkpoint_take(struct time_simulator *s, uint64_t wake_time);
+void checkpointer_free(struct checkpointer *ck);
+
+int time_simulator_checkpoint(struct time_simulator *s, const char *path,
+			      uint64_t interval,
+			      const struct checkpoint_ops *ops);
+/* Wait for the last writer, returns -EIO if any writer failed. */
+int time_simulator_checkpoint_wait(struct time_simulator *s);
+
+/*
+ * Resuming is checkpoint_open(), which reads up to the prelude, the model
+ * loading its prelude, setting the run up again exactly as it was first set
+ * up, then time_simulator_restore() and checkpoint_close().
+ */
+int checkpoint_open(struct checkpoint *c, const char *path);
+int time_simulator_restore(struct time_simulator *s, struct checkpoint *c,
+			   const struct checkpoint_ops *ops);
+void checkpoint_close(struct checkpoint *c);
+#ifdef __cplusplus
+}
+#endif
+#endif /* _CHECKPOINT_H */
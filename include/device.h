@@ -0,0 +1,93 @@
+#ifndef _DEVICE_H
+#define _DEVICE_H
+
+#include <time-simulator.h>
+#include <sampler.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A block device with a fixed queue depth.  Up to queue_depth requests are
+ * in service at once, each for a service time drawn from a 100 entry
+ * percentile table and scaled per direction, the rest wait in FIFO order.
+ * A request submitted right behind a queued one of the same direction that
+ * ends where it starts is merged into it, up to max_merge blocks, and costs
+ * block_ns per extra block instead of a whole draw.
+ *
+ * Requests are driven by an entity each but are not on the simulator's
+ * entity list, they belong to whoever submitted them.  ->end_io runs once
+ * for every request, merged ones included, when its service completes.
+ */
+enum device_dir {
+	DEVICE_READ,
+	DEVICE_WRITE,
+	NR_DEVICE_DIRS,
+};
+
+struct device_config {
+	unsigned int queue_depth;
+	const uint64_t *service_table;
+	struct sampler *stream;
+	unsigned int cost_pct[NR_DEVICE_DIRS];
+	uint64_t block_ns;
+	unsigned int max_merge;		/* in blocks, 0 never merges */
+};
+
+struct device_stats {
+	uint64_t submitted[NR_DEVICE_DIRS];
+	uint64_t merged;
+	uint64_t dispatched;
+	uint64_t busy_time;		/* with at least one request in service */
+	uint64_t queue_time;		/* summed submit to dispatch */
+	uint64_t service_time;		/* summed dispatch to completion */
+	unsigned int max_queued;
+};
+
+struct device {
+	struct device_config cfg;
+	struct device_stats stats;
+	struct list_head queue;
+	unsigned int nr_queued;
+	unsigned int in_flight;
+	uint64_t busy_start;
+};
+
+struct device_request {
+	struct entity e;
+	struct device *dev;
+	enum device_dir dir;
+	uint64_t sector;
+	uint64_t len;
+	uint64_t submit_time;
+	void (*end_io)(struct time_simulator *s, struct device_request *rq);
+	struct list_head list;
+	struct list_head merged;
+};
+
+/* How requests are linked on the queue and merged lists, for checkpoints. */
+#define DEVICE_REQUEST_LIST \
+	(offsetof(struct device_request, list) - \
+	 offsetof(struct device_request, e))
+
+/* Also how a device is reset between runs, after time_simulator_clear(). */
+void device_init(struct device *dev, const struct device_config *cfg);
+void device_submit(struct time_simulator *s, struct device *dev,
+		   struct device_request *rq, enum device_dir dir,
+		   uint64_t sector, uint64_t len);
+/*
+ * Save or load what a device does between requests, the requests themselves
+ * belong to their submitters and only their places in the queue are here.
+ */
+void device_checkpoint(struct checkpoint *c, struct device *dev);
+/*
+ * Save or load a request that may have been submitted to @dev, for its
+ * submitter to call.  ->end_io is the submitter's to restore.
+ */
+void device_request_checkpoint(struct checkpoint *c, struct device *dev,
+			       struct device_request *rq);
+#ifdef __cplusplus
+}
+#endif
+#endif /* _DEVICE_H */
@@ -0,0 +1,87 @@
+#ifndef _GAUGE_H
+#define _GAUGE_H
+
+#include <stdint.h>
+#include <kernel/list.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct time_simulator;
+
+/*
+ * Gauges are model values sampled at a fixed simulated-time interval.  Each
+ * gauge keeps at most max_buckets min/max/mean buckets; once they fill up
+ * neighbouring buckets are merged in pairs and every bucket covers twice as
+ * many samples, so memory stays bounded however long the run is.
+ *
+ * time_simulator_gauge_write() dumps the series in a columnar layout, all
+ * integers in native byte order:
+ *
+ *	char     magic[8]		"TSGAUGE1"
+ *	uint32_t nr_gauges
+ *	uint32_t nr_buckets
+ *	uint64_t interval		ns between samples
+ *	uint64_t per_bucket		samples per bucket
+ *	nr_gauges times:
+ *		uint16_t len, char name[len]
+ *	uint64_t time[nr_buckets]	start of each bucket
+ *	nr_gauges times:
+ *		uint64_t min[nr_buckets]
+ *		uint64_t max[nr_buckets]
+ *		double   mean[nr_buckets]
+ */
+struct gauge_bucket {
+	uint64_t min;
+	uint64_t max;
+	double sum;
+};
+
+struct gauge {
+	const char *name;
+	uint64_t (*read)(struct time_simulator *s, void *priv);
+	void *priv;
+	uint64_t value;
+	struct gauge_bucket *buckets;
+	struct list_head list;
+};
+
+struct gauges {
+	struct list_head list;
+	uint64_t interval;
+	uint64_t next;
+	uint64_t start;
+	uint64_t per_bucket;
+	uint64_t filled;
+	unsigned int nr_buckets;
+	unsigned int max_buckets;
+	unsigned int gen;		/* bumped whenever gauges come or go */
+};
+
+void __gauges_sample(struct time_simulator *s, struct gauges *g,
+		     uint64_t until);
+
+/* Take every sample due before @until, the model state is constant until then. */
+static inline void gauges_sample(struct time_simulator *s, struct gauges *g,
+				 uint64_t until)
+{
+	if (g->interval && g->next < until)
+		__gauges_sample(s, g, until);
+}
+
+void gauges_init(struct gauges *g);
+void gauges_clear(struct gauges *g);
+
+void time_simulator_gauge_interval(struct time_simulator *s,
+				   uint64_t interval,
+				   unsigned int max_buckets);
+int time_simulator_gauge_add(struct time_simulator *s, const char *name,
+			     uint64_t (*read)(struct time_simulator *s,
+					      void *priv),
+			     void *priv);
+int time_simulator_gauge_write(struct time_simulator *s, const char *path);
+#ifdef __cplusplus
+}
+#endif
+#endif /* _GAUGE_H */
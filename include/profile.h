@@ -0,0 +1,88 @@
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct time_simulator;
+
+/*
+ * Per-callback profiling, only built with --enable-profile.  Otherwise every
+ * hook below compiles away and struct time_simulator just carries a NULL
+ * pointer.  Ticks are inclusive, a run callback that wakes sleepers is also
+ * charged for the predicate calls it triggers.
+ */
+#define PROFILE_FNS 64
+#define PROFILE_BUCKETS 64
+
+struct profile_fn {
+	void *fn;
+	const char *name;
+	uint64_t calls;
+	uint64_t ticks;
+};
+
+struct profile {
+	struct profile_fn fns[PROFILE_FNS];
+	uint64_t depth_hist[PROFILE_BUCKETS];
+	uint64_t pred_hist[PROFILE_BUCKETS];
+	uint64_t wakes;
+	uint64_t preds;
+};
+
+#ifdef TIME_SIMULATOR_PROFILE
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_UNIT "cycles"
+static inline uint64_t profile_ticks(void)
+{
+	return __rdtsc();
+}
+#else
+#include <time.h>
+#define PROFILE_UNIT "ns"
+static inline uint64_t profile_ticks(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+struct profile *profile_alloc(void);
+void profile_account(struct profile *p, void *fn, uint64_t ticks);
+void profile_hist(uint64_t *hist, uint64_t value);
+
+#define PROFILE_CALL(s, fn, call) do {					\
+	uint64_t __start = profile_ticks();				\
+	call;								\
+	profile_account((s)->profile, (void *)(fn),			\
+			profile_ticks() - __start);			\
+} while (0)
+#define PROFILE_HIST(s, hist, value) profile_hist((s)->profile->hist, (value))
+#define PROFILE_ADD(s, field, value) ((s)->profile->field += (value))
+
+void time_simulator_profile_name(struct time_simulator *s, void *fn,
+				 const char *name);
+void time_simulator_profile_print(struct time_simulator *s);
+#else
+#define PROFILE_CALL(s, fn, call) call
+#define PROFILE_HIST(s, hist, value) do { } while (0)
+#define PROFILE_ADD(s, field, value) do { } while (0)
+
+static inline void time_simulator_profile_name(struct time_simulator *s,
+					       void *fn, const char *name)
+{
+}
+static inline void time_simulator_profile_print(struct time_simulator *s)
+{
+}
+#endif /* TIME_SIMULATOR_PROFILE */
+#ifdef __cplusplus
+}
+#endif
+#endif /* _PROFILE_H */
@@ -0,0 +1,45 @@
+#ifndef _QUANTILE_H
+#define _QUANTILE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Streaming quantile estimator using the P^2 algorithm (Jain & Chlamtac).
+ * Constant memory, five markers per tracked quantile, O(1) per sample.
+ */
+struct quantile {
+	double p;
+	double q[5];
+	double np[5];
+	double dn[5];
+	int64_t n[5];
+	uint64_t count;
+};
+
+void quantile_init(struct quantile *q, double p);
+void quantile_add(struct quantile *q, uint64_t value);
+uint64_t quantile_get(struct quantile *q);
+
+/*
+ * The same over recent samples only.  Two estimators run staggered by
+ * @window samples and the older one answers, it is restarted every time it
+ * has seen two windows, so answers cover the last one to two windows.
+ */
+struct quantile_window {
+	struct quantile q[2];
+	uint64_t window;
+	int old;
+};
+
+void quantile_window_init(struct quantile_window *w, double p,
+			  uint64_t window);
+void quantile_window_add(struct quantile_window *w, uint64_t value);
+uint64_t quantile_window_get(struct quantile_window *w);
+#ifdef __cplusplus
+}
+#endif
+#endif /* _QUANTILE_H */
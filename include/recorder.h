@@ -0,0 +1,103 @@
+#ifndef _RECORDER_H
+#define _RECORDER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct time_simulator;
+struct entity;
+
+/*
+ * Flight recorder.  Once enabled every core event, and whatever the model
+ * records with time_simulator_record(), goes into a fixed size ring which
+ * costs one 32 byte store per event.  Nothing is written out until a trigger
+ * fires:
+ *
+ *	max_sleep	an entity is woken after sleeping longer than this
+ *	max_depth	the event queue grows past this many entities
+ *	predicate	a model callback returns true after an event is dispatched
+ *
+ * and then the ring is dumped as text to dir/<label>-<n>.rec, oldest event
+ * first.  After a dump further triggers are ignored for holdoff ns of
+ * simulated time and at most max_dumps are written per run.
+ */
+enum record_type {
+	RECORD_ENQUEUE,
+	RECORD_DISPATCH,
+	RECORD_SLEEP,
+	RECORD_WAKE,
+	RECORD_MODEL,		/* first model defined type */
+};
+
+struct record {
+	uint64_t time;
+	uint64_t entity;
+	uint64_t arg;
+	uint32_t type;
+	uint32_t depth;
+};
+
+struct recorder {
+	struct record *ring;
+	uint64_t head;
+	uint64_t mask;
+
+	uint64_t max_sleep;
+	uint64_t max_depth;
+	bool (*predicate)(struct time_simulator *s, void *priv);
+	void *priv;
+
+	const char *dir;
+	char label[64];
+	const char *const *names;
+	unsigned int nr_names;
+	uint64_t holdoff;
+	uint64_t next_dump;
+	unsigned int nr_dumps;
+	unsigned int max_dumps;
+	unsigned int seq;
+};
+
+#define RECORDER_HOLDOFF NSEC_PER_SEC
+#define RECORDER_MAX_DUMPS 16
+
+static inline void recorder_add(struct recorder *r, uint64_t time,
+				uint32_t type, const void *e, uint64_t arg,
+				uint64_t depth)
+{
+	struct record *rec = &r->ring[r->head++ & r->mask];
+
+	rec->time = time;
+	rec->entity = (uintptr_t)e;
+	rec->arg = arg;
+	rec->type = type;
+	rec->depth = depth;
+}
+
+void recorder_free(struct recorder *r);
+void recorder_reset(struct recorder *r);
+
+/* @nr_records is rounded up to a power of two. */
+int time_simulator_recorder(struct time_simulator *s, unsigned int nr_records,
+			    const char *dir);
+void time_simulator_recorder_triggers(struct time_simulator *s,
+				      uint64_t max_sleep, uint64_t max_depth,
+				      bool (*predicate)(struct time_simulator *s,
+							void *priv),
+				      void *priv);
+/* Names for model types, names[0] is RECORD_MODEL. */
+void time_simulator_recorder_names(struct time_simulator *s,
+				   const char *const *names,
+				   unsigned int nr_names);
+void time_simulator_recorder_label(struct time_simulator *s,
+				   const char *label);
+int time_simulator_recorder_dump(struct time_simulator *s,
+				 const char *reason);
+#ifdef __cplusplus
+}
+#endif
+#endif /* _RECORDER_H */
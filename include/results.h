@@ -0,0 +1,132 @@
+#ifndef _RESULTS_H
+#define _RESULTS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Append-only columnar result tables.  Rows are buffered and written as
+ * chunks, each chunk stores its columns back to back so a reader can mmap
+ * the file and only touch the columns it needs.  Every value is 8 bytes and
+ * every section is 8 byte aligned, all integers in native byte order:
+ *
+ *	char     magic[8]		"TSRES001"
+ *	uint32_t nr_columns
+ *	uint32_t header_size		offset of the first chunk
+ *	nr_columns times:
+ *		uint8_t type, uint8_t len, char name[len]
+ *	padding to header_size
+ *	chunks until EOF:
+ *		uint64_t nr_rows
+ *		uint64_t strtab_size	multiple of 8
+ *		nr_columns times:
+ *			uint64_t/double value[nr_rows]
+ *		char strtab[strtab_size]
+ *
+ * String values are offsets of NUL terminated strings in the chunk's strtab.
+ * Opening an existing file with the same columns appends to it, a torn
+ * chunk at the end from a crashed writer is dropped.
+ */
+enum result_type {
+	RESULT_U64,
+	RESULT_F64,
+	RESULT_STR,
+};
+
+struct result_column {
+	const char *name;
+	enum result_type type;
+};
+
+union result_value {
+	uint64_t u;
+	double f;
+	const char *s;
+};
+
+#define RESULTS_CHUNK_ROWS 4096
+
+struct results {
+	int fd;
+	int nr_columns;
+	const struct result_column *columns;
+	uint64_t rows;
+	unsigned int nr_buffered;
+	uint64_t *data;
+	char *strtab;
+	size_t strtab_len;
+	size_t strtab_size;
+	uint64_t *last_str;
+};
+
+int results_open(struct results *r, const char *path,
+		 const struct result_column *columns, int nr_columns);
+int results_append(struct results *r, const union result_value *row);
+int results_flush(struct results *r);
+int results_close(struct results *r);
+
+/* Rows written so far, including ones already in the file when opened. */
+static inline uint64_t results_rows(struct results *r)
+{
+	return r->rows + r->nr_buffered;
+}
+
+struct results_map {
+	const char *map;
+	size_t size;
+	size_t header_size;
+	int nr_columns;
+	struct result_column *columns;
+};
+
+struct results_chunk {
+	uint64_t nr_rows;
+	const uint64_t *data;
+	const char *strtab;
+	uint64_t strtab_size;
+	size_t next;
+};
+
+int results_map_open(struct results_map *m, const char *path);
+void results_map_close(struct results_map *m);
+int results_map_column(struct results_map *m, const char *name);
+
+/*
+ * Iterate the chunks, start with a zeroed @c.  Returns false at the end of
+ * the file or at a torn chunk.
+ */
+bool results_map_chunk(struct results_map *m, struct results_chunk *c);
+
+static inline uint64_t results_u64(struct results_chunk *c, int col,
+				   uint64_t row)
+{
+	return c->data[col * c->nr_rows + row];
+}
+
+static inline double results_f64(struct results_chunk *c, int col,
+				 uint64_t row)
+{
+	union {
+		uint64_t u;
+		double f;
+	} v = { .u = c->data[col * c->nr_rows + row] };
+
+	return v.f;
+}
+
+static inline const char *results_str(struct results_chunk *c, int col,
+				      uint64_t row)
+{
+	uint64_t off = c->data[col * c->nr_rows + row];
+
+	return off < c->strtab_size ? c->strtab + off : "";
+}
+#ifdef __cplusplus
+}
+#endif
+#endif /* _RESULTS_H */
@@ -0,0 +1,73 @@
+#ifndef _SAMPLER_H
+#define _SAMPLER_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Buffered random sampler.  Four interleaved xoshiro256** generators fill a
+ * block of values at a time with vector code, consumers then pull from the
+ * buffer.  A stream only depends on its seed and stream id, so two streams
+ * seeded the same way always hand out the same values, whatever ISA the
+ * block was generated with.
+ */
+#define SAMPLER_LANES 4
+#define SAMPLER_BLOCK 256
+
+typedef uint64_t sampler_vec_t
+	__attribute__((vector_size(SAMPLER_LANES * sizeof(uint64_t))));
+
+struct sampler {
+	sampler_vec_t s[4];
+	uint64_t buf[SAMPLER_BLOCK];
+	unsigned int pos;
+};
+
+void sampler_init(struct sampler *sm, uint64_t seed, uint64_t stream);
+void __sampler_refill(struct sampler *sm);
+
+static inline uint64_t sampler_next(struct sampler *sm)
+{
+	if (sm->pos == SAMPLER_BLOCK)
+		__sampler_refill(sm);
+	return sm->buf[sm->pos++];
+}
+
+/* The high 64 bits of @a * @b. */
+static inline uint64_t sampler_mul_hi(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+	return ((unsigned __int128)a * b) >> 64;
+#else
+	uint64_t lo = (a & 0xffffffff) * (b & 0xffffffff);
+	uint64_t mid1 = (a >> 32) * (b & 0xffffffff) + (lo >> 32);
+	uint64_t mid2 = (a & 0xffffffff) * (b >> 32) + (mid1 & 0xffffffff);
+
+	return (a >> 32) * (b >> 32) + (mid1 >> 32) + (mid2 >> 32);
+#endif
+}
+
+/*
+ * Uniform in [0, range) by multiply-shift.  Ranges that fit in 32 bits only
+ * use the top half of the draw, so their streams don't change with wider
+ * ranges being allowed.
+ */
+static inline uint64_t sampler_bounded(struct sampler *sm, uint64_t range)
+{
+	if (range <= UINT32_MAX)
+		return ((sampler_next(sm) >> 32) * range) >> 32;
+	return sampler_mul_hi(sampler_next(sm), range);
+}
+
+static inline uint64_t sampler_table(struct sampler *sm, const uint64_t *table,
+				     uint32_t nr)
+{
+	return table[sampler_bounded(sm, nr)];
+}
+#ifdef __cplusplus
+}
+#endif
+#endif /* _SAMPLER_H */
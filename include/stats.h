@@ -0,0 +1,74 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct time_simulator;
+
+/*
+ * Live statistics page.  Once enabled the simulator keeps a stats_page
+ * mapped from a file and rewrites it every STATS_BATCH dispatched events,
+ * when the queue drains and when it is cleared, so another process can map
+ * the same file and watch a long run.  Between publishes the only cost is
+ * comparing the event count.
+ *
+ * The page is a seqlock: seq is odd while an update is in progress, readers
+ * copy the page and retry if seq was odd or changed under them, see
+ * stats_page_read().  Gauges are read at every publish, whatever their
+ * sampling interval, names are only rewritten when the set of gauges
+ * changes.
+ */
+#define STATS_MAGIC "TSSTATS1"
+#define STATS_BATCH 4096
+#define STATS_MAX_GAUGES 16
+#define STATS_NAME_LEN 32
+
+struct stats_gauge {
+	char name[STATS_NAME_LEN];
+	uint64_t value;
+};
+
+struct stats_page {
+	char magic[8];
+	uint32_t pid;
+	uint32_t nr_gauges;
+	uint64_t seq;
+	uint64_t time;			/* simulated ns */
+	uint64_t events;		/* dispatched, over all runs */
+	uint64_t events_per_sec;	/* since the previous publish */
+	uint64_t queued;
+	uint64_t sleepers;
+	uint64_t runs;			/* times the simulator was cleared */
+	uint64_t wall;			/* CLOCK_REALTIME ns of this publish */
+	struct stats_gauge gauges[STATS_MAX_GAUGES];
+};
+
+struct stats {
+	struct stats_page *page;
+	uint64_t next;			/* event count to publish at */
+	uint64_t last_events;
+	uint64_t last_wall;
+	unsigned int gauges_gen;
+};
+
+void __stats_publish(struct time_simulator *s);
+void stats_free(struct stats *st);
+
+int time_simulator_stats(struct time_simulator *s, const char *path);
+
+/*
+ * Map a stats file read only, and take a consistent copy of it, which gives
+ * up with -EAGAIN if the writer never finishes its update.
+ */
+struct stats_page *stats_page_map(const char *path);
+void stats_page_unmap(struct stats_page *page);
+int stats_page_read(const struct stats_page *page, struct stats_page *copy);
+#ifdef __cplusplus
+}
+#endif
+#endif /* _STATS_H */
@@ -0,0 +1,256 @@
+#ifndef _TIME_SIMULATOR_CORO_HPP
+#define _TIME_SIMULATOR_CORO_HPP
+
+#include <time-simulator.hpp>
+#include <coroutine>
+#include <exception>
+#include <new>
+#include <utility>
+
+/*
+ * C++20 coroutine entities.  A ts::process is a coroutine that can
+ *
+ *	co_await ts::sleep_for(delta);
+ *	co_await ts::wait_until(counter, value);
+ *	co_await ts::lock(mutex);
+ *
+ * and is driven by a ts::coro_entity, whose run() simply resumes it when its
+ * event fires.  Frames come from ts::frame_pool so suspending and finishing
+ * processes does not hit the heap once the pool is warm.
+ */
+namespace ts {
+
+class frame_pool {
+public:
+	static constexpr size_t granule = 64;
+	static constexpr size_t nr_classes = 64;
+
+	static void *alloc(size_t size)
+	{
+		size_t c = (size + granule - 1) / granule;
+		void *p;
+
+		if (c >= nr_classes)
+			return ::operator new(size);
+		p = free_[c];
+		if (!p)
+			return ::operator new(c * granule);
+		free_[c] = *static_cast<void **>(p);
+		return p;
+	}
+
+	static void release(void *p, size_t size)
+	{
+		size_t c = (size + granule - 1) / granule;
+
+		if (c >= nr_classes) {
+			::operator delete(p);
+			return;
+		}
+		*static_cast<void **>(p) = free_[c];
+		free_[c] = p;
+	}
+
+private:
+	static inline thread_local void *free_[nr_classes];
+};
+
+class coro_entity;
+
+class process {
+public:
+	struct promise_type {
+		coro_entity *owner = nullptr;
+
+		process get_return_object()
+		{
+			return process(handle::from_promise(*this));
+		}
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_always final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+
+		static void *operator new(size_t size)
+		{
+			return frame_pool::alloc(size);
+		}
+		static void operator delete(void *p, size_t size)
+		{
+			frame_pool::release(p, size);
+		}
+	};
+	using handle = std::coroutine_handle<promise_type>;
+
+	process(process &&o) noexcept : h_(std::exchange(o.h_, {})) {}
+	process(const process &) = delete;
+	~process()
+	{
+		if (h_)
+			h_.destroy();
+	}
+
+	handle release() { return std::exchange(h_, {}); }
+
+private:
+	explicit process(handle h) : h_(h) {}
+	handle h_;
+};
+
+class coro_entity : public entity<coro_entity> {
+public:
+	coro_entity() = default;
+	coro_entity(const coro_entity &) = delete;
+	/*
+	 * Unlinks itself from whatever it sleeps on and, while its simulator
+	 * still has it, from the simulator's lists.  Once the simulator is
+	 * cleared main_list is empty and the simulator may be gone.  It has to
+	 * be off the event queue, there is no taking an event back.
+	 */
+	~coro_entity()
+	{
+		if (h_)
+			h_.destroy();
+		if (main_list.next && !list_empty(&main_list)) {
+			if (!list_empty(&list))
+				s_->nr_sleepers--;
+			list_del_init(&main_list);
+		}
+		if (list.next)
+			list_del_init(&list);
+	}
+
+	/* Run @p from the current simulated time on. */
+	void start(struct time_simulator *s, process p)
+	{
+		s_ = s;
+		h_ = p.release();
+		h_.promise().owner = this;
+		enqueue(s, 0);
+	}
+
+	void run(struct time_simulator *s)
+	{
+		h_.resume();
+		if (h_.done()) {
+			h_.destroy();
+			h_ = {};
+		}
+	}
+
+	bool done() const { return !h_; }
+	struct time_simulator *sim() const { return s_; }
+
+	/* Used by the awaitables below. */
+	uint64_t wait_value = 0;
+
+private:
+	struct time_simulator *s_ = nullptr;
+	process::handle h_;
+};
+
+/* A monotonically increasing value processes can wait on. */
+class counter {
+public:
+	counter() { INIT_LIST_HEAD(&waiters_); }
+	counter(const counter &) = delete;
+
+	uint64_t value() const { return v_; }
+
+	void add(uint64_t n)
+	{
+		::entity *e, *tmp;
+
+		v_ += n;
+		list_for_each_entry_safe(e, tmp, &waiters_, list) {
+			coro_entity *c = static_cast<coro_entity *>(e);
+
+			if (c->wait_value <= v_)
+				entity_wake(c->sim(), e, 0);
+		}
+	}
+
+	struct list_head *waiters() { return &waiters_; }
+
+private:
+	uint64_t v_ = 0;
+	struct list_head waiters_;
+};
+
+/* FIFO mutex, unlock hands the lock straight to the oldest waiter. */
+class mutex {
+public:
+	mutex() { INIT_LIST_HEAD(&waiters_); }
+	mutex(const mutex &) = delete;
+
+	bool try_lock()
+	{
+		if (locked_)
+			return false;
+		locked_ = true;
+		return true;
+	}
+
+	void unlock()
+	{
+		::entity *e;
+
+		if (list_empty(&waiters_)) {
+			locked_ = false;
+			return;
+		}
+		e = list_first_entry(&waiters_, ::entity, list);
+		entity_wake(static_cast<coro_entity *>(e)->sim(), e, 0);
+	}
+
+	bool locked() const { return locked_; }
+	struct list_head *waiters() { return &waiters_; }
+
+private:
+	bool locked_ = false;
+	struct list_head waiters_;
+};
+
+struct sleep_for {
+	uint64_t delta;
+
+	bool await_ready() const noexcept { return false; }
+	void await_suspend(process::handle h)
+	{
+		coro_entity *c = h.promise().owner;
+
+		c->enqueue(c->sim(), delta);
+	}
+	void await_resume() const noexcept {}
+};
+
+struct wait_until {
+	counter &c;
+	uint64_t value;
+
+	bool await_ready() const noexcept { return c.value() >= value; }
+	void await_suspend(process::handle h)
+	{
+		coro_entity *e = h.promise().owner;
+
+		e->wait_value = value;
+		entity_sleep_on(e->sim(), e, c.waiters());
+	}
+	void await_resume() const noexcept {}
+};
+
+struct lock {
+	mutex &m;
+
+	bool await_ready() { return m.try_lock(); }
+	void await_suspend(process::handle h)
+	{
+		coro_entity *e = h.promise().owner;
+
+		entity_sleep_on(e->sim(), e, m.waiters());
+	}
+	void await_resume() const noexcept {}
+};
+
+} /* namespace ts */
+#endif /* _TIME_SIMULATOR_CORO_HPP */
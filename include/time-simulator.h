@@ -1,12 +1,23 @@
 #ifndef _TIME_SIMULATOR_H
 #define _TIME_SIMULATOR_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <kernel/list.h>
-#include <kernel/rbtree_augmented.h>
+#include <kernel/rbtree.h>
+#include <checkpoint.h>
+#include <gauge.h>
+#include <profile.h>
+#include <recorder.h>
+#include <stats.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 struct entity;
+struct calendar;
 
 #define NSEC_PER_SEC 1000000000
 #define NSEC_PER_USEC 1000
@@ -16,23 +27,60 @@ enum entity_state {
 	ENTITY_SLEEPING,
 };
 
+/*
+ * Entities due at the same time run lane by lane, and within a lane in the
+ * order they were enqueued.  entity_init() puts an entity in the normal
+ * lane, the library's own device completions and bucket timers go in the
+ * high one.
+ */
+enum entity_lane {
+	ENTITY_LANE_HIGH,
+	ENTITY_LANE_NORMAL,
+	ENTITY_LANE_LOW,
+	NR_ENTITY_LANES,
+};
+
+/*
+ * Models may tag entities with an event class, 0 unless they do, to ask for
+ * the earliest queued event of a class.  Set it before queueing the entity.
+ * Classes from NR_EVENT_CLASSES up are in no class and never found.
+ */
+#define NR_EVENT_CLASSES 32
+
 struct time_simulator {
 	uint64_t time;
 	struct rb_root entities;
-	struct list_head resched;
 	struct list_head sleepers;
 	struct list_head entity_list;
-	bool running;
+	struct gauges gauges;
+	struct profile *profile;
+	struct recorder *recorder;
+	struct stats *stats;
+	struct checkpointer *ckpt;
+	struct calendar *cal;		/* time quantized queue, if any */
+	bool lookahead;			/* keeping the tree's aggregates */
+	uint64_t nr_sleepers;
+	uint64_t nr_queued;
+	uint64_t nr_dispatched;		/* never reset, diff it around a run */
+	uint64_t nr_clears;
+	uint64_t seq;
 	void (*free_entity)(struct entity *e);
 };
 
 struct entity {
 	uint64_t wake_time;
+	uint64_t seq;
+	enum entity_lane lane;
+	unsigned int event_class;
 	uint64_t start_time;
 	uint64_t sleep_time;
 	uint64_t run_time;
 	struct rb_node n;
-	struct entity_ops *ops;
+	struct entity *cal_next;	/* in its calendar bucket */
+	/* Over the subtree under n: queued entities and a mask of their classes */
+	uint32_t subtree_nr;
+	uint32_t subtree_classes;
+	const struct entity_ops *ops;
 	struct list_head list;
 	struct list_head main_list;
 	enum entity_state state;
@@ -41,14 +89,74 @@ struct entity {
 
 struct time_simulator *
 time_simulator_alloc(void (*free_entity)(struct entity *e));
+void time_simulator_free(struct time_simulator *s);
 void time_simulator_run(struct time_simulator *s, uint64_t time);
+struct entity *time_simulator_next(struct time_simulator *s, uint64_t end);
 void time_simulator_clear(struct time_simulator *s);
+/*
+ * Round every wake time up to a multiple of @quantum and queue events in a
+ * calendar, see calendar.h, 0 or 1 goes back to exact times.  @horizon is
+ * how far ahead most events are queued, the calendar's ring covers that
+ * much.  Only while nothing is queued, -EBUSY otherwise.
+ */
+int time_simulator_quantize(struct time_simulator *s, uint64_t quantum,
+			    uint64_t horizon);
+void time_simulator_print_quantum(struct time_simulator *s);
+/* Everything queued, in no particular order. */
+void time_simulator_for_each_queued(struct time_simulator *s,
+				    void (*fn)(struct entity *e, void *priv),
+				    void *priv);
+/*
+ * Looking ahead at the queue.  With lookahead on both are O(log n), off
+ * they walk the queue in order up to the answer.  Keeping the aggregates
+ * up to date costs every enqueue and dispatch a walk up the tree, so it's
+ * only done when asked for, and only while nothing is queued, -EBUSY
+ * otherwise.  The calendar keeps no aggregates, so lookahead and a quantum
+ * rule each other out, -EINVAL from whichever is asked for second.
+ */
+int time_simulator_lookahead(struct time_simulator *s, bool on);
+/* How many queued events are due at or before @time. */
+uint64_t time_simulator_nr_due(struct time_simulator *s, uint64_t time);
+/* The queued entity of @event_class that will run first, if any. */
+struct entity *time_simulator_earliest(struct time_simulator *s,
+				       unsigned int event_class);
 void time_simulator_wake(struct time_simulator *s,
 			 uint64_t (*wake)(struct time_simulator *s,
 					  struct entity *e));
+void time_simulator_wake_queue(struct time_simulator *s,
+			       struct list_head *queue,
+			       uint64_t (*wake)(struct time_simulator *s,
+						struct entity *e));
 
 void entity_init(struct time_simulator *s, struct entity *e);
+/* Queue @e by the key it already has, for restoring checkpoints. */
+void __entity_insert(struct time_simulator *s, struct entity *e);
+/* Drop everything queued and restart the queue at s->time. */
+void __queue_clear(struct time_simulator *s);
 void entity_enqueue(struct time_simulator *s, struct entity *e, uint64_t delta);
 void entity_sleep(struct time_simulator *s, struct entity *e);
+void entity_sleep_on(struct time_simulator *s, struct entity *e,
+		     struct list_head *queue);
+void entity_wake(struct time_simulator *s, struct entity *e, uint64_t delta);
 void time_simulator_print_entity_times(struct time_simulator *s);
+
+/* Add a model event to the flight recorder, if there is one. */
+static inline void time_simulator_record(struct time_simulator *s,
+					 uint32_t type, const void *e,
+					 uint64_t arg)
+{
+	if (s->recorder)
+		recorder_add(s->recorder, s->time, type, e, arg,
+			     s->nr_queued);
+}
+
+/* Rewrite the stats page once a batch of events went by. */
+static inline void stats_publish(struct time_simulator *s)
+{
+	if (s->stats && s->nr_dispatched >= s->stats->next)
+		__stats_publish(s);
+}
+#ifdef __cplusplus
+}
+#endif
 #endif /* _TIME_SIMULATOR_H */
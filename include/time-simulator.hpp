@@ -0,0 +1,105 @@
+#ifndef _TIME_SIMULATOR_HPP
+#define _TIME_SIMULATOR_HPP
+
+#include <time-simulator.h>
+#include <new>
+#include <type_traits>
+
+/*
+ * Header only C++17 front end.  Entities are CRTP types built on the C
+ * struct entity, ts::simulator<Es...> pulls events off the C queue itself and
+ * turns the run pointer into a compare against each of Es, so their run()
+ * is a direct call the compiler can inline.  Anything else, C entities
+ * included, still goes through its run pointer.
+ */
+namespace ts {
+
+template <typename Derived>
+struct entity : ::entity {
+	entity() : ::entity() {}
+
+	static void trampoline(struct time_simulator *s, ::entity *e)
+	{
+		static_cast<Derived *>(e)->run(s);
+	}
+
+	void enqueue(struct time_simulator *s, uint64_t delta)
+	{
+		entity_enqueue(s, this, delta);
+	}
+
+	void sleep(struct time_simulator *s)
+	{
+		entity_sleep(s, this);
+	}
+};
+
+template <typename... Es>
+class simulator {
+public:
+	explicit simulator(void (*free_entity)(::entity *e) = free_nothing)
+		: s_(time_simulator_alloc(free_entity))
+	{
+		if (!s_)
+			throw std::bad_alloc();
+	}
+
+	~simulator()
+	{
+		time_simulator_clear(s_);
+		time_simulator_free(s_);
+	}
+
+	simulator(const simulator &) = delete;
+	simulator &operator=(const simulator &) = delete;
+
+	struct time_simulator *get() { return s_; }
+	uint64_t time() const { return s_->time; }
+
+	/* The simulator does not own @e, it has to outlive the run. */
+	template <typename E>
+	void add(E &e)
+	{
+		static_assert(std::is_base_of_v<entity<E>, E>,
+			      "entities must derive from ts::entity<E>");
+		::entity &base = e;
+
+		entity_init(s_, &base);
+		base.run = &E::trampoline;
+	}
+
+	void run(uint64_t time = 0)
+	{
+		::entity *e;
+
+		if (time)
+			time += s_->time;
+		while ((e = time_simulator_next(s_, time)))
+			dispatch(e);
+	}
+
+	void clear() { time_simulator_clear(s_); }
+
+private:
+	static void free_nothing(::entity *e) {}
+
+	template <typename E>
+	bool try_run(::entity *e)
+	{
+		if (e->run != &E::trampoline)
+			return false;
+		static_cast<E *>(e)->run(s_);
+		return true;
+	}
+
+	void dispatch(::entity *e)
+	{
+		if (!(try_run<Es>(e) || ...))
+			e->run(s_, e);
+	}
+
+	struct time_simulator *s_;
+};
+
+} /* namespace ts */
+#endif /* _TIME_SIMULATOR_HPP */
@@ -0,0 +1,30 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+/*
+ * USDT probes, only compiled in when <sys/sdt.h> is available.  Each probe is
+ * a single nop in the text until something attaches, e.g.
+ *
+ *	bpftrace -e 'usdt:./btrfs-throttle:time_simulator:wake
+ *		{ @slept = hist(arg2); }'
+ *
+ * Core probes (provider time_simulator) take entity, time, delta:
+ *	enqueue		delta until the entity runs
+ *	dispatch	time since the entity was enqueued
+ *	sleep		time since the entity was last enqueued
+ *	wake		time spent sleeping
+ *	clear		simulator, time, number of queued entities
+ *
+ * btrfs-throttle adds (provider btrfs_throttle) entity, time and:
+ *	flush		cost of the ref being flushed
+ *	throttle	refs the worker waits for
+ *	commit		refs outstanding when the commit starts
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE3(provider, name, a, b, c) DTRACE_PROBE3(provider, name, a, b, c)
+#else
+#define TRACE3(provider, name, a, b, c) do { } while (0)
+#endif
+
+#endif /* _TRACE_H */
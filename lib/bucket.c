@@ -0,0 +1,198 @@
+#include <bucket.h>
+#include <errno.h>
+#include <string.h>
+
+static void bucket_timer(struct time_simulator *s, struct entity *e);
+
+void bucket_init(struct bucket *b, enum bucket_type type, uint64_t rate,
+		 uint64_t size)
+{
+	memset(b, 0, sizeof(*b));
+	b->type = type;
+	b->rate = rate;
+	b->size = size;
+	if (type == BUCKET_TOKEN)
+		b->level = size * NSEC_PER_SEC;
+	INIT_LIST_HEAD(&b->waiters);
+	INIT_LIST_HEAD(&b->sleepers);
+	RB_CLEAR_NODE(&b->timer.n);
+	INIT_LIST_HEAD(&b->timer.list);
+	b->timer.run = bucket_timer;
+	b->timer.lane = ENTITY_LANE_HIGH;
+}
+
+/* Bring the level up to date, rate tokens per second is rate per ns here. */
+static void bucket_refill(struct time_simulator *s, struct bucket *b)
+{
+	uint64_t elapsed = s->time - b->last;
+	uint64_t delta;
+
+	b->last = s->time;
+	if (elapsed > UINT64_MAX / b->rate)
+		delta = UINT64_MAX;
+	else
+		delta = elapsed * b->rate;
+
+	if (b->type == BUCKET_LEAKY) {
+		b->level = b->level > delta ? b->level - delta : 0;
+		return;
+	}
+	if (delta > b->size * NSEC_PER_SEC - b->level)
+		b->level = b->size * NSEC_PER_SEC;
+	else
+		b->level += delta;
+}
+
+static bool bucket_ready(struct time_simulator *s, struct bucket *b,
+			 struct bucket_waiter *w)
+{
+	if (b->type == BUCKET_LEAKY)
+		return w->deadline <= s->time;
+	return b->level >= w->tokens * NSEC_PER_SEC;
+}
+
+/* Time until @w can go, rounded up so it never fires early. */
+static uint64_t bucket_delay(struct time_simulator *s, struct bucket *b,
+			     struct bucket_waiter *w)
+{
+	uint64_t need;
+
+	if (b->type == BUCKET_LEAKY)
+		return w->deadline - s->time;
+	need = w->tokens * NSEC_PER_SEC - b->level;
+	return (need + b->rate - 1) / b->rate;
+}
+
+static void bucket_grant(struct time_simulator *s, struct bucket *b,
+			 struct bucket_waiter *w)
+{
+	if (b->type == BUCKET_TOKEN)
+		b->level -= w->tokens * NSEC_PER_SEC;
+	b->stats.tokens += w->tokens;
+}
+
+static void bucket_arm(struct time_simulator *s, struct bucket *b)
+{
+	struct bucket_waiter *w;
+
+	if (b->timer_armed || list_empty(&b->waiters))
+		return;
+	w = list_first_entry(&b->waiters, struct bucket_waiter, list);
+	b->timer_armed = true;
+	entity_enqueue(s, &b->timer, bucket_delay(s, b, w));
+}
+
+static void bucket_timer(struct time_simulator *s, struct entity *e)
+{
+	struct bucket *b = container_of(e, struct bucket, timer);
+	struct bucket_waiter *w, *tmp;
+
+	b->timer_armed = false;
+	bucket_refill(s, b);
+	list_for_each_entry_safe(w, tmp, &b->waiters, list) {
+		uint64_t wait = s->time - w->start;
+
+		if (!bucket_ready(s, b, w))
+			break;
+		list_del_init(&w->list);
+		b->nr_waiters--;
+		bucket_grant(s, b, w);
+		b->stats.wait_time += wait;
+		if (wait > b->stats.max_wait)
+			b->stats.max_wait = wait;
+		entity_wake(s, w->e, 0);
+	}
+	bucket_arm(s, b);
+}
+
+int bucket_get(struct time_simulator *s, struct bucket *b,
+	       struct bucket_waiter *w, struct entity *e, uint64_t tokens)
+{
+	bucket_refill(s, b);
+	b->stats.requests++;
+	w->e = e;
+	w->tokens = tokens;
+	w->start = s->time;
+
+	if (b->type == BUCKET_TOKEN) {
+		if (tokens > b->size)
+			return -EINVAL;
+	} else {
+		if (b->size && tokens * NSEC_PER_SEC >
+		    b->size * NSEC_PER_SEC - b->level) {
+			b->stats.overflows++;
+			return -ENOSPC;
+		}
+		w->deadline = s->time + (b->level + b->rate - 1) / b->rate;
+		b->level += tokens * NSEC_PER_SEC;
+	}
+
+	if (list_empty(&b->waiters) && bucket_ready(s, b, w)) {
+		bucket_grant(s, b, w);
+		b->stats.immediate++;
+		return 1;
+	}
+
+	list_add_tail(&w->list, &b->waiters);
+	if (++b->nr_waiters > b->stats.max_waiters)
+		b->stats.max_waiters = b->nr_waiters;
+	b->stats.waits++;
+	entity_sleep_on(s, e, &b->sleepers);
+	bucket_arm(s, b);
+	return 0;
+}
+
+uint64_t bucket_level(struct time_simulator *s, struct bucket *b)
+{
+	bucket_refill(s, b);
+	return b->level / NSEC_PER_SEC;
+}
+
+/* Waiters live with their entities, so they are saved as offsets from them. */
+static void checkpoint_waiters(struct checkpoint *c, struct bucket *b)
+{
+	struct bucket_waiter *w;
+	uint64_t nr = b->nr_waiters, offset;
+	struct entity *e;
+
+	if (!c->load) {
+		list_for_each_entry(w, &b->waiters, list) {
+			e = w->e;
+			offset = (char *)w - (char *)e;
+			checkpoint_ref(c, &e);
+			checkpoint_var(c, offset);
+			checkpoint_var(c, w->tokens);
+			checkpoint_var(c, w->start);
+			checkpoint_var(c, w->deadline);
+		}
+		return;
+	}
+
+	INIT_LIST_HEAD(&b->waiters);
+	while (nr-- && !c->error) {
+		checkpoint_ref(c, &e);
+		checkpoint_var(c, offset);
+		if (!c->error && !e)
+			c->error = -EINVAL;
+		if (c->error)
+			return;
+		w = (struct bucket_waiter *)((char *)e + offset);
+		w->e = e;
+		checkpoint_var(c, w->tokens);
+		checkpoint_var(c, w->start);
+		checkpoint_var(c, w->deadline);
+		list_add_tail(&w->list, &b->waiters);
+	}
+}
+
+void bucket_checkpoint(struct checkpoint *c, struct bucket *b)
+{
+	checkpoint_var(c, b->level);
+	checkpoint_var(c, b->last);
+	checkpoint_var(c, b->nr_waiters);
+	checkpoint_var(c, b->timer_armed);
+	checkpoint_var(c, b->stats);
+	checkpoint_entity_state(c, &b->timer);
+	checkpoint_list(c, &b->sleepers, CHECKPOINT_ENTITY_LIST);
+	checkpoint_waiters(c, b);
+}
@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+#include <cache.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC "TSCACHE1"
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+void cache_key_init(struct cache_key *k)
+{
+	memset(k, 0, sizeof(*k));
+}
+
+void cache_key_free(struct cache_key *k)
+{
+	free(k->buf);
+	memset(k, 0, sizeof(*k));
+}
+
+void cache_key_add(struct cache_key *k, const void *data, size_t len)
+{
+	if (k->error)
+		return;
+	if (k->len + len > k->size) {
+		size_t size = k->size ? k->size : 256;
+		unsigned char *buf;
+
+		while (size < k->len + len)
+			size *= 2;
+		buf = realloc(k->buf, size);
+		if (!buf) {
+			k->error = -ENOMEM;
+			return;
+		}
+		k->buf = buf;
+		k->size = size;
+	}
+	memcpy(k->buf + k->len, data, len);
+	k->len += len;
+}
+
+void cache_key_add_u64(struct cache_key *k, uint64_t v)
+{
+	cache_key_add(k, &v, sizeof(v));
+}
+
+/* Length prefixed so "ab" + "c" and "a" + "bc" make different keys. */
+void cache_key_add_str(struct cache_key *k, const char *str)
+{
+	size_t len = strlen(str);
+
+	cache_key_add_u64(k, len);
+	cache_key_add(k, str, len);
+}
+
+/* FNV-1a, seed with 0 to start a new hash. */
+uint64_t cache_hash(const void *data, size_t len, uint64_t hash)
+{
+	const unsigned char *p = data;
+	size_t i;
+
+	if (!hash)
+		hash = FNV_OFFSET;
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+static uint64_t hash_file(const char *path, uint64_t hash)
+{
+	char buf[65536];
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return cache_hash(path, strlen(path), hash);
+	while ((ret = read(fd, buf, sizeof(buf))) > 0)
+		hash = cache_hash(buf, ret, hash);
+	close(fd);
+	return hash;
+}
+
+static int hash_object(struct dl_phdr_info *info, size_t size, void *priv)
+{
+	uint64_t *hash = priv;
+	const char *name = info->dlpi_name;
+
+	if (!name || !*name)
+		name = "/proc/self/exe";
+	else if (name[0] != '/')
+		return 0;
+	*hash = hash_file(name, *hash);
+	return 0;
+}
+
+uint64_t cache_build_id(void)
+{
+	static uint64_t build_id;
+
+	if (!build_id) {
+		uint64_t hash = 0;
+
+		dl_iterate_phdr(hash_object, &hash);
+		build_id = hash ? hash : 1;
+	}
+	return build_id;
+}
+
+static int entry_path(const char *dir, struct cache_key *k, char *path,
+		      size_t size)
+{
+	int ret;
+
+	ret = snprintf(path, size, "%s/%016llx", dir,
+		       (unsigned long long)cache_hash(k->buf, k->len, 0));
+	if (ret >= size)
+		return -ENAMETOOLONG;
+	return 0;
+}
+
+/*
+ * An entry is
+ *
+ *	char     magic[8]	"TSCACHE1"
+ *	uint64_t key_len
+ *	uint64_t data_len
+ *	char     key[key_len]
+ *	char     data[data_len]
+ */
+int cache_load(const char *dir, struct cache_key *k, void **data,
+	       size_t *len)
+{
+	char path[PATH_MAX];
+	char magic[8];
+	uint64_t hdr[2];
+	void *key = NULL, *buf = NULL;
+	FILE *f;
+	int ret;
+
+	if (k->error)
+		return k->error;
+	ret = entry_path(dir, k, path, sizeof(path));
+	if (ret)
+		return ret;
+	f = fopen(path, "r");
+	if (!f)
+		return -ENOENT;
+
+	ret = -ENOENT;
+	if (fread(magic, sizeof(magic), 1, f) != 1 ||
+	    memcmp(magic, CACHE_MAGIC, sizeof(magic)) ||
+	    fread(hdr, sizeof(hdr), 1, f) != 1 || hdr[0] != k->len)
+		goto out;
+	key = malloc(k->len);
+	buf = malloc(hdr[1] ? hdr[1] : 1);
+	if (!key || !buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (fread(key, k->len, 1, f) != 1 || memcmp(key, k->buf, k->len))
+		goto out;
+	if (hdr[1] && fread(buf, hdr[1], 1, f) != 1)
+		goto out;
+	*data = buf;
+	*len = hdr[1];
+	buf = NULL;
+	ret = 0;
+out:
+	free(key);
+	free(buf);
+	fclose(f);
+	return ret;
+}
+
+/* Written to a temporary name and renamed, readers never see half an entry. */
+int cache_store(const char *dir, struct cache_key *k, const void *data,
+		size_t len)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 8];
+	uint64_t hdr[2] = { k->len, len };
+	FILE *f;
+	int fd, ret;
+
+	if (k->error)
+		return k->error;
+	ret = entry_path(dir, k, path, sizeof(path));
+	if (ret)
+		return ret;
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return -errno;
+	f = fdopen(fd, "w");
+	if (!f) {
+		ret = -errno;
+		close(fd);
+		unlink(tmp);
+		return ret;
+	}
+	fwrite(CACHE_MAGIC, 8, 1, f);
+	fwrite(hdr, sizeof(hdr), 1, f);
+	fwrite(k->buf, k->len, 1, f);
+	fwrite(data, len, 1, f);
+	if (ferror(f))
+		ret = -EIO;
+	if (fclose(f) && !ret)
+		ret = -errno;
+	if (!ret && rename(tmp, path))
+		ret = -errno;
+	if (ret)
+		unlink(tmp);
+	return ret;
+}
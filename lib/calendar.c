@@ -0,0 +1,217 @@
+#include <calendar.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CALENDAR_MASK(cal) ((cal)->nr_buckets - 1)
+#define CALENDAR_WORDS(cal) ((cal)->nr_buckets / 64)
+#define CALENDAR_SUMMARY(cal) ((CALENDAR_WORDS(cal) + 63) / 64)
+
+struct calendar *calendar_alloc(uint64_t quantum, uint64_t horizon)
+{
+	struct calendar *cal = calloc(1, sizeof(*cal));
+	unsigned int shift = CALENDAR_MIN_SHIFT;
+	uint64_t quanta = horizon / quantum;
+
+	if (!cal)
+		return NULL;
+	while (shift < CALENDAR_MAX_SHIFT && (1ULL << shift) <= quanta)
+		shift++;
+	cal->quantum = quantum;
+	cal->horizon = horizon;
+	cal->nr_buckets = 1U << shift;
+	cal->later = RB_ROOT;
+	cal->buckets = calloc(cal->nr_buckets, sizeof(*cal->buckets));
+	cal->used = calloc(CALENDAR_WORDS(cal), sizeof(*cal->used));
+	cal->used_words = calloc(CALENDAR_SUMMARY(cal),
+				 sizeof(*cal->used_words));
+	if (!cal->buckets || !cal->used || !cal->used_words) {
+		calendar_free(cal);
+		return NULL;
+	}
+	return cal;
+}
+
+void calendar_free(struct calendar *cal)
+{
+	if (!cal)
+		return;
+	free(cal->buckets);
+	free(cal->used);
+	free(cal->used_words);
+	free(cal);
+}
+
+static void bucket_set(struct calendar *cal, unsigned int i)
+{
+	cal->used[i / 64] |= 1ULL << (i % 64);
+	cal->used_words[i / 4096] |= 1ULL << (i / 64 % 64);
+}
+
+static void bucket_clear(struct calendar *cal, unsigned int i)
+{
+	cal->used[i / 64] &= ~(1ULL << (i % 64));
+	if (!cal->used[i / 64])
+		cal->used_words[i / 4096] &= ~(1ULL << (i / 64 % 64));
+}
+
+/* First used bucket at or after @i, cal->nr_buckets if there is none. */
+static unsigned int bucket_next(struct calendar *cal, unsigned int i)
+{
+	unsigned int word = i / 64;
+	uint64_t bits;
+	unsigned int sw;
+
+	if (i >= cal->nr_buckets)
+		return cal->nr_buckets;
+	bits = cal->used[word] & (~0ULL << (i % 64));
+	if (bits)
+		return word * 64 + __builtin_ctzll(bits);
+	word++;
+	for (sw = word / 64; sw < CALENDAR_SUMMARY(cal); sw++) {
+		bits = cal->used_words[sw];
+		if (sw == word / 64)
+			bits &= ~0ULL << (word % 64);
+		if (bits) {
+			word = sw * 64 + __builtin_ctzll(bits);
+			return word * 64 + __builtin_ctzll(cal->used[word]);
+		}
+	}
+	return cal->nr_buckets;
+}
+
+void calendar_reset(struct calendar *cal, uint64_t time)
+{
+	unsigned int i;
+
+	for (i = bucket_next(cal, 0); i < cal->nr_buckets;
+	     i = bucket_next(cal, i + 1)) {
+		cal->buckets[i].head = NULL;
+		cal->buckets[i].tail = NULL;
+	}
+	memset(cal->used, 0, CALENDAR_WORDS(cal) * sizeof(*cal->used));
+	memset(cal->used_words, 0,
+	       CALENDAR_SUMMARY(cal) * sizeof(*cal->used_words));
+	cal->nr = 0;
+	cal->base = time / cal->quantum;
+}
+
+bool calendar_add(struct calendar *cal, struct entity *e)
+{
+	uint64_t q = e->wake_time / cal->quantum;
+	unsigned int i = q & CALENDAR_MASK(cal);
+	struct calendar_bucket *b = &cal->buckets[i];
+
+	if (q - cal->base >= cal->nr_buckets)
+		return false;
+	e->cal_next = NULL;
+	if (b->tail) {
+		b->tail->cal_next = e;
+	} else {
+		b->head = e;
+		bucket_set(cal, i);
+	}
+	b->tail = e;
+	cal->nr++;
+	return true;
+}
+
+struct entity *calendar_first(struct calendar *cal)
+{
+	unsigned int i = bucket_next(cal, cal->base & CALENDAR_MASK(cal));
+	struct entity *e;
+
+	/* Buckets below the current one are the far end of the ring. */
+	if (i == cal->nr_buckets)
+		i = bucket_next(cal, 0);
+	cal->cur_bucket = i;
+	e = cal->buckets[i].head;
+	if (e->cal_next)
+		__builtin_prefetch(e->cal_next);
+	return e;
+}
+
+void calendar_del_first(struct calendar *cal, struct entity *e)
+{
+	struct calendar_bucket *b = &cal->buckets[cal->cur_bucket];
+
+	cal->nr--;
+	b->head = e->cal_next;
+	if (b->head)
+		return;
+	b->tail = NULL;
+	bucket_clear(cal, cal->cur_bucket);
+}
+
+/*
+ * The next used bucket at least @off buckets into the ring, as its distance
+ * from the start of the ring, cal->nr_buckets if there is none.
+ */
+static unsigned int bucket_next_off(struct calendar *cal, unsigned int off)
+{
+	unsigned int start = cal->base & CALENDAR_MASK(cal);
+	unsigned int i;
+
+	if (off >= cal->nr_buckets)
+		return cal->nr_buckets;
+	i = bucket_next(cal, (start + off) & CALENDAR_MASK(cal));
+	if (start + off < cal->nr_buckets) {
+		if (i < cal->nr_buckets)
+			return i - start;
+		i = bucket_next(cal, 0);
+	}
+	return i < start ? i + cal->nr_buckets - start : cal->nr_buckets;
+}
+
+#define for_each_bucket(cal, off) \
+	for (off = bucket_next_off(cal, 0); off < (cal)->nr_buckets; \
+	     off = bucket_next_off(cal, off + 1))
+
+static inline struct entity *bucket_head(struct calendar *cal,
+					 unsigned int off)
+{
+	return cal->buckets[(cal->base + off) & CALENDAR_MASK(cal)].head;
+}
+
+void calendar_for_each(struct calendar *cal,
+		       void (*fn)(struct entity *e, void *priv), void *priv)
+{
+	struct entity *e, *next;
+	unsigned int off;
+
+	/* @fn may queue @e elsewhere, so step past it first. */
+	for_each_bucket(cal, off) {
+		for (e = bucket_head(cal, off); e; e = next) {
+			next = e->cal_next;
+			fn(e, priv);
+		}
+	}
+}
+
+/* Every entity in a bucket is due at the bucket's own quantum. */
+uint64_t calendar_nr_due(struct calendar *cal, uint64_t time)
+{
+	struct entity *e;
+	unsigned int off;
+	uint64_t nr = 0;
+
+	for_each_bucket(cal, off) {
+		if ((cal->base + off) * cal->quantum > time)
+			break;
+		for (e = bucket_head(cal, off); e; e = e->cal_next)
+			nr++;
+	}
+	return nr;
+}
+
+struct entity *calendar_earliest(struct calendar *cal,
+				 unsigned int event_class)
+{
+	struct entity *e;
+	unsigned int off;
+
+	for_each_bucket(cal, off)
+		for (e = bucket_head(cal, off); e; e = e->cal_next)
+			if (e->event_class == event_class)
+				return e;
+	return NULL;
+}
@@ -0,0 +1,409 @@
+#include <errno.h>
+#include <time-simulator.h>
+#include <calendar.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+struct checkpoint_ref {
+	struct entity *e;
+	uint64_t id;
+};
+
+/* An entity reference is its position and an offset into it. */
+struct checkpoint_pos {
+	uint64_t id;
+	uint64_t offset;
+};
+
+void checkpoint_bytes(struct checkpoint *c, void *p, size_t len)
+{
+	if (c->error || !len)
+		return;
+	if (c->load) {
+		if (fread(p, len, 1, c->f) != 1)
+			c->error = -EINVAL;
+	} else if (fwrite(p, len, 1, c->f) != 1) {
+		c->error = -EIO;
+	}
+}
+
+void checkpoint_entity_state(struct checkpoint *c, struct entity *e)
+{
+	checkpoint_var(c, e->start_time);
+	checkpoint_var(c, e->sleep_time);
+	checkpoint_var(c, e->run_time);
+	checkpoint_var(c, e->state);
+}
+
+static int ref_cmp(const void *a, const void *b)
+{
+	const struct checkpoint_ref *ra = a, *rb = b;
+
+	if (ra->e == rb->e)
+		return 0;
+	return (uintptr_t)ra->e < (uintptr_t)rb->e ? -1 : 1;
+}
+
+/* The closest listed entity at or below @e. */
+static struct checkpoint_ref *ref_floor(struct checkpoint *c, struct entity *e)
+{
+	uint64_t lo = 0, hi = c->nr_entities;
+
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+
+		if ((uintptr_t)c->refs[mid].e <= (uintptr_t)e)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo ? &c->refs[lo - 1] : NULL;
+}
+
+void checkpoint_ref(struct checkpoint *c, struct entity **e)
+{
+	struct checkpoint_pos pos = { .id = UINT64_MAX };
+
+	if (!c->load && *e) {
+		struct checkpoint_ref *ref = ref_floor(c, *e);
+
+		if (!ref) {
+			c->error = -EINVAL;
+			return;
+		}
+		pos.id = ref->id;
+		pos.offset = (char *)*e - (char *)ref->e;
+	}
+	checkpoint_var(c, pos);
+	if (!c->load || c->error)
+		return;
+	if (pos.id == UINT64_MAX) {
+		*e = NULL;
+	} else if (pos.id >= c->nr_entities) {
+		c->error = -EINVAL;
+		*e = NULL;
+	} else {
+		*e = (struct entity *)((char *)c->entities[pos.id] +
+				       pos.offset);
+	}
+}
+
+void checkpoint_list(struct checkpoint *c, struct list_head *head,
+		     size_t offset)
+{
+	struct list_head *node;
+	struct entity *e;
+	uint64_t nr = 0;
+
+	if (!c->load)
+		list_for_each(node, head)
+			nr++;
+	checkpoint_var(c, nr);
+	if (c->error)
+		return;
+	if (!c->load) {
+		list_for_each(node, head) {
+			e = (struct entity *)((char *)node - offset);
+			checkpoint_ref(c, &e);
+		}
+		return;
+	}
+	INIT_LIST_HEAD(head);
+	while (nr--) {
+		checkpoint_ref(c, &e);
+		if (c->error || !e) {
+			c->error = -EINVAL;
+			return;
+		}
+		list_add_tail((struct list_head *)((char *)e + offset), head);
+	}
+}
+
+/* Number the listed entities, by address for saving and by id for loading. */
+static int checkpoint_index(struct time_simulator *s, struct checkpoint *c)
+{
+	struct entity *e;
+	uint64_t nr = 0;
+
+	list_for_each_entry(e, &s->entity_list, main_list)
+		nr++;
+	if (c->load) {
+		if (nr != c->nr_entities)
+			return -EINVAL;
+		c->entities = calloc(nr ?: 1, sizeof(*c->entities));
+		if (!c->entities)
+			return -ENOMEM;
+		nr = 0;
+		list_for_each_entry(e, &s->entity_list, main_list)
+			c->entities[nr++] = e;
+		return 0;
+	}
+
+	c->nr_entities = nr;
+	c->refs = calloc(nr ?: 1, sizeof(*c->refs));
+	if (!c->refs)
+		return -ENOMEM;
+	nr = 0;
+	list_for_each_entry(e, &s->entity_list, main_list) {
+		c->refs[nr].e = e;
+		c->refs[nr].id = nr;
+		nr++;
+	}
+	qsort(c->refs, nr, sizeof(*c->refs), ref_cmp);
+	return 0;
+}
+
+static void checkpoint_header(struct checkpoint *c)
+{
+	char magic[8];
+
+	memcpy(magic, CHECKPOINT_MAGIC, sizeof(magic));
+	checkpoint_var(c, magic);
+	if (!c->error && memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)))
+		c->error = -EINVAL;
+	checkpoint_var(c, c->time);
+	checkpoint_var(c, c->seq);
+	checkpoint_var(c, c->nr_dispatched);
+	checkpoint_var(c, c->nr_queued);
+	checkpoint_var(c, c->nr_sleepers);
+	checkpoint_var(c, c->nr_entities);
+}
+
+static void checkpoint_entities(struct checkpoint *c, struct time_simulator *s)
+{
+	struct entity *e;
+
+	list_for_each_entry(e, &s->entity_list, main_list) {
+		checkpoint_entity_state(c, e);
+		if (e->ops && e->ops->checkpoint)
+			e->ops->checkpoint(c, e);
+	}
+}
+
+static void checkpoint_queued(struct entity *e, void *priv)
+{
+	struct checkpoint *c = priv;
+
+	checkpoint_ref(c, &e);
+	checkpoint_var(c, e->wake_time);
+	checkpoint_var(c, e->seq);
+	checkpoint_var(c, e->lane);
+	checkpoint_var(c, e->start_time);
+}
+
+/*
+ * Everything is restored into the tree, which orders it by key alone, and a
+ * calendar takes its lane back on the next enqueue.
+ */
+static void checkpoint_queue(struct checkpoint *c, struct time_simulator *s)
+{
+	uint64_t nr = c->nr_queued;
+	struct entity *e;
+
+	if (!c->load) {
+		time_simulator_for_each_queued(s, checkpoint_queued, c);
+		return;
+	}
+
+	s->time = c->time;
+	__queue_clear(s);
+	while (nr-- && !c->error) {
+		checkpoint_ref(c, &e);
+		if (!c->error && !e)
+			c->error = -EINVAL;
+		if (c->error)
+			return;
+		checkpoint_var(c, e->wake_time);
+		checkpoint_var(c, e->seq);
+		checkpoint_var(c, e->lane);
+		checkpoint_var(c, e->start_time);
+		__entity_insert(s, e);
+	}
+}
+
+static int checkpoint_save(struct time_simulator *s, const char *path)
+{
+	struct checkpointer *ck = s->ckpt;
+	struct checkpoint c = {
+		.time = s->time,
+		.seq = s->seq,
+		.nr_dispatched = s->nr_dispatched,
+		.nr_queued = s->nr_queued,
+		.nr_sleepers = s->nr_sleepers,
+	};
+	char tmp[PATH_MAX];
+	int ret;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp))
+		return -ENAMETOOLONG;
+	ret = checkpoint_index(s, &c);
+	if (ret)
+		return ret;
+	c.f = fopen(tmp, "w");
+	if (!c.f) {
+		free(c.refs);
+		return -errno;
+	}
+
+	checkpoint_header(&c);
+	if (ck->ops->prelude)
+		ck->ops->prelude(s, &c);
+	checkpoint_entities(&c, s);
+	checkpoint_queue(&c, s);
+	checkpoint_list(&c, &s->sleepers, CHECKPOINT_ENTITY_LIST);
+	if (s->cal)
+		checkpoint_var(&c, s->cal->stats);
+	if (ck->ops->state)
+		ck->ops->state(s, &c);
+	free(c.refs);
+
+	ret = c.error;
+	if (fflush(c.f) || fsync(fileno(c.f)))
+		ret = ret ?: -errno;
+	if (fclose(c.f))
+		ret = ret ?: -errno;
+	if (!ret && rename(tmp, path))
+		ret = -errno;
+	if (ret)
+		unlink(tmp);
+	return ret;
+}
+
+/* Collect the writer, with @block wait for it.  Returns false if it's busy. */
+static bool checkpoint_reap(struct checkpointer *ck, bool block)
+{
+	int status;
+	pid_t pid;
+
+	if (ck->writer <= 0)
+		return true;
+	do {
+		pid = waitpid(ck->writer, &status, block ? 0 : WNOHANG);
+	} while (pid < 0 && errno == EINTR);
+	if (!pid)
+		return false;
+	if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+		ck->failed++;
+	ck->writer = 0;
+	return true;
+}
+
+void __checkpoint_take(struct time_simulator *s, uint64_t wake_time)
+{
+	struct checkpointer *ck = s->ckpt;
+	pid_t pid;
+
+	ck->next += ((wake_time - ck->next) / ck->interval + 1) * ck->interval;
+	if (!checkpoint_reap(ck, false)) {
+		ck->skipped++;
+		return;
+	}
+
+	/*
+	 * The child has the simulator exactly as it is between these two
+	 * events and nothing else to do, so the parent only pays for fork().
+	 */
+	pid = fork();
+	if (!pid)
+		_exit(checkpoint_save(s, ck->path) ? 1 : 0);
+	ck->taken++;
+	if (pid > 0) {
+		ck->writer = pid;
+		return;
+	}
+	if (checkpoint_save(s, ck->path))
+		ck->failed++;
+}
+
+int time_simulator_checkpoint(struct time_simulator *s, const char *path,
+			      uint64_t interval,
+			      const struct checkpoint_ops *ops)
+{
+	struct checkpointer *ck;
+
+	if (!interval)
+		return -EINVAL;
+	ck = calloc(1, sizeof(*ck));
+	if (!ck)
+		return -ENOMEM;
+	ck->path = path;
+	ck->interval = interval;
+	ck->next = s->time + interval;
+	ck->ops = ops;
+	checkpointer_free(s->ckpt);
+	s->ckpt = ck;
+	return 0;
+}
+
+int time_simulator_checkpoint_wait(struct time_simulator *s)
+{
+	if (!s->ckpt)
+		return 0;
+	checkpoint_reap(s->ckpt, true);
+	return s->ckpt->failed ? -EIO : 0;
+}
+
+void checkpointer_free(struct checkpointer *ck)
+{
+	if (!ck)
+		return;
+	checkpoint_reap(ck, true);
+	free(ck);
+}
+
+int checkpoint_open(struct checkpoint *c, const char *path)
+{
+	memset(c, 0, sizeof(*c));
+	c->load = true;
+	c->f = fopen(path, "r");
+	if (!c->f)
+		return -errno;
+	checkpoint_header(c);
+	if (c->error) {
+		fclose(c->f);
+		c->f = NULL;
+	}
+	return c->error;
+}
+
+int time_simulator_restore(struct time_simulator *s, struct checkpoint *c,
+			   const struct checkpoint_ops *ops)
+{
+	int ret;
+
+	ret = checkpoint_index(s, c);
+	if (ret)
+		return ret;
+	checkpoint_entities(c, s);
+	checkpoint_queue(c, s);
+	checkpoint_list(c, &s->sleepers, CHECKPOINT_ENTITY_LIST);
+	if (s->cal)
+		checkpoint_var(c, s->cal->stats);
+	if (ops->state)
+		ops->state(s, c);
+	if (!c->error && fgetc(c->f) != EOF)
+		c->error = -EINVAL;
+	if (c->error)
+		return c->error;
+
+	s->time = c->time;
+	s->seq = c->seq;
+	s->nr_dispatched = c->nr_dispatched;
+	s->nr_queued = c->nr_queued;
+	s->nr_sleepers = c->nr_sleepers;
+	if (s->ckpt)
+		s->ckpt->next = s->time + s->ckpt->interval;
+	return 0;
+}
+
+void checkpoint_close(struct checkpoint *c)
+{
+	if (c->f)
+		fclose(c->f);
+	free(c->entities);
+	c->f = NULL;
+	c->entities = NULL;
+}
@@ -0,0 +1,130 @@
+#include <device.h>
+#include <string.h>
+
+void device_init(struct device *dev, const struct device_config *cfg)
+{
+	memset(dev, 0, sizeof(*dev));
+	dev->cfg = *cfg;
+	if (!dev->cfg.queue_depth)
+		dev->cfg.queue_depth = 1;
+	INIT_LIST_HEAD(&dev->queue);
+}
+
+static uint64_t service_time(struct device *dev, struct device_request *rq)
+{
+	uint64_t time = sampler_table(dev->cfg.stream, dev->cfg.service_table,
+				      100);
+
+	time = time * dev->cfg.cost_pct[rq->dir] / 100;
+	return time + (rq->len - 1) * dev->cfg.block_ns;
+}
+
+static void device_dispatch(struct time_simulator *s, struct device *dev)
+{
+	while (dev->in_flight < dev->cfg.queue_depth &&
+	       !list_empty(&dev->queue)) {
+		struct device_request *rq =
+			list_first_entry(&dev->queue, struct device_request,
+					 list);
+
+		list_del_init(&rq->list);
+		dev->nr_queued--;
+		if (!dev->in_flight++)
+			dev->busy_start = s->time;
+		dev->stats.dispatched++;
+		dev->stats.queue_time += s->time - rq->submit_time;
+		entity_enqueue(s, &rq->e, service_time(dev, rq));
+	}
+}
+
+/*
+ * The next request goes into service before any ->end_io runs, so whatever
+ * the callbacks submit queues up behind it.
+ */
+static void device_complete(struct time_simulator *s, struct entity *e)
+{
+	struct device_request *rq = container_of(e, struct device_request, e);
+	struct device *dev = rq->dev;
+	struct device_request *m, *tmp;
+	LIST_HEAD(merged);
+
+	dev->stats.service_time += s->time - e->start_time;
+	if (!--dev->in_flight)
+		dev->stats.busy_time += s->time - dev->busy_start;
+	list_splice_init(&rq->merged, &merged);
+	device_dispatch(s, dev);
+
+	rq->end_io(s, rq);
+	list_for_each_entry_safe(m, tmp, &merged, list) {
+		list_del_init(&m->list);
+		m->end_io(s, m);
+	}
+}
+
+void device_submit(struct time_simulator *s, struct device *dev,
+		   struct device_request *rq, enum device_dir dir,
+		   uint64_t sector, uint64_t len)
+{
+	RB_CLEAR_NODE(&rq->e.n);
+	INIT_LIST_HEAD(&rq->e.list);
+	INIT_LIST_HEAD(&rq->list);
+	INIT_LIST_HEAD(&rq->merged);
+	rq->e.run = device_complete;
+	rq->e.lane = ENTITY_LANE_HIGH;
+	rq->dev = dev;
+	rq->dir = dir;
+	rq->sector = sector;
+	rq->len = len;
+	rq->submit_time = s->time;
+	dev->stats.submitted[dir]++;
+
+	if (dev->cfg.max_merge && !list_empty(&dev->queue)) {
+		struct device_request *tail =
+			list_entry(dev->queue.prev, struct device_request,
+				   list);
+
+		if (tail->dir == dir && tail->sector + tail->len == sector &&
+		    tail->len + len <= dev->cfg.max_merge) {
+			tail->len += len;
+			list_add_tail(&rq->list, &tail->merged);
+			dev->stats.merged++;
+			return;
+		}
+	}
+
+	list_add_tail(&rq->list, &dev->queue);
+	if (++dev->nr_queued > dev->stats.max_queued)
+		dev->stats.max_queued = dev->nr_queued;
+	device_dispatch(s, dev);
+}
+
+void device_request_checkpoint(struct checkpoint *c, struct device *dev,
+			       struct device_request *rq)
+{
+	bool submitted = rq->dev == dev;
+
+	checkpoint_var(c, submitted);
+	if (c->error || !submitted)
+		return;
+	checkpoint_entity_state(c, &rq->e);
+	checkpoint_var(c, rq->dir);
+	checkpoint_var(c, rq->sector);
+	checkpoint_var(c, rq->len);
+	checkpoint_var(c, rq->submit_time);
+	checkpoint_list(c, &rq->merged, DEVICE_REQUEST_LIST);
+	if (c->load) {
+		INIT_LIST_HEAD(&rq->e.list);
+		rq->e.run = device_complete;
+		rq->e.lane = ENTITY_LANE_HIGH;
+		rq->dev = dev;
+	}
+}
+
+void device_checkpoint(struct checkpoint *c, struct device *dev)
+{
+	checkpoint_var(c, dev->stats);
+	checkpoint_var(c, dev->nr_queued);
+	checkpoint_var(c, dev->in_flight);
+	checkpoint_var(c, dev->busy_start);
+	checkpoint_list(c, &dev->queue, DEVICE_REQUEST_LIST);
+}
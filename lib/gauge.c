@@ -0,0 +1,193 @@
+#include <errno.h>
+#include <time-simulator.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+void gauges_init(struct gauges *g)
+{
+	INIT_LIST_HEAD(&g->list);
+	g->next = 0;
+	g->start = 0;
+	g->per_bucket = 1;
+	g->filled = 1;
+	g->nr_buckets = 0;
+}
+
+void gauges_clear(struct gauges *g)
+{
+	while (!list_empty(&g->list)) {
+		struct gauge *gauge = list_first_entry(&g->list, struct gauge,
+						       list);
+		list_del(&gauge->list);
+		free(gauge->buckets);
+		free(gauge);
+	}
+	gauges_init(g);
+	g->gen++;
+}
+
+/* Fold every pair of buckets into one, halving the resolution. */
+static void gauges_compact(struct gauges *g)
+{
+	struct gauge *gauge;
+	unsigned int i;
+
+	list_for_each_entry(gauge, &g->list, list) {
+		struct gauge_bucket *b = gauge->buckets;
+
+		for (i = 0; i < g->nr_buckets / 2; i++) {
+			struct gauge_bucket *l = &b[i * 2], *r = &b[i * 2 + 1];
+
+			b[i].min = l->min < r->min ? l->min : r->min;
+			b[i].max = l->max > r->max ? l->max : r->max;
+			b[i].sum = l->sum + r->sum;
+		}
+	}
+	g->nr_buckets /= 2;
+	g->per_bucket *= 2;
+}
+
+void __gauges_sample(struct time_simulator *s, struct gauges *g,
+		     uint64_t until)
+{
+	uint64_t nr = (until - g->next + g->interval - 1) / g->interval;
+	struct gauge *gauge;
+
+	g->next += nr * g->interval;
+	if (list_empty(&g->list))
+		return;
+
+	list_for_each_entry(gauge, &g->list, list)
+		gauge->value = gauge->read(s, gauge->priv);
+
+	while (nr) {
+		uint64_t n;
+
+		if (g->filled == g->per_bucket) {
+			if (g->nr_buckets == g->max_buckets)
+				gauges_compact(g);
+			list_for_each_entry(gauge, &g->list, list) {
+				struct gauge_bucket *b =
+					&gauge->buckets[g->nr_buckets];
+				b->min = UINT64_MAX;
+				b->max = 0;
+				b->sum = 0;
+			}
+			g->nr_buckets++;
+			g->filled = 0;
+		}
+
+		n = g->per_bucket - g->filled;
+		if (n > nr)
+			n = nr;
+		list_for_each_entry(gauge, &g->list, list) {
+			struct gauge_bucket *b =
+				&gauge->buckets[g->nr_buckets - 1];
+			if (gauge->value < b->min)
+				b->min = gauge->value;
+			if (gauge->value > b->max)
+				b->max = gauge->value;
+			b->sum += (double)gauge->value * n;
+		}
+		g->filled += n;
+		nr -= n;
+	}
+}
+
+/*
+ * Must be called before any gauge is added, @max_buckets is rounded up to an
+ * even number so buckets can always be merged in pairs.
+ */
+void time_simulator_gauge_interval(struct time_simulator *s,
+				   uint64_t interval,
+				   unsigned int max_buckets)
+{
+	struct gauges *g = &s->gauges;
+
+	g->interval = interval;
+	g->max_buckets = (max_buckets + 1) & ~1U;
+	g->next = s->time;
+	g->start = s->time;
+}
+
+int time_simulator_gauge_add(struct time_simulator *s, const char *name,
+			     uint64_t (*read)(struct time_simulator *s,
+					      void *priv),
+			     void *priv)
+{
+	struct gauges *g = &s->gauges;
+	struct gauge *gauge;
+
+	if (!g->interval || !g->max_buckets || g->nr_buckets)
+		return -EINVAL;
+
+	gauge = calloc(1, sizeof(struct gauge));
+	if (!gauge)
+		return -ENOMEM;
+	gauge->buckets = calloc(g->max_buckets, sizeof(struct gauge_bucket));
+	if (!gauge->buckets) {
+		free(gauge);
+		return -ENOMEM;
+	}
+	gauge->name = name;
+	gauge->read = read;
+	gauge->priv = priv;
+	list_add_tail(&gauge->list, &g->list);
+	g->gen++;
+	return 0;
+}
+
+int time_simulator_gauge_write(struct time_simulator *s, const char *path)
+{
+	struct gauges *g = &s->gauges;
+	struct gauge *gauge;
+	uint32_t nr_gauges = 0, nr_buckets = g->nr_buckets;
+	unsigned int i;
+	FILE *f;
+
+	list_for_each_entry(gauge, &g->list, list)
+		nr_gauges++;
+
+	f = fopen(path, "w");
+	if (!f)
+		return -errno;
+
+	fwrite("TSGAUGE1", 1, 8, f);
+	fwrite(&nr_gauges, sizeof(nr_gauges), 1, f);
+	fwrite(&nr_buckets, sizeof(nr_buckets), 1, f);
+	fwrite(&g->interval, sizeof(g->interval), 1, f);
+	fwrite(&g->per_bucket, sizeof(g->per_bucket), 1, f);
+	list_for_each_entry(gauge, &g->list, list) {
+		uint16_t len = strlen(gauge->name);
+
+		fwrite(&len, sizeof(len), 1, f);
+		fwrite(gauge->name, 1, len, f);
+	}
+
+	for (i = 0; i < nr_buckets; i++) {
+		uint64_t time = g->start + i * g->per_bucket * g->interval;
+
+		fwrite(&time, sizeof(time), 1, f);
+	}
+
+	list_for_each_entry(gauge, &g->list, list) {
+		for (i = 0; i < nr_buckets; i++)
+			fwrite(&gauge->buckets[i].min, sizeof(uint64_t), 1, f);
+		for (i = 0; i < nr_buckets; i++)
+			fwrite(&gauge->buckets[i].max, sizeof(uint64_t), 1, f);
+		for (i = 0; i < nr_buckets; i++) {
+			uint64_t samples = g->per_bucket;
+			double mean;
+
+			if (i == nr_buckets - 1)
+				samples = g->filled;
+			mean = gauge->buckets[i].sum / samples;
+			fwrite(&mean, sizeof(mean), 1, f);
+		}
+	}
+
+	if (fclose(f))
+		return -errno;
+	return 0;
+}
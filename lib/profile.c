@@ -0,0 +1,100 @@
+#include <time-simulator.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#ifdef TIME_SIMULATOR_PROFILE
+struct profile *profile_alloc(void)
+{
+	return calloc(1, sizeof(struct profile));
+}
+
+/* Open addressed on the function pointer, the last slot catches overflow. */
+static struct profile_fn *profile_lookup(struct profile *p, void *fn)
+{
+	unsigned int i = ((uintptr_t)fn >> 4) * 2654435761U % (PROFILE_FNS - 1);
+	unsigned int tries;
+
+	for (tries = 0; tries < PROFILE_FNS - 1; tries++) {
+		struct profile_fn *f = &p->fns[i];
+
+		if (f->fn == fn)
+			return f;
+		if (!f->fn) {
+			f->fn = fn;
+			return f;
+		}
+		i = (i + 1) % (PROFILE_FNS - 1);
+	}
+	return &p->fns[PROFILE_FNS - 1];
+}
+
+void profile_account(struct profile *p, void *fn, uint64_t ticks)
+{
+	struct profile_fn *f = profile_lookup(p, fn);
+
+	f->calls++;
+	f->ticks += ticks;
+}
+
+void profile_hist(uint64_t *hist, uint64_t value)
+{
+	unsigned int bucket = value ? 64 - __builtin_clzll(value) : 0;
+
+	if (bucket >= PROFILE_BUCKETS)
+		bucket = PROFILE_BUCKETS - 1;
+	hist[bucket]++;
+}
+
+void time_simulator_profile_name(struct time_simulator *s, void *fn,
+				 const char *name)
+{
+	profile_lookup(s->profile, fn)->name = name;
+}
+
+static void print_hist(const char *title, uint64_t *hist)
+{
+	int i;
+
+	printf("%s\n", title);
+	for (i = 0; i < PROFILE_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		printf("\t[%llu, %llu]\t%llu\n",
+		       i ? 1ULL << (i - 1) : 0ULL,
+		       i ? (1ULL << i) - 1 : 0ULL,
+		       (unsigned long long)hist[i]);
+	}
+}
+
+void time_simulator_profile_print(struct time_simulator *s)
+{
+	struct profile *p = s->profile;
+	uint64_t total = 0;
+	int i;
+
+	for (i = 0; i < PROFILE_FNS; i++)
+		total += p->fns[i].ticks;
+
+	printf("%-24s %14s %16s %10s %7s\n", "callback", "calls",
+	       PROFILE_UNIT, "per call", "%");
+	for (i = 0; i < PROFILE_FNS; i++) {
+		struct profile_fn *f = &p->fns[i];
+		char buf[32];
+
+		if (!f->calls)
+			continue;
+		if (!f->name)
+			snprintf(buf, sizeof(buf), "%p", f->fn);
+		printf("%-24s %14llu %16llu %10.1f %6.2f%%\n",
+		       f->name ? f->name : buf,
+		       (unsigned long long)f->calls,
+		       (unsigned long long)f->ticks,
+		       (double)f->ticks / f->calls,
+		       total ? (double)f->ticks * 100 / total : 0.0);
+	}
+	printf("%llu wakes, %llu predicate calls\n",
+	       (unsigned long long)p->wakes, (unsigned long long)p->preds);
+	print_hist("queue depth at dispatch", p->depth_hist);
+	print_hist("predicate calls per wake", p->pred_hist);
+}
+#endif /* TIME_SIMULATOR_PROFILE */
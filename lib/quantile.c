@@ -0,0 +1,124 @@
+#include <quantile.h>
+#include <string.h>
+
+void quantile_init(struct quantile *q, double p)
+{
+	memset(q, 0, sizeof(*q));
+	q->p = p;
+	q->dn[0] = 0;
+	q->dn[1] = p / 2;
+	q->dn[2] = p;
+	q->dn[3] = (1 + p) / 2;
+	q->dn[4] = 1;
+}
+
+static double parabolic(struct quantile *q, int i, int d)
+{
+	double n0 = q->n[i - 1], n1 = q->n[i], n2 = q->n[i + 1];
+
+	return q->q[i] + d / (n2 - n0) *
+		((n1 - n0 + d) * (q->q[i + 1] - q->q[i]) / (n2 - n1) +
+		 (n2 - n1 - d) * (q->q[i] - q->q[i - 1]) / (n1 - n0));
+}
+
+static double linear(struct quantile *q, int i, int d)
+{
+	return q->q[i] + d * (q->q[i + d] - q->q[i]) / (q->n[i + d] - q->n[i]);
+}
+
+/*
+ * The first five samples are kept sorted in the marker heights, after that
+ * the markers are adjusted with the piecewise-parabolic formula.
+ */
+void quantile_add(struct quantile *q, uint64_t value)
+{
+	double x = value;
+	int i, k;
+
+	if (q->count < 5) {
+		for (i = q->count; i > 0 && q->q[i - 1] > x; i--)
+			q->q[i] = q->q[i - 1];
+		q->q[i] = x;
+		if (++q->count < 5)
+			return;
+		for (i = 0; i < 5; i++)
+			q->n[i] = i;
+		q->np[0] = 0;
+		q->np[1] = 2 * q->p;
+		q->np[2] = 4 * q->p;
+		q->np[3] = 2 + 2 * q->p;
+		q->np[4] = 4;
+		return;
+	}
+
+	q->count++;
+	if (x < q->q[0]) {
+		q->q[0] = x;
+		k = 0;
+	} else if (x >= q->q[4]) {
+		q->q[4] = x;
+		k = 3;
+	} else {
+		for (k = 0; k < 3; k++)
+			if (x < q->q[k + 1])
+				break;
+	}
+
+	for (i = k + 1; i < 5; i++)
+		q->n[i]++;
+	for (i = 0; i < 5; i++)
+		q->np[i] += q->dn[i];
+
+	for (i = 1; i < 4; i++) {
+		double d = q->np[i] - q->n[i];
+		double h;
+		int dir;
+
+		if (!((d >= 1 && q->n[i + 1] - q->n[i] > 1) ||
+		      (d <= -1 && q->n[i - 1] - q->n[i] < -1)))
+			continue;
+		dir = d > 0 ? 1 : -1;
+		h = parabolic(q, i, dir);
+		if (q->q[i - 1] < h && h < q->q[i + 1])
+			q->q[i] = h;
+		else
+			q->q[i] = linear(q, i, dir);
+		q->n[i] += dir;
+	}
+}
+
+uint64_t quantile_get(struct quantile *q)
+{
+	if (!q->count)
+		return 0;
+	if (q->count < 5)
+		return q->q[(int)(q->p * (q->count - 1) + 0.5)];
+	return q->q[2];
+}
+
+void quantile_window_init(struct quantile_window *w, double p,
+			  uint64_t window)
+{
+	quantile_init(&w->q[0], p);
+	quantile_init(&w->q[1], p);
+	w->window = window ?: 1;
+	w->old = 0;
+}
+
+void quantile_window_add(struct quantile_window *w, uint64_t value)
+{
+	struct quantile *old = &w->q[w->old];
+
+	quantile_add(old, value);
+	if (old->count > w->window)
+		quantile_add(&w->q[!w->old], value);
+	if (old->count < 2 * w->window)
+		return;
+	quantile_init(old, old->p);
+	w->old = !w->old;
+}
+
+uint64_t quantile_window_get(struct quantile_window *w)
+{
+	return quantile_get(&w->q[w->old]);
+}
@@ -0,0 +1,155 @@
+#include <errno.h>
+#include <time-simulator.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *core_names[RECORD_MODEL] = {
+	[RECORD_ENQUEUE] = "enqueue",
+	[RECORD_DISPATCH] = "dispatch",
+	[RECORD_SLEEP] = "sleep",
+	[RECORD_WAKE] = "wake",
+};
+
+void recorder_free(struct recorder *r)
+{
+	if (!r)
+		return;
+	free(r->ring);
+	free(r);
+}
+
+/* The clock restarts for every run, so does the recording. */
+void recorder_reset(struct recorder *r)
+{
+	r->head = 0;
+	r->next_dump = 0;
+	r->nr_dumps = 0;
+}
+
+int time_simulator_recorder(struct time_simulator *s, unsigned int nr_records,
+			    const char *dir)
+{
+	struct recorder *r;
+	uint64_t size = 1;
+
+	if (!nr_records)
+		return -EINVAL;
+	while (size < nr_records)
+		size <<= 1;
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return -ENOMEM;
+	r->ring = calloc(size, sizeof(struct record));
+	if (!r->ring) {
+		free(r);
+		return -ENOMEM;
+	}
+	r->mask = size - 1;
+	r->dir = dir;
+	r->holdoff = RECORDER_HOLDOFF;
+	r->max_dumps = RECORDER_MAX_DUMPS;
+	strcpy(r->label, "run");
+	recorder_free(s->recorder);
+	s->recorder = r;
+	return 0;
+}
+
+void time_simulator_recorder_triggers(struct time_simulator *s,
+				      uint64_t max_sleep, uint64_t max_depth,
+				      bool (*predicate)(struct time_simulator *s,
+							void *priv),
+				      void *priv)
+{
+	struct recorder *r = s->recorder;
+
+	if (!r)
+		return;
+	r->max_sleep = max_sleep;
+	r->max_depth = max_depth;
+	r->predicate = predicate;
+	r->priv = priv;
+}
+
+void time_simulator_recorder_names(struct time_simulator *s,
+				   const char *const *names,
+				   unsigned int nr_names)
+{
+	if (!s->recorder)
+		return;
+	s->recorder->names = names;
+	s->recorder->nr_names = nr_names;
+}
+
+void time_simulator_recorder_label(struct time_simulator *s,
+				   const char *label)
+{
+	struct recorder *r = s->recorder;
+	int i;
+
+	if (!r)
+		return;
+	snprintf(r->label, sizeof(r->label), "%s", label);
+	for (i = 0; r->label[i]; i++)
+		if (r->label[i] == ' ' || r->label[i] == '/')
+			r->label[i] = '-';
+}
+
+static const char *record_name(struct recorder *r, uint32_t type)
+{
+	if (type < RECORD_MODEL)
+		return core_names[type];
+	if (type - RECORD_MODEL < r->nr_names)
+		return r->names[type - RECORD_MODEL];
+	return "model";
+}
+
+/*
+ * Write the ring out, oldest first.  Returns 0 without writing anything
+ * while held off or once this run has used up its dumps.
+ */
+int time_simulator_recorder_dump(struct time_simulator *s,
+				 const char *reason)
+{
+	struct recorder *r = s->recorder;
+	char path[PATH_MAX];
+	uint64_t i, start;
+	FILE *f;
+	int ret;
+
+	if (!r || !r->dir)
+		return 0;
+	if (s->time < r->next_dump || r->nr_dumps >= r->max_dumps)
+		return 0;
+	r->next_dump = s->time + r->holdoff;
+	r->nr_dumps++;
+
+	ret = snprintf(path, sizeof(path), "%s/%s-%u.rec", r->dir, r->label,
+		       r->seq++);
+	if (ret >= sizeof(path))
+		return -ENAMETOOLONG;
+	f = fopen(path, "w");
+	if (!f)
+		return -errno;
+
+	start = r->head > r->mask ? r->head - r->mask - 1 : 0;
+	fprintf(f, "# %s at %lluns, %llu events\n", reason,
+		(unsigned long long)s->time,
+		(unsigned long long)(r->head - start));
+	fprintf(f, "# time entity event arg depth\n");
+	for (i = start; i < r->head; i++) {
+		struct record *rec = &r->ring[i & r->mask];
+
+		fprintf(f, "%llu %#llx %s %llu %u\n",
+			(unsigned long long)rec->time,
+			(unsigned long long)rec->entity,
+			record_name(r, rec->type),
+			(unsigned long long)rec->arg, rec->depth);
+	}
+	if (fclose(f))
+		return -errno;
+	fprintf(stderr, "flight recorder: %s at %lluns, wrote %s\n", reason,
+		(unsigned long long)s->time, path);
+	return 0;
+}
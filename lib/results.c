@@ -0,0 +1,414 @@
+#include <results.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RESULTS_MAGIC "TSRES001"
+#define ALIGN8(x) (((x) + 7) & ~(size_t)7)
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len) {
+		ssize_t ret = write(fd, p, len);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len, off_t off)
+{
+	char *p = buf;
+
+	while (len) {
+		ssize_t ret = pread(fd, p, len, off);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (ret == 0)
+			return -EINVAL;
+		p += ret;
+		off += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static size_t header_size(const struct result_column *columns, int nr_columns)
+{
+	size_t size = 16;
+	int i;
+
+	for (i = 0; i < nr_columns; i++)
+		size += 2 + strlen(columns[i].name);
+	return ALIGN8(size);
+}
+
+static int write_header(struct results *r)
+{
+	size_t size = header_size(r->columns, r->nr_columns);
+	uint32_t nr = r->nr_columns, hsize = size;
+	char *buf, *p;
+	int i, ret;
+
+	buf = calloc(1, size);
+	if (!buf)
+		return -ENOMEM;
+	memcpy(buf, RESULTS_MAGIC, 8);
+	memcpy(buf + 8, &nr, 4);
+	memcpy(buf + 12, &hsize, 4);
+	p = buf + 16;
+	for (i = 0; i < r->nr_columns; i++) {
+		uint8_t len = strlen(r->columns[i].name);
+
+		*p++ = r->columns[i].type;
+		*p++ = len;
+		memcpy(p, r->columns[i].name, len);
+		p += len;
+	}
+	ret = write_all(r->fd, buf, size);
+	free(buf);
+	return ret;
+}
+
+/*
+ * Check an existing file has our columns and find the end of the last
+ * complete chunk, anything after it is a torn write and gets cut off.
+ */
+static int check_existing(struct results *r, size_t size)
+{
+	size_t hsize = header_size(r->columns, r->nr_columns);
+	uint64_t chunk[2];
+	off_t off;
+	char *buf;
+	int i, ret;
+
+	buf = malloc(hsize);
+	if (!buf)
+		return -ENOMEM;
+	ret = -EINVAL;
+	if (size < hsize || read_all(r->fd, buf, hsize, 0))
+		goto out;
+	if (memcmp(buf, RESULTS_MAGIC, 8) ||
+	    *(uint32_t *)(buf + 8) != r->nr_columns ||
+	    *(uint32_t *)(buf + 12) != hsize)
+		goto out;
+	off = 16;
+	for (i = 0; i < r->nr_columns; i++) {
+		size_t len = strlen(r->columns[i].name);
+
+		if (buf[off] != r->columns[i].type ||
+		    (uint8_t)buf[off + 1] != len ||
+		    memcmp(buf + off + 2, r->columns[i].name, len))
+			goto out;
+		off += 2 + len;
+	}
+
+	off = hsize;
+	while (off + sizeof(chunk) <= size) {
+		uint64_t len;
+
+		if (read_all(r->fd, chunk, sizeof(chunk), off))
+			break;
+		if (chunk[0] > (size - off) / 8 / r->nr_columns)
+			break;
+		len = sizeof(chunk) + chunk[0] * 8 * r->nr_columns + chunk[1];
+		if (len > size - off)
+			break;
+		r->rows += chunk[0];
+		off += len;
+	}
+	ret = 0;
+	if (off < size && ftruncate(r->fd, off))
+		ret = -errno;
+	else if (lseek(r->fd, off, SEEK_SET) < 0)
+		ret = -errno;
+out:
+	free(buf);
+	return ret;
+}
+
+int results_open(struct results *r, const char *path,
+		 const struct result_column *columns, int nr_columns)
+{
+	struct stat st;
+	int i, ret;
+
+	memset(r, 0, sizeof(*r));
+	if (nr_columns < 1)
+		return -EINVAL;
+	for (i = 0; i < nr_columns; i++)
+		if (strlen(columns[i].name) > UINT8_MAX)
+			return -EINVAL;
+	r->columns = columns;
+	r->nr_columns = nr_columns;
+	r->data = calloc((size_t)nr_columns * RESULTS_CHUNK_ROWS,
+			 sizeof(uint64_t));
+	r->last_str = malloc(nr_columns * sizeof(uint64_t));
+	if (!r->data || !r->last_str) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	memset(r->last_str, 0xff, nr_columns * sizeof(uint64_t));
+
+	r->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (r->fd < 0) {
+		ret = -errno;
+		goto fail;
+	}
+	if (fstat(r->fd, &st)) {
+		ret = -errno;
+		goto fail_close;
+	}
+	if (st.st_size)
+		ret = check_existing(r, st.st_size);
+	else
+		ret = write_header(r);
+	if (ret)
+		goto fail_close;
+	return 0;
+fail_close:
+	close(r->fd);
+fail:
+	free(r->data);
+	free(r->last_str);
+	memset(r, 0, sizeof(*r));
+	return ret;
+}
+
+static int strtab_reserve(struct results *r, size_t len)
+{
+	size_t size = r->strtab_size ? r->strtab_size : 4096;
+	char *strtab;
+
+	if (r->strtab_len + len <= r->strtab_size)
+		return 0;
+	while (size < r->strtab_len + len)
+		size *= 2;
+	strtab = realloc(r->strtab, size);
+	if (!strtab)
+		return -ENOMEM;
+	r->strtab = strtab;
+	r->strtab_size = size;
+	return 0;
+}
+
+/* Repeats of the previous string in a column share its strtab entry. */
+static int add_string(struct results *r, int col, const char *s,
+		      uint64_t *off)
+{
+	size_t len = strlen(s) + 1;
+	int ret;
+
+	if (r->last_str[col] != UINT64_MAX &&
+	    !strcmp(r->strtab + r->last_str[col], s)) {
+		*off = r->last_str[col];
+		return 0;
+	}
+	ret = strtab_reserve(r, len);
+	if (ret)
+		return ret;
+	memcpy(r->strtab + r->strtab_len, s, len);
+	*off = r->last_str[col] = r->strtab_len;
+	r->strtab_len += len;
+	return 0;
+}
+
+int results_append(struct results *r, const union result_value *row)
+{
+	int i, ret;
+
+	for (i = 0; i < r->nr_columns; i++) {
+		uint64_t *v = &r->data[i * RESULTS_CHUNK_ROWS + r->nr_buffered];
+
+		switch (r->columns[i].type) {
+		case RESULT_U64:
+			*v = row[i].u;
+			break;
+		case RESULT_F64:
+			memcpy(v, &row[i].f, sizeof(*v));
+			break;
+		case RESULT_STR:
+			ret = add_string(r, i, row[i].s ? row[i].s : "", v);
+			if (ret)
+				return ret;
+			break;
+		}
+	}
+	if (++r->nr_buffered == RESULTS_CHUNK_ROWS)
+		return results_flush(r);
+	return 0;
+}
+
+int results_flush(struct results *r)
+{
+	uint64_t chunk[2];
+	size_t pad;
+	int i, ret;
+
+	if (!r->nr_buffered)
+		return 0;
+	pad = ALIGN8(r->strtab_len) - r->strtab_len;
+	ret = strtab_reserve(r, pad);
+	if (ret)
+		return ret;
+	memset(r->strtab + r->strtab_len, 0, pad);
+	r->strtab_len += pad;
+
+	chunk[0] = r->nr_buffered;
+	chunk[1] = r->strtab_len;
+	ret = write_all(r->fd, chunk, sizeof(chunk));
+	for (i = 0; i < r->nr_columns && !ret; i++)
+		ret = write_all(r->fd, &r->data[i * RESULTS_CHUNK_ROWS],
+				r->nr_buffered * sizeof(uint64_t));
+	if (!ret)
+		ret = write_all(r->fd, r->strtab, r->strtab_len);
+	if (ret)
+		return ret;
+
+	r->rows += r->nr_buffered;
+	r->nr_buffered = 0;
+	r->strtab_len = 0;
+	memset(r->last_str, 0xff, r->nr_columns * sizeof(uint64_t));
+	return 0;
+}
+
+int results_close(struct results *r)
+{
+	int ret = results_flush(r);
+
+	if (close(r->fd) && !ret)
+		ret = -errno;
+	free(r->data);
+	free(r->last_str);
+	free(r->strtab);
+	memset(r, 0, sizeof(*r));
+	return ret;
+}
+
+int results_map_open(struct results_map *m, const char *path)
+{
+	struct stat st;
+	uint32_t nr, hsize;
+	size_t off;
+	int fd, i, ret = -EINVAL;
+
+	memset(m, 0, sizeof(*m));
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st)) {
+		ret = -errno;
+		goto out;
+	}
+	if (st.st_size < 16)
+		goto out;
+	m->size = st.st_size;
+	m->map = mmap(NULL, m->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (m->map == MAP_FAILED) {
+		ret = -errno;
+		m->map = NULL;
+		goto out;
+	}
+
+	memcpy(&nr, m->map + 8, 4);
+	memcpy(&hsize, m->map + 12, 4);
+	if (memcmp(m->map, RESULTS_MAGIC, 8) || !nr || hsize > m->size ||
+	    hsize % 8)
+		goto out;
+	m->columns = calloc(nr, sizeof(*m->columns));
+	if (!m->columns) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	m->nr_columns = nr;
+	off = 16;
+	for (i = 0; i < nr; i++) {
+		uint8_t len;
+		char *name;
+
+		if (off + 2 > hsize)
+			goto out;
+		len = m->map[off + 1];
+		if (off + 2 + len > hsize)
+			goto out;
+		name = strndup(m->map + off + 2, len);
+		if (!name) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		m->columns[i].name = name;
+		m->columns[i].type = m->map[off];
+		off += 2 + len;
+	}
+	m->header_size = hsize;
+	ret = 0;
+out:
+	close(fd);
+	if (ret)
+		results_map_close(m);
+	return ret;
+}
+
+void results_map_close(struct results_map *m)
+{
+	int i;
+
+	if (m->columns)
+		for (i = 0; i < m->nr_columns; i++)
+			free((char *)m->columns[i].name);
+	free(m->columns);
+	if (m->map)
+		munmap((void *)m->map, m->size);
+	memset(m, 0, sizeof(*m));
+}
+
+int results_map_column(struct results_map *m, const char *name)
+{
+	int i;
+
+	for (i = 0; i < m->nr_columns; i++)
+		if (!strcmp(m->columns[i].name, name))
+			return i;
+	return -1;
+}
+
+bool results_map_chunk(struct results_map *m, struct results_chunk *c)
+{
+	size_t off = c->next ? c->next : m->header_size;
+	const uint64_t *hdr;
+	uint64_t len;
+
+	if (off + 16 > m->size)
+		return false;
+	hdr = (const uint64_t *)(m->map + off);
+	if (hdr[0] > (m->size - off) / 8 / m->nr_columns || hdr[1] % 8)
+		return false;
+	len = 16 + hdr[0] * 8 * m->nr_columns + hdr[1];
+	if (len > m->size - off)
+		return false;
+
+	c->nr_rows = hdr[0];
+	c->data = hdr + 2;
+	c->strtab = (const char *)(c->data + hdr[0] * m->nr_columns);
+	c->strtab_size = hdr[1];
+	if (c->strtab_size && c->strtab[c->strtab_size - 1])
+		return false;
+	c->next = off + len;
+	return true;
+}
@@ -0,0 +1,52 @@
+#include <sampler.h>
+
+static uint64_t splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+void sampler_init(struct sampler *sm, uint64_t seed, uint64_t stream)
+{
+	uint64_t x = seed ^ (stream * 0xd1b54a32d192ed03ULL);
+	int i, lane;
+
+	for (lane = 0; lane < SAMPLER_LANES; lane++)
+		for (i = 0; i < 4; i++)
+			sm->s[i][lane] = splitmix64(&x);
+	sm->pos = SAMPLER_BLOCK;
+}
+
+#define rotl(x, k) (((x) << (k)) | ((x) >> (64 - (k))))
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target_clones("avx2", "default")))
+#endif
+void __sampler_refill(struct sampler *sm)
+{
+	sampler_vec_t s0 = sm->s[0], s1 = sm->s[1];
+	sampler_vec_t s2 = sm->s[2], s3 = sm->s[3];
+	int i, lane;
+
+	for (i = 0; i < SAMPLER_BLOCK; i += SAMPLER_LANES) {
+		sampler_vec_t r = rotl(s1 * 5, 7) * 9;
+		sampler_vec_t t = s1 << 17;
+
+		s2 ^= s0;
+		s3 ^= s1;
+		s1 ^= s2;
+		s0 ^= s3;
+		s2 ^= t;
+		s3 = rotl(s3, 45);
+		for (lane = 0; lane < SAMPLER_LANES; lane++)
+			sm->buf[i + lane] = r[lane];
+	}
+	sm->s[0] = s0;
+	sm->s[1] = s1;
+	sm->s[2] = s2;
+	sm->s[3] = s3;
+	sm->pos = 0;
+}
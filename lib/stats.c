@@ -0,0 +1,160 @@
+#include <errno.h>
+#include <time-simulator.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Events per second is over at least this much wall time. */
+#define STATS_RATE_NS (NSEC_PER_SEC / 10)
+/* A writer that died halfway through an update leaves seq odd for good. */
+#define STATS_READ_TRIES 100000
+
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * (uint64_t)NSEC_PER_SEC + ts.tv_nsec;
+}
+
+void stats_free(struct stats *st)
+{
+	if (!st)
+		return;
+	munmap(st->page, sizeof(*st->page));
+	free(st);
+}
+
+int time_simulator_stats(struct time_simulator *s, const char *path)
+{
+	struct stats *st;
+	void *page;
+	int fd, ret = 0;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -errno;
+	if (ftruncate(fd, sizeof(struct stats_page))) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+	page = mmap(NULL, sizeof(struct stats_page), PROT_READ | PROT_WRITE,
+		    MAP_SHARED, fd, 0);
+	if (page == MAP_FAILED)
+		ret = -errno;
+	close(fd);
+	if (ret)
+		return ret;
+
+	st = calloc(1, sizeof(*st));
+	if (!st) {
+		munmap(page, sizeof(struct stats_page));
+		return -ENOMEM;
+	}
+	st->page = page;
+	memcpy(st->page->magic, STATS_MAGIC, sizeof(st->page->magic));
+	st->gauges_gen = UINT_MAX;
+	st->last_events = s->nr_dispatched;
+	st->last_wall = clock_ns(CLOCK_MONOTONIC);
+	stats_free(s->stats);
+	s->stats = st;
+	__stats_publish(s);
+	return 0;
+}
+
+void __stats_publish(struct time_simulator *s)
+{
+	struct stats *st = s->stats;
+	struct stats_page *p = st->page;
+	uint64_t seq = p->seq;
+	uint64_t now = clock_ns(CLOCK_MONOTONIC);
+	struct gauge *gauge;
+	bool names = st->gauges_gen != s->gauges.gen;
+	uint32_t i = 0;
+
+	__atomic_store_n(&p->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	p->pid = getpid();
+	p->time = s->time;
+	p->events = s->nr_dispatched;
+	if (now - st->last_wall >= STATS_RATE_NS) {
+		p->events_per_sec = (s->nr_dispatched - st->last_events) *
+			NSEC_PER_SEC / (now - st->last_wall);
+		st->last_events = s->nr_dispatched;
+		st->last_wall = now;
+	}
+	p->queued = s->nr_queued;
+	p->sleepers = s->nr_sleepers;
+	p->runs = s->nr_clears;
+	p->wall = clock_ns(CLOCK_REALTIME);
+	list_for_each_entry(gauge, &s->gauges.list, list) {
+		if (i == STATS_MAX_GAUGES)
+			break;
+		if (names) {
+			strncpy(p->gauges[i].name, gauge->name,
+				STATS_NAME_LEN - 1);
+			p->gauges[i].name[STATS_NAME_LEN - 1] = '\0';
+		}
+		p->gauges[i++].value = gauge->read(s, gauge->priv);
+	}
+	p->nr_gauges = i;
+
+	__atomic_store_n(&p->seq, seq + 2, __ATOMIC_RELEASE);
+	st->gauges_gen = s->gauges.gen;
+	st->next = s->nr_dispatched + STATS_BATCH;
+}
+
+struct stats_page *stats_page_map(const char *path)
+{
+	struct stats_page *page;
+	struct stat sb;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &sb) || sb.st_size < sizeof(*page)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (page == MAP_FAILED)
+		return NULL;
+	if (memcmp(page->magic, STATS_MAGIC, sizeof(page->magic))) {
+		munmap(page, sizeof(*page));
+		errno = EINVAL;
+		return NULL;
+	}
+	return page;
+}
+
+void stats_page_unmap(struct stats_page *page)
+{
+	munmap(page, sizeof(*page));
+}
+
+int stats_page_read(const struct stats_page *page, struct stats_page *copy)
+{
+	uint64_t seq;
+	int i;
+
+	for (i = 0; i < STATS_READ_TRIES; i++) {
+		seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(copy, page, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq)
+			return 0;
+	}
+	return -EAGAIN;
+}
@@ -1,59 +1,326 @@
 #include <errno.h>
 #include <time-simulator.h>
+#include <calendar.h>
+#include <kernel/rbtree_augmented.h>
+#include <trace.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
-static void tree_insert(struct time_simulator *s, struct entity *e)
+/* Time first, then lane, then enqueue order, so no two entities tie. */
+static bool entity_before(struct entity *a, struct entity *b)
 {
-	struct rb_node **p = &s->entities.rb_node;
+	if (a->wake_time != b->wake_time)
+		return a->wake_time < b->wake_time;
+	if (a->lane != b->lane)
+		return a->lane < b->lane;
+	return a->seq < b->seq;
+}
+
+/* Out of range classes are in none, rather than shifting past the mask. */
+static inline uint32_t class_bit(unsigned int event_class)
+{
+	return event_class < NR_EVENT_CLASSES ? 1U << event_class : 0;
+}
+
+#define subtree_nr(node) \
+	((node) ? rb_entry((node), struct entity, n)->subtree_nr : 0)
+#define subtree_classes(node) \
+	((node) ? rb_entry((node), struct entity, n)->subtree_classes : 0)
+
+/* Recompute @e's aggregates from its children, false if they didn't change. */
+static inline bool subtree_update(struct entity *e)
+{
+	uint32_t nr = subtree_nr(e->n.rb_left) + subtree_nr(e->n.rb_right) + 1;
+	uint32_t classes = subtree_classes(e->n.rb_left) |
+		subtree_classes(e->n.rb_right) | class_bit(e->event_class);
+
+	if (e->subtree_nr == nr && e->subtree_classes == classes)
+		return false;
+	e->subtree_nr = nr;
+	e->subtree_classes = classes;
+	return true;
+}
+
+static void subtree_propagate(struct rb_node *rb, struct rb_node *stop)
+{
+	while (rb != stop) {
+		if (!subtree_update(rb_entry(rb, struct entity, n)))
+			break;
+		rb = rb_parent(rb);
+	}
+}
+
+static void subtree_copy(struct rb_node *rb_old, struct rb_node *rb_new)
+{
+	struct entity *old = rb_entry(rb_old, struct entity, n);
+	struct entity *new = rb_entry(rb_new, struct entity, n);
+
+	new->subtree_nr = old->subtree_nr;
+	new->subtree_classes = old->subtree_classes;
+}
+
+static void subtree_rotate(struct rb_node *rb_old, struct rb_node *rb_new)
+{
+	subtree_copy(rb_old, rb_new);
+	subtree_update(rb_entry(rb_old, struct entity, n));
+}
+
+static const struct rb_augment_callbacks subtree_callbacks = {
+	subtree_propagate, subtree_copy, subtree_rotate,
+};
+
+static void tree_insert(struct time_simulator *s, struct rb_root *root,
+			struct entity *e)
+{
+	struct rb_node **p = &root->rb_node;
 	struct rb_node *parent = NULL;
 	struct entity *parent_entry;
+	uint32_t class = class_bit(e->event_class);
 
 	while (*p) {
 		parent = *p;
 		parent_entry = rb_entry(parent, struct entity, n);
-		if (e->wake_time <= parent_entry->wake_time)
+		/* Everything on the way down gains @e. */
+		if (s->lookahead) {
+			parent_entry->subtree_nr++;
+			parent_entry->subtree_classes |= class;
+		}
+		if (entity_before(e, parent_entry))
 			p = &parent->rb_left;
 		else
 			p = &parent->rb_right;
 	}
 
 	rb_link_node(&e->n, parent, p);
-	rb_insert_color(&e->n, &s->entities);
+	if (!s->lookahead) {
+		rb_insert_color(&e->n, root);
+		return;
+	}
+	e->subtree_nr = 1;
+	e->subtree_classes = class;
+	rb_insert_augmented(&e->n, root, &subtree_callbacks);
+}
+
+static inline void tree_erase(struct time_simulator *s, struct rb_root *root,
+			      struct entity *e)
+{
+	if (s->lookahead)
+		rb_erase_augmented(&e->n, root, &subtree_callbacks);
+	else
+		rb_erase(&e->n, root);
+}
+
+static inline struct entity *tree_first(struct rb_root *root)
+{
+	struct rb_node *n = rb_first(root);
+
+	return n ? rb_entry(n, struct entity, n) : NULL;
+}
+
+/* Whether @e goes in the calendar rather than s->entities. */
+static inline bool in_calendar(struct time_simulator *s, struct entity *e)
+{
+	return s->cal && s->cal->on && e->lane == ENTITY_LANE_NORMAL;
+}
+
+void __entity_insert(struct time_simulator *s, struct entity *e)
+{
+	if (!in_calendar(s, e)) {
+		tree_insert(s, &s->entities, e);
+		return;
+	}
+	if (calendar_add(s->cal, e))
+		return;
+	s->cal->stats.overflows++;
+	tree_insert(s, &s->cal->later, e);
+}
+
+/*
+ * With the calendar on s->entities only has the other lanes, and the ring
+ * holds everything due before what cal->later holds.
+ */
+static inline struct entity *queue_first(struct time_simulator *s)
+{
+	struct entity *e = tree_first(&s->entities);
+	struct calendar *cal = s->cal;
+	struct entity *c;
+
+	if (!cal || !cal->on)
+		return e;
+	c = cal->nr ? calendar_first(cal) : tree_first(&cal->later);
+	if (c && (!e || entity_before(c, e)))
+		return c;
+	return e;
+}
+
+static inline void queue_del_first(struct time_simulator *s, struct entity *e)
+{
+	if (!in_calendar(s, e))
+		tree_erase(s, &s->entities, e);
+	else if (s->cal->nr)
+		calendar_del_first(s->cal, e);
+	else
+		tree_erase(s, &s->cal->later, e);
+}
+
+/* The clock moved on, bring what the ring reaches now over from the tree. */
+static void queue_advance(struct time_simulator *s)
+{
+	struct calendar *cal = s->cal;
+	struct entity *e;
+
+	cal->base = s->time / cal->quantum;
+	while ((e = tree_first(&cal->later))) {
+		if (!calendar_add(cal, e))
+			break;
+		tree_erase(s, &cal->later, e);
+	}
+}
+
+/* Enough is queued that the ring beats the tree, move the normal lane over. */
+static void queue_calendar_on(struct time_simulator *s)
+{
+	struct rb_node *n, *next;
+
+	s->cal->base = s->time / s->cal->quantum;
+	s->cal->on = true;
+	for (n = rb_first(&s->entities); n; n = next) {
+		struct entity *e = rb_entry(n, struct entity, n);
+
+		next = rb_next(n);
+		if (!in_calendar(s, e))
+			continue;
+		tree_erase(s, &s->entities, e);
+		__entity_insert(s, e);
+	}
+}
+
+static void calendar_to_tree(struct entity *e, void *priv)
+{
+	struct time_simulator *s = priv;
+
+	tree_insert(s, &s->entities, e);
+}
+
+static void queue_calendar_off(struct time_simulator *s)
+{
+	struct calendar *cal = s->cal;
+	struct entity *e;
+
+	calendar_for_each(cal, calendar_to_tree, s);
+	calendar_reset(cal, s->time);
+	while ((e = tree_first(&cal->later))) {
+		tree_erase(s, &cal->later, e);
+		tree_insert(s, &s->entities, e);
+	}
+	cal->on = false;
+}
+
+void __queue_clear(struct time_simulator *s)
+{
+	struct entity *e;
+
+	while ((e = tree_first(&s->entities)))
+		tree_erase(s, &s->entities, e);
+	if (s->cal) {
+		while ((e = tree_first(&s->cal->later)))
+			tree_erase(s, &s->cal->later, e);
+		calendar_reset(s->cal, s->time);
+		s->cal->on = false;
+	}
+	s->nr_queued = 0;
 }
 
 void entity_enqueue(struct time_simulator *s, struct entity *e, uint64_t delta)
 {
 	e->state = ENTITY_RUNNING;
-	e->wake_time = s->time + delta;
-	e->start_time = s->time;
-	if (!s->running || delta)
-		tree_insert(s, e);
+	if (s->cal)
+		e->wake_time = calendar_wake_time(s->cal, s->time, delta);
 	else
-		list_add_tail(&e->list, &s->resched);
+		e->wake_time = s->time + delta;
+	e->seq = s->seq++;
+	e->start_time = s->time;
+	s->nr_queued++;
+	TRACE3(time_simulator, enqueue, e, s->time, delta);
+	if (s->recorder) {
+		time_simulator_record(s, RECORD_ENQUEUE, e, delta);
+		if (s->recorder->max_depth &&
+		    s->nr_queued == s->recorder->max_depth + 1)
+			time_simulator_recorder_dump(s, "queue depth");
+	}
+	if (s->cal && !s->cal->on && s->nr_queued >= CALENDAR_ON)
+		queue_calendar_on(s);
+	__entity_insert(s, e);
 }
 
-void entity_sleep(struct time_simulator *s, struct entity *e)
+/*
+ * Park @e on @queue, whoever owns the queue is responsible for waking it with
+ * entity_wake().  Entities on s->sleepers are woken by time_simulator_wake().
+ */
+void entity_sleep_on(struct time_simulator *s, struct entity *e,
+		     struct list_head *queue)
 {
+	TRACE3(time_simulator, sleep, e, s->time, s->time - e->start_time);
+	time_simulator_record(s, RECORD_SLEEP, e, s->time - e->start_time);
 	e->state = ENTITY_SLEEPING;
 	e->start_time = s->time;
-	list_add_tail(&e->list, &s->sleepers);
+	list_add_tail(&e->list, queue);
+	s->nr_sleepers++;
 }
 
-void time_simulator_wake(struct time_simulator *s,
-			 uint64_t (*wake)(struct time_simulator *s,
-					  struct entity *e))
+void entity_sleep(struct time_simulator *s, struct entity *e)
+{
+	entity_sleep_on(s, e, &s->sleepers);
+}
+
+void entity_wake(struct time_simulator *s, struct entity *e, uint64_t delta)
+{
+	TRACE3(time_simulator, wake, e, s->time, s->time - e->start_time);
+	if (s->recorder) {
+		uint64_t slept = s->time - e->start_time;
+
+		time_simulator_record(s, RECORD_WAKE, e, slept);
+		if (s->recorder->max_sleep && slept > s->recorder->max_sleep)
+			time_simulator_recorder_dump(s, "long sleep");
+	}
+	e->sleep_time += s->time - e->start_time;
+	list_del_init(&e->list);
+	s->nr_sleepers--;
+	entity_enqueue(s, e, delta);
+}
+
+/*
+ * Offer every entity sleeping on @queue to @wake, which returns the delay to
+ * wake it with or UINT64_MAX to leave it asleep.
+ */
+void time_simulator_wake_queue(struct time_simulator *s,
+			       struct list_head *queue,
+			       uint64_t (*wake)(struct time_simulator *s,
+						struct entity *e))
 {
 	struct entity *e, *tmp;
+	uint64_t scanned = 0;
+
+	PROFILE_ADD(s, wakes, 1);
+	list_for_each_entry_safe(e, tmp, queue, list) {
+		uint64_t wake_time;
 
-	list_for_each_entry_safe(e, tmp, &s->sleepers, list) {
-		uint64_t wake_time = wake(s, e);
+		scanned++;
+		PROFILE_CALL(s, wake, wake_time = wake(s, e));
 		if (wake_time == UINT64_MAX)
 			continue;
-		e->sleep_time += s->time - e->start_time;
-		list_del_init(&e->list);
-		entity_enqueue(s, e, wake_time);
+		entity_wake(s, e, wake_time);
 	}
+	PROFILE_ADD(s, preds, scanned);
+	PROFILE_HIST(s, pred_hist, scanned);
+}
+
+void time_simulator_wake(struct time_simulator *s,
+			 uint64_t (*wake)(struct time_simulator *s,
+					  struct entity *e))
+{
+	time_simulator_wake_queue(s, &s->sleepers, wake);
 }
 
 struct time_simulator *
@@ -63,29 +330,44 @@ time_simulator_alloc(void (*free_entity)(struct entity *entity))
 	if (!s)
 		return NULL;
 	s->entities = RB_ROOT;
-	INIT_LIST_HEAD(&s->resched);
 	INIT_LIST_HEAD(&s->sleepers);
 	INIT_LIST_HEAD(&s->entity_list);
+	gauges_init(&s->gauges);
 	s->free_entity = free_entity;
+#ifdef TIME_SIMULATOR_PROFILE
+	s->profile = profile_alloc();
+	if (!s->profile) {
+		free(s);
+		return NULL;
+	}
+#endif
 	return s;
 }
 
+void time_simulator_free(struct time_simulator *s)
+{
+	recorder_free(s->recorder);
+	stats_free(s->stats);
+	checkpointer_free(s->ckpt);
+	calendar_free(s->cal);
+	free(s->profile);
+	free(s);
+}
+
 void entity_init(struct time_simulator *s, struct entity *e)
 {
 	RB_CLEAR_NODE(&e->n);
 	INIT_LIST_HEAD(&e->list);
+	e->lane = ENTITY_LANE_NORMAL;
 	list_add_tail(&e->main_list, &s->entity_list);
 }
 
 void time_simulator_clear(struct time_simulator *s)
 {
-	struct rb_node *n;
-
-	while ((n = rb_first(&s->entities)))
-		rb_erase(n, &s->entities);
+	TRACE3(time_simulator, clear, s, s->time, s->nr_queued);
+	s->time = 0;
+	__queue_clear(s);
 
-	while (!list_empty(&s->resched))
-		list_del_init(s->resched.next);
 	while (!list_empty(&s->sleepers))
 		list_del_init(s->sleepers.next);
 	while (!list_empty(&s->entity_list)) {
@@ -95,7 +377,175 @@ void time_simulator_clear(struct time_simulator *s)
 		list_del_init(&e->main_list);
 		s->free_entity(e);
 	}
-	s->time = 0;
+	gauges_clear(&s->gauges);
+	if (s->recorder)
+		recorder_reset(s->recorder);
+	s->nr_sleepers = 0;
+	s->seq = 0;
+	s->nr_clears++;
+	if (s->cal)
+		memset(&s->cal->stats, 0, sizeof(s->cal->stats));
+	if (s->ckpt)
+		s->ckpt->next = s->ckpt->interval;
+	if (s->stats)
+		__stats_publish(s);
+}
+
+int time_simulator_quantize(struct time_simulator *s, uint64_t quantum,
+			    uint64_t horizon)
+{
+	struct calendar *cal = NULL;
+
+	/* Rounding to 1ns changes nothing, so don't pay for the calendar. */
+	if (quantum <= 1)
+		quantum = 0;
+	if (s->cal ? s->cal->quantum == quantum && s->cal->horizon == horizon :
+	    !quantum)
+		return 0;
+	if (quantum && s->lookahead)
+		return -EINVAL;
+	if (s->nr_queued)
+		return -EBUSY;
+	if (quantum) {
+		cal = calendar_alloc(quantum, horizon);
+		if (!cal)
+			return -ENOMEM;
+		calendar_reset(cal, s->time);
+	}
+	calendar_free(s->cal);
+	s->cal = cal;
+	return 0;
+}
+
+/* How late quantizing made events, against the mean delay they asked for. */
+void time_simulator_print_quantum(struct time_simulator *s)
+{
+	struct calendar_stats *st;
+
+	if (!s->cal || !s->cal->stats.events)
+		return;
+	st = &s->cal->stats;
+	printf("Quantum %lluns: %llu events late avg %lluns max %lluns, %.4f%% of their avg delay %lluns, %llu past the ring\n",
+	       (unsigned long long)s->cal->quantum,
+	       (unsigned long long)st->events,
+	       (unsigned long long)(st->late / st->events),
+	       (unsigned long long)st->max_late,
+	       st->delay ? 100.0 * st->late / st->delay : 0.0,
+	       (unsigned long long)(st->delay / st->events),
+	       (unsigned long long)st->overflows);
+}
+
+void time_simulator_for_each_queued(struct time_simulator *s,
+				    void (*fn)(struct entity *e, void *priv),
+				    void *priv)
+{
+	struct rb_node *n;
+
+	for (n = rb_first(&s->entities); n; n = rb_next(n))
+		fn(rb_entry(n, struct entity, n), priv);
+	if (!s->cal)
+		return;
+	calendar_for_each(s->cal, fn, priv);
+	for (n = rb_first(&s->cal->later); n; n = rb_next(n))
+		fn(rb_entry(n, struct entity, n), priv);
+}
+
+int time_simulator_lookahead(struct time_simulator *s, bool on)
+{
+	if (s->lookahead == on)
+		return 0;
+	if (on && s->cal)
+		return -EINVAL;
+	if (s->nr_queued)
+		return -EBUSY;
+	s->lookahead = on;
+	return 0;
+}
+
+static uint64_t tree_nr_due(struct time_simulator *s, struct rb_root *root,
+			    uint64_t time)
+{
+	struct rb_node *n = root->rb_node;
+	uint64_t nr = 0;
+
+	if (!s->lookahead) {
+		for (n = rb_first(root); n; n = rb_next(n)) {
+			if (rb_entry(n, struct entity, n)->wake_time > time)
+				break;
+			nr++;
+		}
+		return nr;
+	}
+	while (n) {
+		struct entity *e = rb_entry(n, struct entity, n);
+
+		if (e->wake_time <= time) {
+			nr += subtree_nr(n->rb_left) + 1;
+			n = n->rb_right;
+		} else {
+			n = n->rb_left;
+		}
+	}
+	return nr;
+}
+
+uint64_t time_simulator_nr_due(struct time_simulator *s, uint64_t time)
+{
+	uint64_t nr = tree_nr_due(s, &s->entities, time);
+
+	if (s->cal)
+		nr += calendar_nr_due(s->cal, time) +
+			tree_nr_due(s, &s->cal->later, time);
+	return nr;
+}
+
+static struct entity *tree_earliest(struct time_simulator *s,
+				    struct rb_root *root,
+				    unsigned int event_class)
+{
+	struct rb_node *n = root->rb_node;
+	uint32_t class = class_bit(event_class);
+	struct entity *e;
+
+	if (!s->lookahead) {
+		for (n = rb_first(root); n; n = rb_next(n)) {
+			e = rb_entry(n, struct entity, n);
+			if (e->event_class == event_class)
+				return e;
+		}
+		return NULL;
+	}
+	if (!(subtree_classes(n) & class))
+		return NULL;
+	/* Leftmost in order, so keep left whenever the class is down there. */
+	for (;;) {
+		e = rb_entry(n, struct entity, n);
+		if (subtree_classes(n->rb_left) & class)
+			n = n->rb_left;
+		else if (e->event_class == event_class)
+			return e;
+		else
+			n = n->rb_right;
+	}
+}
+
+struct entity *time_simulator_earliest(struct time_simulator *s,
+				       unsigned int event_class)
+{
+	struct entity *e, *c;
+
+	if (event_class >= NR_EVENT_CLASSES)
+		return NULL;
+	e = tree_earliest(s, &s->entities, event_class);
+	if (!s->cal)
+		return e;
+	/* The ring is all due before the later tree. */
+	c = calendar_earliest(s->cal, event_class);
+	if (!c)
+		c = tree_earliest(s, &s->cal->later, event_class);
+	if (c && (!e || entity_before(c, e)))
+		return c;
+	return e;
 }
 
 void time_simulator_print_entity_times(struct time_simulator *s)
@@ -110,44 +560,66 @@ void time_simulator_print_entity_times(struct time_simulator *s)
 	}
 }
 
-static void run_entities(struct time_simulator *s)
+static void record_dispatch(struct time_simulator *s, struct entity *e)
 {
-	struct rb_node *n;
-	struct entity *e, *tmp;
+	struct recorder *r = s->recorder;
 
-	while ((n = rb_first(&s->entities))) {
-		e = rb_entry(n, struct entity, n);
-		if (e->wake_time > s->time)
+	time_simulator_record(s, RECORD_DISPATCH, e, s->time - e->start_time);
+	if (r->predicate && r->predicate(s, r->priv))
+		time_simulator_recorder_dump(s, "model trigger");
+}
+
+/*
+ * Pop the next entity that is due, advancing the clock when everything at the
+ * current time has run.  Returns NULL once the queue is empty or the clock
+ * passed @end (0 runs until the queue drains).
+ */
+struct entity *time_simulator_next(struct time_simulator *s, uint64_t end)
+{
+	struct entity *e;
+
+	for (;;) {
+		e = queue_first(s);
+		if (!e)
 			break;
-		rb_erase(n, &s->entities);
-		e->run_time += s->time - e->start_time;
-		e->run(s, e);
-	}
+		if (e->wake_time <= s->time) {
+			queue_del_first(s, e);
+			PROFILE_HIST(s, depth_hist, s->nr_queued);
+			s->nr_queued--;
+			if (s->cal && s->cal->on && s->nr_queued < CALENDAR_OFF)
+				queue_calendar_off(s);
+			s->nr_dispatched++;
+			TRACE3(time_simulator, dispatch, e, s->time,
+			       s->time - e->start_time);
+			if (s->recorder)
+				record_dispatch(s, e);
+			stats_publish(s);
+			e->run_time += s->time - e->start_time;
+			return e;
+		}
 
-	list_for_each_entry_safe(e, tmp, &s->resched, list) {
-		list_del_init(&e->list);
-		tree_insert(s, e);
+		/* Just jump to the next wake up event. */
+		if (s->ckpt && e->wake_time >= s->ckpt->next)
+			__checkpoint_take(s, e->wake_time);
+		gauges_sample(s, &s->gauges, e->wake_time);
+		s->time = e->wake_time;
+		if (s->cal && s->cal->on)
+			queue_advance(s);
+		if (end && s->time > end)
+			break;
 	}
+	gauges_sample(s, &s->gauges, s->time + 1);
+	if (s->stats)
+		__stats_publish(s);
+	return NULL;
 }
 
 void time_simulator_run(struct time_simulator *s, uint64_t time)
 {
-	struct rb_node *n;
 	struct entity *e;
 
 	if (time)
 		time += s->time;
-	s->running = true;
-	while (!time || (s->time <= time)) {
-		run_entities(s);
-		n = rb_first(&s->entities);
-		if (!n)
-			break;
-		e = rb_entry(n, struct entity, n);
-
-		/* Just jump to the next wake up event. */
-		if (e->wake_time > s->time)
-			s->time = e->wake_time;
-	}
-	s->running = false;
+	while ((e = time_simulator_next(s, time)))
+		PROFILE_CALL(s, e->run, e->run(s, e));
 }
@@ -0,0 +1,221 @@
+#include <time-simulator-coro.hpp>
+#include <sampler.h>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <unistd.h>
+
+/*
+ * A btrfs transaction model written with coroutine entities.  Writers join
+ * the running transaction, do some work and generate delayed refs, and get
+ * throttled when the backlog grows too large.  An async flusher drains the
+ * refs, and every 30 seconds the commit goes through its phases: block new
+ * writers, wait for the running ones, run the remaining delayed refs and
+ * write out the transaction.
+ */
+#define COMMIT_INTERVAL (30ULL * NSEC_PER_SEC)
+#define WRITER_PERIOD (NSEC_PER_SEC >> 4)
+#define WRITER_WORK (NSEC_PER_SEC >> 8)
+#define COMMIT_WRITE_TIME (NSEC_PER_SEC >> 6)
+#define MAX_REFS 20
+#define THROTTLE_REFS 64
+
+enum commit_phase {
+	PHASE_BLOCK,
+	PHASE_WAIT_WRITERS,
+	PHASE_RUN_REFS,
+	PHASE_WRITE,
+	NR_PHASES,
+};
+
+static const char *phase_names[NR_PHASES] = {
+	"block writers",
+	"wait for writers",
+	"run delayed refs",
+	"write transaction",
+};
+
+struct model {
+	struct time_simulator *s;
+	uint64_t horizon;
+	bool stop;
+
+	ts::mutex trans_lock;
+	ts::counter joins;
+	ts::counter exits;
+	ts::counter flushed;
+	ts::counter kick;
+	uint64_t queued;
+	/* Refs someone took to flush, flushed <= claimed <= queued. */
+	uint64_t claimed;
+
+	uint64_t ops;
+	uint64_t throttle_time;
+	uint64_t throttles;
+	uint64_t commits;
+	uint64_t phase_time[NR_PHASES];
+};
+
+static uint64_t percentile_table[100];
+static struct sampler refs_stream;
+static struct sampler flush_stream;
+
+static ts::process writer(model &m)
+{
+	while (!m.stop) {
+		co_await ts::sleep_for{WRITER_PERIOD};
+
+		/* Joining blocks while the commit holds the transaction. */
+		co_await ts::lock{m.trans_lock};
+		m.joins.add(1);
+		m.trans_lock.unlock();
+
+		co_await ts::sleep_for{WRITER_WORK};
+		m.queued += sampler_bounded(&refs_stream, MAX_REFS);
+		m.ops++;
+		m.exits.add(1);
+		m.kick.add(1);
+
+		if (m.queued > m.flushed.value() + THROTTLE_REFS) {
+			uint64_t start = m.s->time;
+			uint64_t target = m.queued > THROTTLE_REFS / 2 ?
+				m.queued - THROTTLE_REFS / 2 : 0;
+
+			co_await ts::wait_until{m.flushed, target};
+			m.throttle_time += m.s->time - start;
+			m.throttles++;
+		}
+	}
+}
+
+static ts::process async_flusher(model &m)
+{
+	for (;;) {
+		if (m.claimed >= m.queued) {
+			co_await ts::wait_until{m.kick, m.kick.value() + 1};
+			continue;
+		}
+		m.claimed++;
+		co_await ts::sleep_for{sampler_table(&flush_stream,
+						     percentile_table, 100)};
+		m.flushed.add(1);
+	}
+}
+
+static ts::process committer(model &m)
+{
+	while (m.s->time < m.horizon) {
+		uint64_t start, target;
+
+		co_await ts::sleep_for{COMMIT_INTERVAL};
+
+		start = m.s->time;
+		co_await ts::lock{m.trans_lock};
+		m.phase_time[PHASE_BLOCK] += m.s->time - start;
+
+		start = m.s->time;
+		co_await ts::wait_until{m.exits, m.joins.value()};
+		m.phase_time[PHASE_WAIT_WRITERS] += m.s->time - start;
+
+		/* The commit runs delayed refs alongside the async flusher. */
+		start = m.s->time;
+		target = m.queued;
+		while (m.claimed < target) {
+			m.claimed++;
+			co_await ts::sleep_for{sampler_table(&flush_stream,
+							     percentile_table,
+							     100)};
+			m.flushed.add(1);
+		}
+		/* The async flusher may still be on the last of them. */
+		co_await ts::wait_until{m.flushed, target};
+		m.phase_time[PHASE_RUN_REFS] += m.s->time - start;
+
+		start = m.s->time;
+		co_await ts::sleep_for{COMMIT_WRITE_TIME};
+		m.phase_time[PHASE_WRITE] += m.s->time - start;
+
+		m.commits++;
+		m.trans_lock.unlock();
+	}
+	m.stop = true;
+}
+
+static void init_percentile_table(uint64_t max)
+{
+	int i;
+
+	percentile_table[99] = max;
+	max >>= 1;
+	for (i = 91; i < 98; i++)
+		percentile_table[i] = max;
+	for (i = 90; i >= 0; i--) {
+		if (!(i % 10))
+			max >>= 1;
+		percentile_table[i] = max;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t horizon = 300ULL * NSEC_PER_SEC;
+	int nr_writers = 10;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "t:w:")) != -1) {
+		switch (opt) {
+		case 't':
+			horizon = strtoull(optarg, NULL, 0) * NSEC_PER_SEC;
+			break;
+		case 'w':
+			nr_writers = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-t seconds] [-w writers]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (nr_writers < 1) {
+		fprintf(stderr, "Need at least one writer\n");
+		return 1;
+	}
+
+	init_percentile_table(NSEC_PER_SEC >> 6);
+	sampler_init(&refs_stream, 1, 0);
+	sampler_init(&flush_stream, 1, 1);
+
+	/* Destroyed in reverse, so the simulator goes before what it links. */
+	model m{};
+	std::unique_ptr<ts::coro_entity[]> writers(
+		new ts::coro_entity[nr_writers]);
+	ts::coro_entity flusher, commit;
+	ts::simulator<ts::coro_entity> sim;
+
+	m.s = sim.get();
+	m.horizon = horizon;
+	for (i = 0; i < nr_writers; i++) {
+		sim.add(writers[i]);
+		writers[i].start(m.s, writer(m));
+	}
+	sim.add(flusher);
+	flusher.start(m.s, async_flusher(m));
+	sim.add(commit);
+	commit.start(m.s, committer(m));
+
+	sim.run();
+
+	printf("%d writers, %llu commits in %llus\n", nr_writers,
+	       (unsigned long long)m.commits,
+	       (unsigned long long)(sim.time() / NSEC_PER_SEC));
+	printf("Writers did %f ops per second each\n",
+	       (double)m.ops * NSEC_PER_SEC / sim.time() / nr_writers);
+	if (m.throttles)
+		printf("Throttled %llu times, avg %lluns\n",
+		       (unsigned long long)m.throttles,
+		       (unsigned long long)(m.throttle_time / m.throttles));
+	for (i = 0; i < NR_PHASES && m.commits; i++)
+		printf("Commit phase %-18s avg %lluns\n", phase_names[i],
+		       (unsigned long long)(m.phase_time[i] / m.commits));
+	return 0;
+}
@@ -1,47 +1,300 @@
 #include <time-simulator.h>
+#include <bucket.h>
+#include <cache.h>
+#include <device.h>
+#include <quantile.h>
+#include <results.h>
+#include <sampler.h>
+#include <trace.h>
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <signal.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "scenario.h"
 
 #define MIN_RUNTIME 1
 #define MAX_RUNTIME (NSEC_PER_SEC >> 1)
 
-struct fs_state {
-	uint64_t num_entries;
-	uint64_t avg_time_per_run;
+#define RUN_TEST	(1 << 0)
+#define RUN_QUANTILE	(1 << 1)
+#define RUN_RATE	(1 << 2)
+
+#define DEFAULT_RUN_PERIOD (NSEC_PER_SEC >> 4)
+#define DEFAULT_MAX_REFS 20
+#define DEFAULT_COMMIT_INTERVAL (30ULL * NSEC_PER_SEC)
+#define DEFAULT_FLUSH_MAX (NSEC_PER_SEC >> 1)
+/* A read and a write at half a table draw each cost a ref at queue depth 1. */
+#define DEFAULT_IO_COST 50
+
+#define DEFAULT_DIRTY_BACKGROUND 1024
+#define DEFAULT_DIRTY_LIMIT 2048
+#define DEFAULT_WRITEBACK_BATCH 64
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define MAX_ASYNC_WORKERS 64
+#define ASYNC_CONTENTION_PCT 10
+/* Flushed refs the quantile policy's p90 is over, one to two of these. */
+#define FLUSH_WINDOW 256
+
+#define MAX_ENSEMBLE SCENARIO_MAX_SEEDS
+
+#define GAUGE_INTERVAL (NSEC_PER_SEC / 100)
+#define GAUGE_BUCKETS 4096
+
+#define MAX_COMMITS 64
+
+/*
+ * Scaling points simulate a fixed window, long enough for one commit and
+ * its flushing, and get SCALING_BUDGET seconds of CPU each.
+ */
+#define SCALING_WINDOW (2 * DEFAULT_COMMIT_INTERVAL)
+#define SCALING_BUDGET 60
+
+#define RECORDER_EVENTS (1 << 16)
+#define RECORDER_MAX_SLEEP (10ULL * NSEC_PER_SEC)
+
+#define DEFAULT_CHECKPOINT_INTERVAL (300ULL * NSEC_PER_SEC)
+#define CHECKPOINT_ARGS_LEN 1024
+
+enum {
+	REC_FLUSH = RECORD_MODEL,
+	REC_THROTTLE,
+	REC_COMMIT,
+};
+
+static const char *const rec_names[] = { "flush", "throttle", "commit" };
+
+/*
+ * Where workers spend simulated time.  A worker is in one phase at a time,
+ * each transition charges the time since the last one to the phase it
+ * leaves, and at the end of a run every worker's totals go to its policy.
+ */
+enum worker_phase {
+	PHASE_RUNNING,			/* between ops */
+	PHASE_THROTTLED,		/* waiting on refs or ref tokens */
+	PHASE_LOCKED,			/* parked until the commit is over */
+	PHASE_INLINE_FLUSH,
+	PHASE_DIRTY,			/* in balance_dirty_pages() */
+	NR_PHASES,
+};
+
+static const char *const phase_names[NR_PHASES] = {
+	[PHASE_RUNNING] = "running",
+	[PHASE_THROTTLED] = "throttled",
+	[PHASE_LOCKED] = "transaction_locked",
+	[PHASE_INLINE_FLUSH] = "inline_flush",
+	[PHASE_DIRTY] = "dirty_throttled",
+};
+
+/* One transaction commit, from kicking it off to the last ref flushed. */
+struct commit_stat {
+	uint64_t start;
+	uint64_t refs;
+	uint64_t flushed;
+	uint64_t duration;
+};
+
+/*
+ * A group of workers sharing a period, ref distribution and throttle policy.
+ * Every filesystem gets nr_workers of them, the counters are over all of
+ * them.
+ */
+struct worker_class {
+	const char *name;
+	void (*run)(struct time_simulator *s, struct entity *e);
+	unsigned int flags;		/* RUN_* of its policy */
+	int nr_workers;
+	uint64_t run_period;
 	uint64_t min_refs;
 	uint64_t max_refs;
-	uint64_t run_period;
-	uint64_t entity_throttle_time;
-	uint64_t entity_ops;
-	uint64_t refs_seq;
-	bool transaction_locked;
-	bool async_running;
-	bool test;
+
+	uint64_t ops;
+	uint64_t throttle_time;
+	uint64_t throttle_events;
+	struct quantile throttle_p99;
 };
 
 struct normal_entity {
 	struct entity e;
+	struct fs_state *fs;
+	struct worker_class *wc;
 	uint64_t throttled_time;
 	int state;
 
 	uint64_t nr_to_flush;
 	uint64_t flush_time;
 	uint64_t flushed;
+	uint64_t claimed;
+	bool async;
+	bool running;
 
 	struct list_head l;
+	struct device_request rq;
+	struct bucket_waiter wait;
+	uint64_t io_start;
+	uint64_t dirty_start;
+
+	int phase;
+	uint64_t phase_start;
+	uint64_t phase_time[NR_PHASES];
+};
+
+/*
+ * One filesystem: its transaction, async flushers, writeback and everything
+ * they count.  Every filesystem in a run has its own workers and wait
+ * queues and only shares the device and the clock with the others.
+ */
+struct fs_state {
+	int id;
+	uint64_t num_entries;
+	uint64_t avg_time_per_run;
+	uint64_t entity_throttle_time;
+	uint64_t entity_ops;
+	uint64_t refs_seq;
+	uint64_t claimed;
+	uint64_t next_block;
+	uint64_t throttle_time;
+	uint64_t throttle_events;
+	struct quantile throttle_p99;
+	struct quantile flush_p50;
+	struct quantile flush_p90;
+	struct quantile flush_p99;
+	struct quantile_window recent_p90;
+	struct commit_stat commits[MAX_COMMITS];
+	int nr_commits;
+	uint64_t dirty;
+	uint64_t writeback;
+	uint64_t written;
+	uint64_t dirty_throttle_time;
+	uint64_t dirty_throttle_events;
+	struct quantile dirty_throttle_p99;
+	bool writeback_running;
+	bool writeback_sync;
+	int nr_async_workers;
+	int nr_async_running;
+	bool transaction_locked;
+	unsigned int flags;		/* RUN_* of all its classes */
+
+	struct normal_entity commit_entity;
+	struct normal_entity writeback_entity;
+	struct normal_entity async_workers[MAX_ASYNC_WORKERS];
+	struct list_head sleepers;
+	struct list_head io_waiters;
+	struct list_head dirty_waiters;
+	struct bucket ref_bucket;
+};
+
+struct run_result {
+	double ops_per_sec;
+	uint64_t total_time;
+	uint64_t throttle_avg;
+	uint64_t throttle_p99;
+};
+
+/* Per-replication results of one scenario, one array per metric. */
+struct ensemble {
+	int nr;
+	unsigned int seed[MAX_ENSEMBLE];
+	double ops_per_sec[MAX_ENSEMBLE];
+	double throttle_avg[MAX_ENSEMBLE];
+	double throttle_p99[MAX_ENSEMBLE];
 };
 
-static struct fs_state state;
-static struct normal_entity trans_commit_entity;
-static struct normal_entity async_worker;
+static struct fs_state *filesystems;
+static int nr_filesystems = 1;
+static int filesystems_size;
+/* Run wide counters and quantiles, only kept with more than one filesystem. */
+static struct fs_state totals;
+static int nr_async_flushers = 1;
 static uint64_t percentile_table[100];
+static uint64_t *flush_table = percentile_table;
+static uint64_t commit_interval = DEFAULT_COMMIT_INTERVAL;
+static uint64_t flush_thresh = NSEC_PER_SEC;
+static uint64_t kick_thresh;
+static struct normal_entity *arena;
+static int arena_size;
+static int arena_used;
+static struct sampler refs_stream;
+static struct sampler flush_stream;
+static struct sampler io_stream;
+static struct device device;
+static unsigned int queue_depth;
+/* Wake times are rounded up to this, 0 keeps them exact. */
+static uint64_t quantum;
+static unsigned int max_merge;
+static unsigned int read_cost = DEFAULT_IO_COST;
+static unsigned int write_cost = DEFAULT_IO_COST;
+static uint64_t dirty_per_op;
+static uint64_t dirty_background = DEFAULT_DIRTY_BACKGROUND;
+static uint64_t dirty_limit = DEFAULT_DIRTY_LIMIT;
+static uint64_t writeback_batch = DEFAULT_WRITEBACK_BATCH;
+static const char *gauge_dir;
+static const char *results_dir;
+static const char *recorder_dir;
+static const char *stats_file;
+static const char *phase_file;
+/* Worker time by phase over every run so far, in ns. */
+static uint64_t phase_totals[NR_POLICIES][NR_PHASES];
+static struct results run_results;
+static struct results class_results;
+static struct results commit_results;
+static struct results fs_results;
+static uint64_t cur_seed;
+static FILE *record;
+static const char *cache_dir;
+static uint64_t cache_hits;
+static uint64_t cache_misses;
+static uint64_t flush_max = DEFAULT_FLUSH_MAX;
+/* Simulated time a run is cut off at, 0 runs until the last commit drains. */
+static uint64_t run_limit;
+static bool quiet;
+static const char *checkpoint_file;
+static uint64_t checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+/* The command line a checkpoint was taken with, only it can resume it. */
+static char checkpoint_args[CHECKPOINT_ARGS_LEN];
+/*
+ * Results of every run finished so far, saved with each checkpoint so a
+ * resume can hand them out again for the runs before the checkpointed one
+ * instead of simulating them.
+ */
+static struct run_result *done_runs;
+static uint64_t nr_done_runs;
+static uint64_t done_runs_size;
+static uint64_t nr_resume_runs;
+static struct checkpoint resume;
+static bool resuming;
+static struct worker_class *cur_classes;
+static int cur_nr_classes;
+
+static void normal_checkpoint(struct checkpoint *c, struct entity *e);
+
+static const struct entity_ops normal_ops = {
+	.checkpoint = normal_checkpoint,
+};
 
+/* Batch runs carve their workers out of one arena sized for the file. */
 static struct normal_entity *alloc_entity(struct time_simulator *s)
 {
-	struct normal_entity *n = calloc(1, sizeof(struct normal_entity));
+	struct normal_entity *n;
+
+	if (arena_used < arena_size) {
+		n = &arena[arena_used++];
+		memset(n, 0, sizeof(*n));
+	} else {
+		n = calloc(1, sizeof(struct normal_entity));
+		if (!n)
+			return NULL;
+	}
 	entity_init(s, &n->e);
+	n->e.ops = &normal_ops;
 	return n;
 }
 
@@ -49,7 +302,9 @@ static void free_entity(struct entity *e)
 {
 	struct normal_entity *n = container_of(e, struct normal_entity, e);
 
-	if (n == &async_worker || n == &trans_commit_entity)
+	if (((void *)n >= (void *)filesystems &&
+	     (void *)n < (void *)(filesystems + filesystems_size)) ||
+	    (n >= arena && n < arena + arena_size))
 		return;
 	free(n);
 }
@@ -72,73 +327,202 @@ static void enqueue_sleeping_tasks(struct time_simulator *s)
 			       (uint64_t)NSEC_PER_SEC * 30);
 }
 */
-static bool need_flush(bool throttle)
+
+static void worker_phase(struct time_simulator *s, struct normal_entity *n,
+			 int phase)
+{
+	n->phase_time[n->phase] += s->time - n->phase_start;
+	n->phase_start = s->time;
+	n->phase = phase;
+}
+
+/* After an op a worker waits out its period, unless a commit parks it. */
+static void worker_wait(struct time_simulator *s, struct normal_entity *n)
+{
+	if (n->fs->transaction_locked) {
+		worker_phase(s, n, PHASE_LOCKED);
+		return;
+	}
+	worker_phase(s, n, PHASE_RUNNING);
+	entity_enqueue(s, &n->e, n->wc->run_period);
+}
+
+/*
+ * Estimated time to drain the current backlog.  The quantile policy sizes it
+ * off the p90 of recent per-ref flush times instead of the running mean.
+ */
+static uint64_t backlog_time(struct fs_state *fs, unsigned int flags)
+{
+	uint64_t per_ref = fs->avg_time_per_run;
+
+	if ((flags & RUN_QUANTILE) && fs->flush_p90.count)
+		per_ref = quantile_window_get(&fs->recent_p90);
+	return fs->num_entries * per_ref;
+}
+
+static bool need_flush(struct fs_state *fs, unsigned int flags, bool throttle)
 {
-	uint64_t time = state.num_entries * state.avg_time_per_run;
+	uint64_t time = backlog_time(fs, flags);
 
-	if (time >= NSEC_PER_SEC)
+	if (time >= flush_thresh)
 		return true;
 	if (!throttle)
 		return false;
-	return (time >= (NSEC_PER_SEC >> 1));
+	return (time >= (kick_thresh ?: NSEC_PER_SEC >> 1));
 }
 
-static bool need_flush_test(bool throttle)
+static bool need_flush_test(struct fs_state *fs, unsigned int flags,
+			    bool throttle)
 {
-	uint64_t time = state.num_entries * state.avg_time_per_run;
+	uint64_t time = backlog_time(fs, flags);
 
-	if (time >= NSEC_PER_SEC)
+	if (time >= flush_thresh)
 		return true;
 	if (!throttle)
 		return false;
-	return (time >= (NSEC_PER_SEC >> 2));
+	return (time >= (kick_thresh ?: NSEC_PER_SEC >> 2));
+}
+
+static void throttle_done(struct time_simulator *s, struct normal_entity *n)
+{
+	struct fs_state *fs = n->fs;
+	uint64_t latency = s->time - n->flush_time;
+
+	worker_phase(s, n, PHASE_RUNNING);
+	fs->throttle_time += latency;
+	fs->throttle_events++;
+	quantile_add(&fs->throttle_p99, latency);
+	if (nr_filesystems > 1)
+		quantile_add(&totals.throttle_p99, latency);
+	n->wc->throttle_time += latency;
+	n->wc->throttle_events++;
+	quantile_add(&n->wc->throttle_p99, latency);
 }
 
 static uint64_t wake_sleeper(struct time_simulator *s, struct entity *e)
 {
 	struct normal_entity *n = container_of(e, struct normal_entity, e);
 
-	if (state.num_entries == 0 || n->nr_to_flush == state.refs_seq)
-		return state.run_period;
+	if (n->fs->num_entries == 0 || n->nr_to_flush == n->fs->refs_seq) {
+		throttle_done(s, n);
+		return n->wc->run_period;
+	}
 	return UINT64_MAX;
 }
 
+/* Sleepers of other classes on the same filesystem keep their own rule. */
 static uint64_t test_wake_sleeper(struct time_simulator *s, struct entity *e)
 {
 	struct normal_entity *n = container_of(e, struct normal_entity, e);
 
-	if (need_flush_test(false) || n->nr_to_flush == state.refs_seq)
-		return state.run_period;
+	if (!(n->wc->flags & RUN_TEST))
+		return wake_sleeper(s, e);
+	if (need_flush_test(n->fs, n->wc->flags, false) ||
+	    n->nr_to_flush == n->fs->refs_seq) {
+		throttle_done(s, n);
+		return n->wc->run_period;
+	}
 	return UINT64_MAX;
 }
 
+/* Account one ref that took @time to flush and wake whoever waited on it. */
+static void flush_done(struct time_simulator *s, struct normal_entity *n,
+		       uint64_t time)
+{
+	struct fs_state *fs = n->fs;
+
+	n->throttled_time += time;
+	n->flush_time += time;
+	n->flushed++;
+	fs->refs_seq++;
+	quantile_add(&fs->flush_p50, time);
+	quantile_add(&fs->flush_p90, time);
+	quantile_add(&fs->flush_p99, time);
+	quantile_window_add(&fs->recent_p90, time);
+	if (nr_filesystems > 1) {
+		quantile_add(&totals.flush_p50, time);
+		quantile_add(&totals.flush_p90, time);
+		quantile_add(&totals.flush_p99, time);
+	}
+
+	if (fs->flags & RUN_TEST)
+		time_simulator_wake_queue(s, &fs->sleepers, test_wake_sleeper);
+	else
+		time_simulator_wake_queue(s, &fs->sleepers, wake_sleeper);
+}
+
+/*
+ * With a device a ref is a read of the extent tree leaf followed by the COW
+ * write of it.  Writes go to freshly allocated, so sequential, blocks and
+ * are the ones that can merge.
+ */
+static void flush_end_io(struct time_simulator *s, struct device_request *rq)
+{
+	struct normal_entity *n = container_of(rq, struct normal_entity, rq);
+	uint64_t time;
+
+	if (rq->dir == DEVICE_READ) {
+		device_submit(s, &device, rq, DEVICE_WRITE,
+			      n->fs->next_block++, 1);
+		return;
+	}
+	time = s->time - n->io_start;
+	TRACE3(btrfs_throttle, flush, n, s->time, time);
+	time_simulator_record(s, REC_FLUSH, n, time);
+	flush_done(s, n, time);
+	entity_wake(s, &n->e, 0);
+}
+
+/*
+ * Take one ref off the backlog.  An async flusher's claim shrinks with it,
+ * so the others see the refs it still has to go rather than its whole batch.
+ */
+static void take_ref(struct fs_state *fs, struct normal_entity *n)
+{
+	fs->num_entries--;
+	n->nr_to_flush--;
+	if (n->claimed) {
+		n->claimed--;
+		fs->claimed--;
+	}
+}
+
 static int do_flushing(struct time_simulator *s, struct normal_entity *n)
 {
+	struct fs_state *fs = n->fs;
 	uint64_t time;
 
-	if (!state.num_entries || !n->nr_to_flush) {
+	if (!fs->num_entries || !n->nr_to_flush) {
 		n->nr_to_flush = 0;
 		return 1;
 	}
 
-	time = percentile_table[random() % 100];;
-	state.num_entries--;
-	n->nr_to_flush--;
+	if (queue_depth) {
+		take_ref(fs, n);
+		n->io_start = s->time;
+		n->rq.end_io = flush_end_io;
+		device_submit(s, &device, &n->rq, DEVICE_READ,
+			      sampler_next(&io_stream), 1);
+		entity_sleep_on(s, &n->e, &fs->io_waiters);
+		return 0;
+	}
 
-	n->throttled_time += time;
-	n->flush_time += time;
-	n->flushed++;
-	state.refs_seq++;
+	time = sampler_table(&flush_stream, flush_table, 100);
 
-	if (state.test)
-		time_simulator_wake(s, test_wake_sleeper);
-	else
-		time_simulator_wake(s, wake_sleeper);
+	/* Concurrent async flushers slow each other down. */
+	if (n->async && fs->nr_async_running > 1)
+		time += time * ASYNC_CONTENTION_PCT *
+			(fs->nr_async_running - 1) / 100;
+	TRACE3(btrfs_throttle, flush, n, s->time, time);
+	time_simulator_record(s, REC_FLUSH, n, time);
+	take_ref(fs, n);
+
+	flush_done(s, n, time);
 	entity_enqueue(s, &n->e, time);
 	return 0;
 }
 
-static void calc_avg_time(uint64_t time, uint64_t nr)
+static void calc_avg_time(struct fs_state *fs, uint64_t time, uint64_t nr)
 {
 	uint64_t avg;
 
@@ -147,50 +531,201 @@ static void calc_avg_time(uint64_t time, uint64_t nr)
 
 	time /= nr;
 
-	avg = state.avg_time_per_run * 3 + time;
+	avg = fs->avg_time_per_run * 3 + time;
 	avg /= 4;
-	state.avg_time_per_run = avg;
+	fs->avg_time_per_run = avg;
+}
+
+/*
+ * Dirty page writeback.  Every worker op dirties dirty_per_op pages, once
+ * dirty plus writeback pages pass dirty_background the writeback entity
+ * writes them out writeback_batch at a time, on the same device the refs
+ * are flushed to, and past dirty_limit workers block in
+ * balance_dirty_pages() until writeback brings them back under the midpoint
+ * of the two thresholds.  A commit writes back everything that was dirty.
+ */
+static uint64_t dirty_total(struct fs_state *fs)
+{
+	return fs->dirty + fs->writeback;
+}
+
+static void kick_writeback(struct time_simulator *s, struct fs_state *fs,
+			   bool sync)
+{
+	if (sync)
+		fs->writeback_sync = true;
+	if (fs->writeback_running)
+		return;
+	fs->writeback_running = true;
+	entity_enqueue(s, &fs->writeback_entity.e, 1);
+}
+
+static void wake_dirty_waiters(struct time_simulator *s, struct fs_state *fs)
+{
+	struct normal_entity *n, *tmp;
+
+	if (dirty_total(fs) > (dirty_background + dirty_limit) / 2)
+		return;
+	list_for_each_entry_safe(n, tmp, &fs->dirty_waiters, e.list) {
+		uint64_t latency = s->time - n->dirty_start;
+
+		fs->dirty_throttle_time += latency;
+		fs->dirty_throttle_events++;
+		quantile_add(&fs->dirty_throttle_p99, latency);
+		if (nr_filesystems > 1)
+			quantile_add(&totals.dirty_throttle_p99, latency);
+		entity_wake(s, &n->e, 0);
+	}
+}
+
+static void writeback_end_io(struct time_simulator *s,
+			     struct device_request *rq)
+{
+	struct normal_entity *n = container_of(rq, struct normal_entity, rq);
+	struct fs_state *fs = n->fs;
+
+	n->throttled_time += s->time - n->io_start;
+	fs->writeback -= n->nr_to_flush;
+	fs->written += n->nr_to_flush;
+	wake_dirty_waiters(s, fs);
+	entity_wake(s, &n->e, 0);
+}
+
+static void writeback_run(struct time_simulator *s, struct entity *e)
+{
+	struct normal_entity *n = container_of(e, struct normal_entity, e);
+	struct fs_state *fs = n->fs;
+
+	if (!fs->dirty)
+		fs->writeback_sync = false;
+	if (!fs->dirty || (!fs->writeback_sync &&
+			   dirty_total(fs) <= dirty_background)) {
+		fs->writeback_running = false;
+		return;
+	}
+	n->nr_to_flush = fs->dirty < writeback_batch ? fs->dirty :
+		writeback_batch;
+	fs->dirty -= n->nr_to_flush;
+	fs->writeback += n->nr_to_flush;
+	n->io_start = s->time;
+	n->rq.end_io = writeback_end_io;
+	device_submit(s, &device, &n->rq, DEVICE_WRITE, fs->next_block,
+		      n->nr_to_flush);
+	fs->next_block += n->nr_to_flush;
+	entity_sleep_on(s, e, &fs->io_waiters);
+}
+
+/*
+ * Called before a worker starts an op.  Returns true if it was blocked on
+ * dirty pages instead, it runs the op as soon as it's woken, and can then
+ * be throttled on refs on top.
+ */
+static bool balance_dirty_pages(struct time_simulator *s,
+				struct normal_entity *n)
+{
+	struct fs_state *fs = n->fs;
+
+	if (!dirty_per_op)
+		return false;
+	if (dirty_total(fs) > dirty_background)
+		kick_writeback(s, fs, false);
+	if (dirty_total(fs) <= dirty_limit)
+		return false;
+	n->dirty_start = s->time;
+	worker_phase(s, n, PHASE_DIRTY);
+	entity_sleep_on(s, &n->e, &fs->dirty_waiters);
+	return true;
 }
 
 static void transaction_run(struct time_simulator *s, struct entity *e)
 {
 	struct normal_entity *n = container_of(e, struct normal_entity, e);
+	struct fs_state *fs = n->fs;
 
 	if (n->state == 0) {
-		n->nr_to_flush = state.num_entries;
+		TRACE3(btrfs_throttle, commit, n, s->time, fs->num_entries);
+		time_simulator_record(s, REC_COMMIT, n, fs->num_entries);
+		if (dirty_per_op && fs->dirty)
+			kick_writeback(s, fs, true);
+		if (fs->nr_commits < MAX_COMMITS) {
+			struct commit_stat *cs = &fs->commits[fs->nr_commits];
+
+			cs->start = s->time;
+			cs->refs = fs->num_entries;
+		}
+		n->nr_to_flush = fs->num_entries;
 		n->flush_time = 0;
 		n->flushed = 0;
 		n->state++;
 	}
 
 	if (n->state == 1 && do_flushing(s, n)) {
-		calc_avg_time(n->flush_time, n->flushed);
-		if (state.transaction_locked) {
+		calc_avg_time(fs, n->flush_time, n->flushed);
+		if (fs->transaction_locked) {
 //			enqueue_sleeping_tasks(s);
+			if (fs->nr_commits < MAX_COMMITS) {
+				struct commit_stat *cs =
+					&fs->commits[fs->nr_commits];
+
+				cs->flushed = n->flushed;
+				cs->duration = s->time - cs->start;
+				fs->nr_commits++;
+			}
 			return;
 		}
-		state.transaction_locked = true;
+		fs->transaction_locked = true;
 		n->nr_to_flush = UINT64_MAX;
 		entity_enqueue(s, e, 1);
 	}
 }
 
+/*
+ * Every flusher claims its share of half of the unclaimed backlog, with a
+ * single flusher this is simply half of the backlog.
+ */
+static bool async_flusher_claim(struct normal_entity *n)
+{
+	struct fs_state *fs = n->fs;
+	uint64_t unclaimed = 0;
+
+	if (fs->num_entries > fs->claimed)
+		unclaimed = fs->num_entries - fs->claimed;
+	n->nr_to_flush = unclaimed / (2 * fs->nr_async_workers);
+	n->claimed = n->nr_to_flush;
+	fs->claimed += n->claimed;
+	return n->nr_to_flush != 0;
+}
+
+static void async_flusher_stop(struct normal_entity *n)
+{
+	n->running = false;
+	n->fs->nr_async_running--;
+}
+
+static void kick_async_flushers(struct time_simulator *s, struct fs_state *fs)
+{
+	int i;
+
+	for (i = 0; i < fs->nr_async_workers; i++) {
+		struct normal_entity *n = &fs->async_workers[i];
+
+		if (n->running)
+			continue;
+		n->running = true;
+		fs->nr_async_running++;
+		entity_enqueue(s, &n->e, 1);
+	}
+}
+
 static void async_flusher_run(struct time_simulator *s, struct entity *e)
 {
 	struct normal_entity *n = container_of(e, struct normal_entity, e);
 
 	if (n->state == 0) {
-		if (state.transaction_locked) {
-			state.async_running = false;
-			return;
-		}
-		if (!need_flush(true)) {
-			state.async_running = false;
-			return;
-		}
-		n->nr_to_flush = state.num_entries >> 1;
-		if (!n->nr_to_flush) {
-			state.async_running = false;
+		if (n->fs->transaction_locked ||
+		    !need_flush(n->fs, n->fs->flags, true) ||
+		    !async_flusher_claim(n)) {
+			async_flusher_stop(n);
 			return;
 		}
 		n->flush_time = 0;
@@ -199,7 +734,10 @@ static void async_flusher_run(struct time_simulator *s, struct entity *e)
 	}
 
 	if (n->state == 1 && do_flushing(s, n)) {
-		calc_avg_time(n->flush_time, n->flushed);
+		/* Whatever the backlog ran out before. */
+		n->fs->claimed -= n->claimed;
+		n->claimed = 0;
+		calc_avg_time(n->fs, n->flush_time, n->flushed);
 		n->state = 0;
 		entity_enqueue(s, e, 1);
 	}
@@ -210,17 +748,10 @@ static void async_flusher_run_test(struct time_simulator *s, struct entity *e)
 	struct normal_entity *n = container_of(e, struct normal_entity, e);
 
 	if (n->state == 0) {
-		if (state.transaction_locked) {
-			state.async_running = false;
-			return;
-		}
-		if (!need_flush_test(true)) {
-			state.async_running = false;
-			return;
-		}
-		n->nr_to_flush = state.num_entries >> 1;
-		if (!n->nr_to_flush) {
-			state.async_running = false;
+		if (n->fs->transaction_locked ||
+		    !need_flush_test(n->fs, n->fs->flags, true) ||
+		    !async_flusher_claim(n)) {
+			async_flusher_stop(n);
 			return;
 		}
 		n->flush_time = 0;
@@ -229,225 +760,2550 @@ static void async_flusher_run_test(struct time_simulator *s, struct entity *e)
 	}
 
 	if (n->state == 1 && do_flushing(s, n)) {
-		calc_avg_time(n->flush_time, n->flushed);
+		/* Whatever the backlog ran out before. */
+		n->fs->claimed -= n->claimed;
+		n->claimed = 0;
+		calc_avg_time(n->fs, n->flush_time, n->flushed);
 		n->state = 0;
 		entity_enqueue(s, e, 1);
 	}
 }
 
-static uint64_t nr_refs(void)
+/* Ref counts and flush latencies come from independent streams. */
+static void seed_random(uint64_t seed)
+{
+	cur_seed = seed;
+	sampler_init(&refs_stream, seed, 0);
+	sampler_init(&flush_stream, seed, 1);
+	sampler_init(&io_stream, seed, 2);
+}
+
+/*
+ * Refs per op, uniform over [min_refs, max_refs].  Classes without a minimum
+ * keep the original [0, max_refs) draw, so their streams don't change.
+ */
+static uint64_t nr_refs(struct worker_class *wc)
+{
+	if (!wc->min_refs)
+		return sampler_bounded(&refs_stream, wc->max_refs);
+	return wc->min_refs + sampler_bounded(&refs_stream,
+					      wc->max_refs - wc->min_refs + 1);
+}
+
+/* One operation by a worker, returns the number of refs it generated. */
+static uint64_t worker_op(struct normal_entity *n)
 {
-	uint64_t refs = (random() % state.max_refs);
-	if (refs < state.min_refs)
-		refs += state.min_refs;
-	if (refs > state.max_refs)
-		refs += state.max_refs;
+	uint64_t refs = nr_refs(n->wc);
+
+	n->fs->num_entries += refs;
+	n->fs->dirty += dirty_per_op;
+	n->fs->entity_ops++;
+	n->wc->ops++;
 	return refs;
 }
 
 static void nothrottle_run(struct time_simulator *s, struct entity *e)
 {
-	uint64_t refs = nr_refs();
-	state.num_entries += refs;
-	state.entity_ops++;
-	if (!state.transaction_locked)
-		entity_enqueue(s, e, state.run_period);
+	struct normal_entity *n = container_of(e, struct normal_entity, e);
+
+	if (balance_dirty_pages(s, n))
+		return;
+	worker_op(n);
+	worker_wait(s, n);
 }
 
 static void async_nothrottle_run(struct time_simulator *s, struct entity *e)
 {
-	uint64_t refs = nr_refs();
-	state.num_entries += refs;
-	state.entity_ops++;
+	struct normal_entity *n = container_of(e, struct normal_entity, e);
 
-	if (!state.transaction_locked)
-		entity_enqueue(s, e, state.run_period);
-	if (!state.async_running && need_flush(false)) {
-		state.async_running = true;
-		entity_enqueue(s, &async_worker.e, 1);
-	}
+	if (balance_dirty_pages(s, n))
+		return;
+	worker_op(n);
+	worker_wait(s, n);
+	if (need_flush(n->fs, n->wc->flags, false))
+		kick_async_flushers(s, n->fs);
 }
 
 static void inline_refs_run(struct time_simulator *s, struct entity *e)
 {
 	struct normal_entity *n = container_of(e, struct normal_entity, e);
-	uint64_t refs = nr_refs();
-
-	state.num_entries += refs;
-	state.entity_ops++;
+	uint64_t refs;
 
+	if (n->state == 0 && balance_dirty_pages(s, n))
+		return;
+	refs = worker_op(n);
 	if (n->state == 0) {
 		n->nr_to_flush = refs;
 		n->state++;
+		worker_phase(s, n, PHASE_INLINE_FLUSH);
 	}
 
 	if (n->state == 1 && do_flushing(s, n)) {
 		n->state = 0;
-		if (!state.transaction_locked)
-			entity_enqueue(s, e, state.run_period);
+		worker_wait(s, n);
 	}
 }
 
 static void throttle_run(struct time_simulator *s, struct entity *e)
 {
 	struct normal_entity *n = container_of(e, struct normal_entity, e);
-	uint64_t refs = nr_refs();
-	state.num_entries += refs;
-	state.entity_ops++;
+	uint64_t refs;
 
-	if (state.transaction_locked)
+	if (balance_dirty_pages(s, n))
 		return;
+	refs = worker_op(n);
 
-	if (need_flush(false)) {
-		if (!state.async_running) {
-			state.async_running = true;
-			entity_enqueue(s, &async_worker.e, 1);
-		}
+	if (n->fs->transaction_locked) {
+		worker_phase(s, n, PHASE_LOCKED);
+		return;
+	}
+
+	if (need_flush(n->fs, n->wc->flags, false)) {
+		kick_async_flushers(s, n->fs);
 		if (refs == 0)
 			refs = 1;
+		TRACE3(btrfs_throttle, throttle, n, s->time, refs);
+		time_simulator_record(s, REC_THROTTLE, n, refs);
 		n->flush_time = s->time;
-		n->nr_to_flush = state.refs_seq + refs;
-		entity_sleep(s, &n->e);
+		n->nr_to_flush = n->fs->refs_seq + refs;
+		worker_phase(s, n, PHASE_THROTTLED);
+		entity_sleep_on(s, &n->e, &n->fs->sleepers);
 	} else {
-		entity_enqueue(s, e, state.run_period);
+		worker_phase(s, n, PHASE_RUNNING);
+		entity_enqueue(s, e, n->wc->run_period);
 	}
 }
 
-static void init_state(struct time_simulator *s, bool test)
+static void init_quantiles(struct fs_state *fs)
+{
+	quantile_init(&fs->flush_p50, 0.5);
+	quantile_init(&fs->flush_p90, 0.9);
+	quantile_init(&fs->flush_p99, 0.99);
+	quantile_window_init(&fs->recent_p90, 0.9, FLUSH_WINDOW);
+	quantile_init(&fs->throttle_p99, 0.99);
+	quantile_init(&fs->dirty_throttle_p99, 0.99);
+}
+
+/*
+ * The rate policy admits refs as fast as the async flushers retire them at
+ * the mean of the latency table, in bursts of up to what flush_thresh worth
+ * of backlog holds.
+ */
+static uint64_t ref_rate(void)
+{
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0; i < 100; i++)
+		sum += flush_table[i];
+	return (uint64_t)nr_async_flushers * NSEC_PER_SEC * 100 / sum ?: 1;
+}
+
+static void init_fs(struct time_simulator *s, struct fs_state *fs, int id,
+		    unsigned int flags)
 {
-	memset(&state, 0, sizeof(state));
-	state.min_refs = 0;
-	state.max_refs = 20;
-	state.run_period = NSEC_PER_SEC >> 4;
-	state.avg_time_per_run = NSEC_PER_SEC >> 4;
-	state.test = test;
+	memset(fs, 0, sizeof(*fs));
+	fs->id = id;
+	fs->avg_time_per_run = NSEC_PER_SEC >> 4;
+	fs->nr_async_workers = nr_async_flushers;
+	fs->flags = flags;
+	init_quantiles(fs);
+	INIT_LIST_HEAD(&fs->sleepers);
+	INIT_LIST_HEAD(&fs->io_waiters);
+	INIT_LIST_HEAD(&fs->dirty_waiters);
+	if (flags & RUN_RATE) {
+		uint64_t rate = ref_rate();
+
+		bucket_init(&fs->ref_bucket, BUCKET_TOKEN, rate,
+			    rate * flush_thresh / NSEC_PER_SEC ?: 1);
+	}
+
+	if (dirty_per_op) {
+		entity_init(s, &fs->writeback_entity.e);
+		fs->writeback_entity.e.ops = &normal_ops;
+		fs->writeback_entity.fs = fs;
+		fs->writeback_entity.e.run = writeback_run;
+	}
+
+	/* A commit due with workers goes first, so they see it locked. */
+	entity_init(s, &fs->commit_entity.e);
+	fs->commit_entity.e.ops = &normal_ops;
+	fs->commit_entity.fs = fs;
+	fs->commit_entity.e.run = transaction_run;
+	fs->commit_entity.e.lane = ENTITY_LANE_HIGH;
 
-	memset(&trans_commit_entity, 0, sizeof(trans_commit_entity));
-	entity_init(s, &trans_commit_entity.e);
-	trans_commit_entity.e.run = transaction_run;
+	entity_enqueue(s, &fs->commit_entity.e, commit_interval);
+}
+
+/*
+ * Device service times come off the flush latency table, and an extra
+ * merged block costs as much as the fastest flush in it.  Without a queue
+ * depth only writeback uses it, at depth 1.  All filesystems share it.
+ */
+static void init_device(void)
+{
+	struct device_config cfg = {
+		.queue_depth = queue_depth,
+		.service_table = flush_table,
+		.stream = &flush_stream,
+		.cost_pct = { read_cost, write_cost },
+		.block_ns = flush_table[0],
+		.max_merge = max_merge,
+	};
+
+	if (queue_depth || dirty_per_op)
+		device_init(&device, &cfg);
+}
 
-	entity_enqueue(s, &trans_commit_entity.e, (uint64_t)NSEC_PER_SEC * 30);
+/* Filesystems live in one array so free_entity() can tell them apart. */
+static int alloc_filesystems(int nr)
+{
+	struct fs_state *fs;
+
+	if (nr <= filesystems_size)
+		return 0;
+	fs = realloc(filesystems, nr * sizeof(*fs));
+	if (!fs)
+		return -ENOMEM;
+	filesystems = fs;
+	filesystems_size = nr;
+	return 0;
 }
 
 static void test_run(struct time_simulator *s, struct entity *e)
 {
 	struct normal_entity *n = container_of(e, struct normal_entity, e);
-	uint64_t refs = nr_refs();
-	state.num_entries += refs;
-	state.entity_ops++;
+	uint64_t refs;
 
-	if (state.transaction_locked)
+	if (balance_dirty_pages(s, n))
 		return;
+	refs = worker_op(n);
 
-	if (need_flush_test(true)) {
-		if (!state.async_running) {
-			state.async_running = true;
-			entity_enqueue(s, &async_worker.e, 1);
-		}
+	if (n->fs->transaction_locked) {
+		worker_phase(s, n, PHASE_LOCKED);
+		return;
+	}
+
+	if (need_flush_test(n->fs, n->wc->flags, true)) {
+		kick_async_flushers(s, n->fs);
 	}
 
-	if (need_flush_test(false)) {
+	if (need_flush_test(n->fs, n->wc->flags, false)) {
 		if (refs == 0)
 			refs = 1;
+		TRACE3(btrfs_throttle, throttle, n, s->time, refs);
+		time_simulator_record(s, REC_THROTTLE, n, refs);
 		n->flush_time = s->time;
-		n->nr_to_flush = state.refs_seq + refs;
-		entity_sleep(s, e);
+		n->nr_to_flush = n->fs->refs_seq + refs;
+		worker_phase(s, n, PHASE_THROTTLED);
+		entity_sleep_on(s, e, &n->fs->sleepers);
 	} else {
-		entity_enqueue(s, e, state.run_period);
+		worker_phase(s, n, PHASE_RUNNING);
+		entity_enqueue(s, e, n->wc->run_period);
 	}
 }
 
-static void init_async_worker(struct time_simulator *s, bool test)
+/*
+ * Workers take a token per ref they generate, sleeping in the ref bucket
+ * until they are there, and the async flushers are kicked as usual.  An op
+ * with more refs than the bucket holds takes all of it.
+ */
+static void rate_run(struct time_simulator *s, struct entity *e)
 {
-	memset(&async_worker, 0, sizeof(async_worker));
-	entity_init(s, &async_worker.e);
-	if (test)
-		async_worker.e.run = async_flusher_run_test;
-	else
-		async_worker.e.run = async_flusher_run;
+	struct normal_entity *n = container_of(e, struct normal_entity, e);
+	struct fs_state *fs = n->fs;
+	uint64_t refs;
+
+	if (n->state == 1) {
+		n->state = 0;
+		throttle_done(s, n);
+		worker_wait(s, n);
+		return;
+	}
+
+	if (balance_dirty_pages(s, n))
+		return;
+	refs = worker_op(n);
+
+	if (fs->transaction_locked) {
+		worker_phase(s, n, PHASE_LOCKED);
+		return;
+	}
+
+	if (need_flush(fs, n->wc->flags, true))
+		kick_async_flushers(s, fs);
+	if (refs > fs->ref_bucket.size)
+		refs = fs->ref_bucket.size;
+	if (bucket_get(s, &fs->ref_bucket, &n->wait, e, refs) == 0) {
+		TRACE3(btrfs_throttle, throttle, n, s->time, refs);
+		time_simulator_record(s, REC_THROTTLE, n, refs);
+		n->flush_time = s->time;
+		n->state = 1;
+		worker_phase(s, n, PHASE_THROTTLED);
+		return;
+	}
+	worker_phase(s, n, PHASE_RUNNING);
+	entity_enqueue(s, e, n->wc->run_period);
 }
 
-static void run_test(struct time_simulator *s, const char *testname,
-		     void(*run)(struct time_simulator *s, struct entity *e),
-		     int nr_workers, bool test)
+static const struct {
+	void (*run)(struct time_simulator *s, struct entity *e);
+	unsigned int flags;
+} policies[NR_POLICIES] = {
+	[POLICY_NOTHROTTLE] = { nothrottle_run, 0 },
+	[POLICY_ASYNC_NOTHROTTLE] = { async_nothrottle_run, 0 },
+	[POLICY_INLINE] = { inline_refs_run, 0 },
+	[POLICY_THROTTLE] = { throttle_run, 0 },
+	[POLICY_TEST] = { test_run, RUN_TEST },
+	[POLICY_QUANTILE] = { throttle_run, RUN_QUANTILE },
+	[POLICY_RATE] = { rate_run, RUN_RATE },
+};
+
+static int policy_index(struct worker_class *wc)
 {
 	int i;
 
-	init_state(s, test);
-	init_async_worker(s, test);
-	for (i = 0; i < nr_workers; i++) {
-		struct normal_entity *n = alloc_entity(s);
-		if (!n) {
-			fprintf(stderr, "Could only allocate %d workers\n", i);
-			break;
-		}
-		n->e.run = run;
-		entity_enqueue(s, &n->e, 0);
-	}
+	for (i = 0; i < NR_POLICIES; i++)
+		if (policies[i].run == wc->run &&
+		    policies[i].flags == wc->flags)
+			return i;
+	return -1;
+}
 
-	printf("starting %s run %d workers\n", testname, nr_workers);
-	time_simulator_run(s, 0);
-	printf("async flusher took %llu nanoseconds (%llu seconds) to run\n",
-	       (unsigned long long)async_worker.throttled_time,
-	       (unsigned long long)(async_worker.throttled_time /
-				    NSEC_PER_SEC));
-	printf("Transaction took %llu nanoseconds (%llu seconds) to run\n",
-	       (unsigned long long)trans_commit_entity.throttled_time,
-	       (unsigned long long)(trans_commit_entity.throttled_time /
-				    NSEC_PER_SEC));
-	printf("Entities did %f ops per second\n",
-	       (double)state.entity_ops / (s->time / NSEC_PER_SEC));
-	printf("Theoretical max %f ops per second\n",
-	       (double)NSEC_PER_SEC / state.run_period);
-	printf("Final average time %llu\n",
-	       (unsigned long long)state.avg_time_per_run);
-	printf("Total time %lluns (%llus)\n", (unsigned long long)s->time,
-	       (unsigned long long)(s->time / NSEC_PER_SEC));
-	time_simulator_print_entity_times(s);
-	printf("\n");
-	time_simulator_clear(s);
+static const char *policy_name(struct worker_class *wc)
+{
+	int i = policy_index(wc);
+
+	return i < 0 ? "unknown" : scenario_policy_name(i);
 }
 
-static void init_percentile_table(uint64_t max)
+/* The classes' shared policy, or "mixed" when they differ. */
+static const char *run_policy_name(struct worker_class *classes,
+				   int nr_classes)
 {
-	int i = 90;
-	percentile_table[99] = max;
-	max >>= 1;
-	for (i = 91; i < 98; i++)
-		percentile_table[i] = max;
-	for (i = 90; i >= 0; i--) {
-		if (!(i % 10))
-			max >>= 1;
-		percentile_table[i] = max;
-	}
+	int i;
+
+	for (i = 1; i < nr_classes; i++)
+		if (policy_index(&classes[i]) != policy_index(&classes[0]))
+			return "mixed";
+	return policy_name(&classes[0]);
 }
 
-int main(int argc, char **argv)
+/* What the filesystem wide machinery has to do for all of @classes. */
+static unsigned int class_flags(struct worker_class *classes, int nr_classes)
 {
-	struct time_simulator *s;
+	unsigned int flags = 0;
+	int i;
 
-	srandom(1);
+	for (i = 0; i < nr_classes; i++)
+		flags |= classes[i].flags;
+	return flags;
+}
 
-	init_percentile_table(NSEC_PER_SEC >> 1);
+/* Gauges are over all filesystems, averaged for avg_time_per_run. */
+static uint64_t gauge_num_entries(struct time_simulator *s, void *priv)
+{
+	uint64_t total = 0;
+	int i;
 
-	s = time_simulator_alloc(free_entity);
-	if (!s) {
-		perror("Error allocating time simulator\n");
-		return -1;
-	}
+	for (i = 0; i < nr_filesystems; i++)
+		total += filesystems[i].num_entries;
+	return total;
+}
 
-	run_test(s, "nothrottle", nothrottle_run, 1, false);
-	run_test(s, "nothrottle", nothrottle_run, 10, false);
-	run_test(s, "async nothrottle", async_nothrottle_run, 1, false);
-	run_test(s, "async nothrottle", async_nothrottle_run, 10, false);
-	run_test(s, "inline", inline_refs_run, 1, false);
-	run_test(s, "inline", inline_refs_run, 10, false);
-	srandom(1);
-	run_test(s, "baseline throttle", throttle_run, 1, false);
-	run_test(s, "baseline throttle", throttle_run, 10, false);
-	srandom(1);
-	run_test(s, "test", test_run, 1, true);
-	run_test(s, "test", test_run, 10, true);
-	free(s);
-	return 0;
+static uint64_t gauge_avg_time(struct time_simulator *s, void *priv)
+{
+	uint64_t total = 0;
+	int i;
+
+	for (i = 0; i < nr_filesystems; i++)
+		total += filesystems[i].avg_time_per_run;
+	return total / nr_filesystems;
+}
+
+static uint64_t gauge_sleepers(struct time_simulator *s, void *priv)
+{
+	return s->nr_sleepers;
+}
+
+static uint64_t gauge_async_running(struct time_simulator *s, void *priv)
+{
+	uint64_t total = 0;
+	int i;
+
+	for (i = 0; i < nr_filesystems; i++)
+		total += filesystems[i].nr_async_running;
+	return total;
+}
+
+/*
+ * Without a gauge directory only the stats page wants them, and it reads
+ * them itself, so they are hardly sampled.
+ */
+static void init_gauges(struct time_simulator *s)
+{
+	time_simulator_gauge_interval(s, gauge_dir ? GAUGE_INTERVAL :
+				      commit_interval, GAUGE_BUCKETS);
+	if (time_simulator_gauge_add(s, "num_entries", gauge_num_entries,
+				     NULL) ||
+	    time_simulator_gauge_add(s, "sleepers", gauge_sleepers, NULL) ||
+	    time_simulator_gauge_add(s, "avg_time_per_run", gauge_avg_time,
+				     NULL) ||
+	    time_simulator_gauge_add(s, "async_running", gauge_async_running,
+				     NULL))
+		fprintf(stderr, "Failed to register gauges\n");
+}
+
+static void write_gauges(struct time_simulator *s, const char *testname,
+			 int nr_workers)
+{
+	char path[PATH_MAX];
+	int ret, i;
+
+	ret = snprintf(path, sizeof(path), "%s/%s-%d.gauge", gauge_dir,
+		       testname, nr_workers);
+	if (ret >= sizeof(path)) {
+		fprintf(stderr, "Gauge path too long\n");
+		return;
+	}
+	for (i = strlen(gauge_dir) + 1; path[i]; i++)
+		if (path[i] == ' ')
+			path[i] = '-';
+	ret = time_simulator_gauge_write(s, path);
+	if (ret)
+		fprintf(stderr, "Failed to write %s: %s\n", path,
+			strerror(-ret));
+}
+
+static void init_async_workers(struct time_simulator *s, struct fs_state *fs)
+{
+	bool test = fs->flags & RUN_TEST;
+	int i;
+
+	for (i = 0; i < fs->nr_async_workers; i++) {
+		struct normal_entity *n = &fs->async_workers[i];
+
+		entity_init(s, &n->e);
+		n->e.ops = &normal_ops;
+		n->fs = fs;
+		n->async = true;
+		if (test)
+			n->e.run = async_flusher_run_test;
+		else
+			n->e.run = async_flusher_run;
+	}
+}
+
+static void print_class_stats(struct time_simulator *s,
+			      struct worker_class *classes, int nr_classes)
+{
+	int i;
+
+	for (i = 0; i < nr_classes; i++) {
+		struct worker_class *wc = &classes[i];
+		int nr_workers = wc->nr_workers * nr_filesystems;
+		double ops = (double)wc->ops / (s->time / NSEC_PER_SEC) /
+			nr_workers;
+		double max = (double)NSEC_PER_SEC / wc->run_period;
+
+		printf("Class %s: %d workers did %f ops per second each (%.1f%% of theoretical max)\n",
+		       wc->name, nr_workers, ops, ops * 100 / max);
+		if (!wc->throttle_events)
+			continue;
+		printf("Class %s: throttle latency avg %llu p99 %llu over %llu throttles\n",
+		       wc->name,
+		       (unsigned long long)(wc->throttle_time /
+					    wc->throttle_events),
+		       (unsigned long long)quantile_get(&wc->throttle_p99),
+		       (unsigned long long)wc->throttle_events);
+	}
+}
+
+static uint64_t device_queue_avg(void)
+{
+	if (!device.stats.dispatched)
+		return 0;
+	return device.stats.queue_time / device.stats.dispatched;
+}
+
+static void print_device(struct time_simulator *s)
+{
+	struct device_stats *st = &device.stats;
+
+	printf("Device queue depth %u: %llu reads %llu writes, %llu merged, busy %.1f%%\n",
+	       device.cfg.queue_depth,
+	       (unsigned long long)st->submitted[DEVICE_READ],
+	       (unsigned long long)st->submitted[DEVICE_WRITE],
+	       (unsigned long long)st->merged,
+	       s->time ? (double)st->busy_time * 100 / s->time : 0);
+	printf("Device queue wait avg %llu max queued %u, service avg %llu\n",
+	       (unsigned long long)device_queue_avg(), st->max_queued,
+	       (unsigned long long)(st->dispatched ?
+				    st->service_time / st->dispatched : 0));
+}
+
+/* Per op throttling from both sources, they add up on the same ops. */
+static void print_writeback(struct fs_state *t)
+{
+	if (t->dirty_throttle_events)
+		printf("Dirty throttle latency avg %llu p99 %llu over %llu throttles\n",
+		       (unsigned long long)(t->dirty_throttle_time /
+					    t->dirty_throttle_events),
+		       (unsigned long long)quantile_get(&t->dirty_throttle_p99),
+		       (unsigned long long)t->dirty_throttle_events);
+	printf("Wrote back %llu pages, %llu dirty at the end\n",
+	       (unsigned long long)t->written,
+	       (unsigned long long)dirty_total(t));
+	if (t->entity_ops)
+		printf("Throttled %llu ns per op, %llu on refs %llu on dirty pages\n",
+		       (unsigned long long)((t->throttle_time +
+					     t->dirty_throttle_time) /
+					    t->entity_ops),
+		       (unsigned long long)(t->throttle_time /
+					    t->entity_ops),
+		       (unsigned long long)(t->dirty_throttle_time /
+					    t->entity_ops));
+}
+
+static uint64_t fs_async_time(struct fs_state *fs)
+{
+	uint64_t time = 0;
+	int i;
+
+	for (i = 0; i < fs->nr_async_workers; i++)
+		time += fs->async_workers[i].throttled_time;
+	return time;
+}
+
+static uint64_t async_time(void)
+{
+	uint64_t time = 0;
+	int i;
+
+	for (i = 0; i < nr_filesystems; i++)
+		time += fs_async_time(&filesystems[i]);
+	return time;
+}
+
+static uint64_t commit_time(void)
+{
+	uint64_t time = 0;
+	int i;
+
+	for (i = 0; i < nr_filesystems; i++)
+		time += filesystems[i].commit_entity.throttled_time;
+	return time;
+}
+
+/*
+ * The run wide view of the filesystems.  With a single filesystem that is
+ * simply it, with more the counters are summed into totals, whose quantiles
+ * were fed as the run went.
+ */
+static struct fs_state *sum_filesystems(void)
+{
+	uint64_t avg_time = 0;
+	int i;
+
+	if (nr_filesystems == 1)
+		return &filesystems[0];
+	totals.nr_async_workers = filesystems[0].nr_async_workers;
+	totals.flags = filesystems[0].flags;
+	for (i = 0; i < nr_filesystems; i++) {
+		struct fs_state *fs = &filesystems[i];
+
+		totals.num_entries += fs->num_entries;
+		totals.entity_ops += fs->entity_ops;
+		totals.throttle_time += fs->throttle_time;
+		totals.throttle_events += fs->throttle_events;
+		totals.dirty += fs->dirty;
+		totals.writeback += fs->writeback;
+		totals.written += fs->written;
+		totals.dirty_throttle_time += fs->dirty_throttle_time;
+		totals.dirty_throttle_events += fs->dirty_throttle_events;
+		avg_time += fs->avg_time_per_run;
+	}
+	totals.avg_time_per_run = avg_time / nr_filesystems;
+	return &totals;
+}
+
+static bool any_class_runs(struct worker_class *classes, int nr_classes,
+			   void (*run)(struct time_simulator *s,
+				       struct entity *e))
+{
+	int i;
+
+	for (i = 0; i < nr_classes; i++)
+		if (classes[i].run == run)
+			return true;
+	return false;
+}
+
+static void print_ref_bucket(void)
+{
+	struct bucket_stats st = {};
+	int i;
+
+	for (i = 0; i < nr_filesystems; i++) {
+		struct bucket_stats *b = &filesystems[i].ref_bucket.stats;
+
+		st.requests += b->requests;
+		st.tokens += b->tokens;
+		st.waits += b->waits;
+		st.wait_time += b->wait_time;
+		if (b->max_wait > st.max_wait)
+			st.max_wait = b->max_wait;
+		if (b->max_waiters > st.max_waiters)
+			st.max_waiters = b->max_waiters;
+	}
+	printf("Ref bucket %llu refs/sec burst %llu: %llu refs over %llu ops, %llu waited\n",
+	       (unsigned long long)filesystems[0].ref_bucket.rate,
+	       (unsigned long long)filesystems[0].ref_bucket.size,
+	       (unsigned long long)st.tokens,
+	       (unsigned long long)st.requests,
+	       (unsigned long long)st.waits);
+	printf("Ref bucket wait avg %llu max %llu, at most %u waiters\n",
+	       (unsigned long long)(st.waits ? st.wait_time / st.waits : 0),
+	       (unsigned long long)st.max_wait, st.max_waiters);
+}
+
+static void print_filesystems(struct time_simulator *s)
+{
+	int i;
+
+	for (i = 0; i < nr_filesystems; i++) {
+		struct fs_state *fs = &filesystems[i];
+
+		printf("Filesystem %d: %f ops per second, transaction %llu ns, async flushers %llu ns\n",
+		       fs->id, (double)fs->entity_ops / (s->time / NSEC_PER_SEC),
+		       (unsigned long long)fs->commit_entity.throttled_time,
+		       (unsigned long long)fs_async_time(fs));
+		printf("Filesystem %d: flush time p50 %llu p90 %llu p99 %llu, throttle avg %llu p99 %llu over %llu throttles\n",
+		       fs->id,
+		       (unsigned long long)quantile_get(&fs->flush_p50),
+		       (unsigned long long)quantile_get(&fs->flush_p90),
+		       (unsigned long long)quantile_get(&fs->flush_p99),
+		       (unsigned long long)(fs->throttle_events ?
+					    fs->throttle_time /
+					    fs->throttle_events : 0),
+		       (unsigned long long)quantile_get(&fs->throttle_p99),
+		       (unsigned long long)fs->throttle_events);
+		if (dirty_per_op)
+			printf("Filesystem %d: dirty throttle avg %llu over %llu throttles, wrote back %llu pages\n",
+			       fs->id,
+			       (unsigned long long)(fs->dirty_throttle_events ?
+						    fs->dirty_throttle_time /
+						    fs->dirty_throttle_events : 0),
+			       (unsigned long long)fs->dirty_throttle_events,
+			       (unsigned long long)fs->written);
+	}
+}
+
+static void print_run(struct time_simulator *s, struct worker_class *classes,
+		      int nr_classes, struct fs_state *t,
+		      struct run_result *res)
+{
+	uint64_t async = async_time();
+	uint64_t commit = commit_time();
+
+	printf("async flusher took %llu nanoseconds (%llu seconds) to run\n",
+	       (unsigned long long)async,
+	       (unsigned long long)(async / NSEC_PER_SEC));
+	printf("Transaction took %llu nanoseconds (%llu seconds) to run\n",
+	       (unsigned long long)commit,
+	       (unsigned long long)(commit / NSEC_PER_SEC));
+	printf("Entities did %f ops per second\n", res->ops_per_sec);
+	if (nr_classes == 1)
+		printf("Theoretical max %f ops per second\n",
+		       (double)NSEC_PER_SEC / classes[0].run_period);
+	else
+		print_class_stats(s, classes, nr_classes);
+	printf("Final average time %llu\n",
+	       (unsigned long long)t->avg_time_per_run);
+	printf("Flush time p50 %llu p90 %llu p99 %llu\n",
+	       (unsigned long long)quantile_get(&t->flush_p50),
+	       (unsigned long long)quantile_get(&t->flush_p90),
+	       (unsigned long long)quantile_get(&t->flush_p99));
+	if (t->throttle_events)
+		printf("Throttle latency avg %llu p99 %llu over %llu throttles\n",
+		       (unsigned long long)res->throttle_avg,
+		       (unsigned long long)res->throttle_p99,
+		       (unsigned long long)t->throttle_events);
+	if (any_class_runs(classes, nr_classes, rate_run))
+		print_ref_bucket();
+	if (dirty_per_op)
+		print_writeback(t);
+	if (queue_depth)
+		print_device(s);
+	if (nr_filesystems > 1)
+		print_filesystems(s);
+	time_simulator_print_quantum(s);
+	printf("Total time %lluns (%llus)\n", (unsigned long long)s->time,
+	       (unsigned long long)(s->time / NSEC_PER_SEC));
+	time_simulator_print_entity_times(s);
+	printf("\n");
+}
+
+enum {
+	RUN_COL_RUN,
+	RUN_COL_TEST,
+	RUN_COL_POLICY,
+	RUN_COL_SEED,
+	RUN_COL_WORKERS,
+	RUN_COL_CLASSES,
+	RUN_COL_FILESYSTEMS,
+	RUN_COL_FLUSHERS,
+	RUN_COL_HORIZON,
+	RUN_COL_FLUSH_THRESH,
+	RUN_COL_KICK_THRESH,
+	RUN_COL_FLUSH_MAX,
+	RUN_COL_QUEUE_DEPTH,
+	RUN_COL_QUANTUM,
+	RUN_COL_OPS,
+	RUN_COL_MAX_OPS,
+	RUN_COL_TOTAL_TIME,
+	RUN_COL_ASYNC_TIME,
+	RUN_COL_COMMIT_TIME,
+	RUN_COL_THROTTLES,
+	RUN_COL_THROTTLE_AVG,
+	RUN_COL_THROTTLE_P99,
+	RUN_COL_FLUSH_P50,
+	RUN_COL_FLUSH_P90,
+	RUN_COL_FLUSH_P99,
+	RUN_COL_DEVICE_BUSY,
+	RUN_COL_DEVICE_QUEUE_AVG,
+	RUN_COL_DEVICE_MERGED,
+	RUN_COL_DIRTY_PER_OP,
+	RUN_COL_DIRTY_THROTTLES,
+	RUN_COL_DIRTY_THROTTLE_AVG,
+	RUN_COL_DIRTY_THROTTLE_P99,
+	NR_RUN_COLS,
+};
+
+static const struct result_column run_columns[NR_RUN_COLS] = {
+	[RUN_COL_RUN] = { "run", RESULT_U64 },
+	[RUN_COL_TEST] = { "test", RESULT_STR },
+	[RUN_COL_POLICY] = { "policy", RESULT_STR },
+	[RUN_COL_SEED] = { "seed", RESULT_U64 },
+	[RUN_COL_WORKERS] = { "workers", RESULT_U64 },
+	[RUN_COL_CLASSES] = { "classes", RESULT_U64 },
+	[RUN_COL_FILESYSTEMS] = { "filesystems", RESULT_U64 },
+	[RUN_COL_FLUSHERS] = { "flushers", RESULT_U64 },
+	[RUN_COL_HORIZON] = { "horizon", RESULT_U64 },
+	[RUN_COL_FLUSH_THRESH] = { "flush_threshold", RESULT_U64 },
+	[RUN_COL_KICK_THRESH] = { "kick_threshold", RESULT_U64 },
+	[RUN_COL_FLUSH_MAX] = { "flush_max", RESULT_U64 },
+	[RUN_COL_QUEUE_DEPTH] = { "queue_depth", RESULT_U64 },
+	[RUN_COL_QUANTUM] = { "quantum", RESULT_U64 },
+	[RUN_COL_OPS] = { "ops_per_sec", RESULT_F64 },
+	[RUN_COL_MAX_OPS] = { "max_ops_per_sec", RESULT_F64 },
+	[RUN_COL_TOTAL_TIME] = { "total_time", RESULT_U64 },
+	[RUN_COL_ASYNC_TIME] = { "async_time", RESULT_U64 },
+	[RUN_COL_COMMIT_TIME] = { "commit_time", RESULT_U64 },
+	[RUN_COL_THROTTLES] = { "throttles", RESULT_U64 },
+	[RUN_COL_THROTTLE_AVG] = { "throttle_avg", RESULT_U64 },
+	[RUN_COL_THROTTLE_P99] = { "throttle_p99", RESULT_U64 },
+	[RUN_COL_FLUSH_P50] = { "flush_p50", RESULT_U64 },
+	[RUN_COL_FLUSH_P90] = { "flush_p90", RESULT_U64 },
+	[RUN_COL_FLUSH_P99] = { "flush_p99", RESULT_U64 },
+	[RUN_COL_DEVICE_BUSY] = { "device_busy", RESULT_U64 },
+	[RUN_COL_DEVICE_QUEUE_AVG] = { "device_queue_avg", RESULT_U64 },
+	[RUN_COL_DEVICE_MERGED] = { "device_merged", RESULT_U64 },
+	[RUN_COL_DIRTY_PER_OP] = { "dirty_per_op", RESULT_U64 },
+	[RUN_COL_DIRTY_THROTTLES] = { "dirty_throttles", RESULT_U64 },
+	[RUN_COL_DIRTY_THROTTLE_AVG] = { "dirty_throttle_avg", RESULT_U64 },
+	[RUN_COL_DIRTY_THROTTLE_P99] = { "dirty_throttle_p99", RESULT_U64 },
+};
+
+enum {
+	CLASS_COL_RUN,
+	CLASS_COL_CLASS,
+	CLASS_COL_POLICY,
+	CLASS_COL_WORKERS,
+	CLASS_COL_PERIOD,
+	CLASS_COL_MIN_REFS,
+	CLASS_COL_MAX_REFS,
+	CLASS_COL_OPS,
+	CLASS_COL_THROTTLES,
+	CLASS_COL_THROTTLE_AVG,
+	CLASS_COL_THROTTLE_P99,
+	NR_CLASS_COLS,
+};
+
+static const struct result_column class_columns[NR_CLASS_COLS] = {
+	[CLASS_COL_RUN] = { "run", RESULT_U64 },
+	[CLASS_COL_CLASS] = { "class", RESULT_STR },
+	[CLASS_COL_POLICY] = { "policy", RESULT_STR },
+	[CLASS_COL_WORKERS] = { "workers", RESULT_U64 },
+	[CLASS_COL_PERIOD] = { "period", RESULT_U64 },
+	[CLASS_COL_MIN_REFS] = { "min_refs", RESULT_U64 },
+	[CLASS_COL_MAX_REFS] = { "max_refs", RESULT_U64 },
+	[CLASS_COL_OPS] = { "ops_per_sec", RESULT_F64 },
+	[CLASS_COL_THROTTLES] = { "throttles", RESULT_U64 },
+	[CLASS_COL_THROTTLE_AVG] = { "throttle_avg", RESULT_U64 },
+	[CLASS_COL_THROTTLE_P99] = { "throttle_p99", RESULT_U64 },
+};
+
+enum {
+	COMMIT_COL_RUN,
+	COMMIT_COL_FS,
+	COMMIT_COL_COMMIT,
+	COMMIT_COL_START,
+	COMMIT_COL_REFS,
+	COMMIT_COL_FLUSHED,
+	COMMIT_COL_DURATION,
+	NR_COMMIT_COLS,
+};
+
+static const struct result_column commit_columns[NR_COMMIT_COLS] = {
+	[COMMIT_COL_RUN] = { "run", RESULT_U64 },
+	[COMMIT_COL_FS] = { "fs", RESULT_U64 },
+	[COMMIT_COL_COMMIT] = { "commit", RESULT_U64 },
+	[COMMIT_COL_START] = { "start", RESULT_U64 },
+	[COMMIT_COL_REFS] = { "refs", RESULT_U64 },
+	[COMMIT_COL_FLUSHED] = { "flushed", RESULT_U64 },
+	[COMMIT_COL_DURATION] = { "duration", RESULT_U64 },
+};
+
+enum {
+	FS_COL_RUN,
+	FS_COL_FS,
+	FS_COL_OPS,
+	FS_COL_COMMIT_TIME,
+	FS_COL_ASYNC_TIME,
+	FS_COL_AVG_TIME,
+	FS_COL_THROTTLES,
+	FS_COL_THROTTLE_AVG,
+	FS_COL_THROTTLE_P99,
+	FS_COL_FLUSH_P50,
+	FS_COL_FLUSH_P90,
+	FS_COL_FLUSH_P99,
+	FS_COL_DIRTY_THROTTLES,
+	FS_COL_DIRTY_THROTTLE_AVG,
+	FS_COL_WRITTEN,
+	NR_FS_COLS,
+};
+
+static const struct result_column fs_columns[NR_FS_COLS] = {
+	[FS_COL_RUN] = { "run", RESULT_U64 },
+	[FS_COL_FS] = { "fs", RESULT_U64 },
+	[FS_COL_OPS] = { "ops_per_sec", RESULT_F64 },
+	[FS_COL_COMMIT_TIME] = { "commit_time", RESULT_U64 },
+	[FS_COL_ASYNC_TIME] = { "async_time", RESULT_U64 },
+	[FS_COL_AVG_TIME] = { "avg_time_per_run", RESULT_U64 },
+	[FS_COL_THROTTLES] = { "throttles", RESULT_U64 },
+	[FS_COL_THROTTLE_AVG] = { "throttle_avg", RESULT_U64 },
+	[FS_COL_THROTTLE_P99] = { "throttle_p99", RESULT_U64 },
+	[FS_COL_FLUSH_P50] = { "flush_p50", RESULT_U64 },
+	[FS_COL_FLUSH_P90] = { "flush_p90", RESULT_U64 },
+	[FS_COL_FLUSH_P99] = { "flush_p99", RESULT_U64 },
+	[FS_COL_DIRTY_THROTTLES] = { "dirty_throttles", RESULT_U64 },
+	[FS_COL_DIRTY_THROTTLE_AVG] = { "dirty_throttle_avg", RESULT_U64 },
+	[FS_COL_WRITTEN] = { "written", RESULT_U64 },
+};
+
+enum {
+	TABLE_RUNS,
+	TABLE_CLASSES,
+	TABLE_COMMITS,
+	TABLE_FILESYSTEMS,
+	NR_TABLES,
+};
+
+/*
+ * Runs, classes, commits and filesystems each get their own table in the
+ * results directory, joined on the run column, which is the first column of
+ * every table.  Appending to existing tables keeps run numbers unique across
+ * invocations.
+ */
+static const struct {
+	const char *name;
+	struct results *r;
+	const struct result_column *columns;
+	int nr_columns;
+} tables[NR_TABLES] = {
+	[TABLE_RUNS] = { "runs", &run_results, run_columns, NR_RUN_COLS },
+	[TABLE_CLASSES] = { "classes", &class_results, class_columns,
+			    NR_CLASS_COLS },
+	[TABLE_COMMITS] = { "commits", &commit_results, commit_columns,
+			    NR_COMMIT_COLS },
+	[TABLE_FILESYSTEMS] = { "filesystems", &fs_results, fs_columns,
+				NR_FS_COLS },
+};
+
+static int open_results(void)
+{
+	char path[PATH_MAX];
+	int i, ret;
+
+	for (i = 0; i < NR_TABLES; i++) {
+		ret = snprintf(path, sizeof(path), "%s/%s.tsr", results_dir,
+			       tables[i].name);
+		if (ret >= sizeof(path)) {
+			fprintf(stderr, "Results path too long\n");
+			ret = -ENAMETOOLONG;
+			goto fail;
+		}
+		ret = results_open(tables[i].r, path, tables[i].columns,
+				   tables[i].nr_columns);
+		if (ret) {
+			fprintf(stderr, "Failed to open %s: %s\n", path,
+				strerror(-ret));
+			goto fail;
+		}
+	}
+	return 0;
+fail:
+	while (i--)
+		results_close(tables[i].r);
+	return ret;
+}
+
+static void close_results(void)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < NR_TABLES; i++) {
+		int err = results_close(tables[i].r);
+
+		if (!ret)
+			ret = err;
+	}
+	if (ret)
+		fprintf(stderr, "Failed to write results: %s\n",
+			strerror(-ret));
+}
+
+/*
+ * Append a row to its table, and while a run is being recorded for the
+ * cache serialize it as the table number followed by the values, strings
+ * as a length including the NUL and the bytes.
+ */
+static int emit_row(int table, const union result_value *row)
+{
+	const struct result_column *columns = tables[table].columns;
+	int i;
+
+	if (record) {
+		fputc(table, record);
+		for (i = 0; i < tables[table].nr_columns; i++) {
+			uint32_t len;
+
+			if (columns[i].type != RESULT_STR) {
+				fwrite(&row[i], sizeof(uint64_t), 1, record);
+				continue;
+			}
+			len = strlen(row[i].s) + 1;
+			fwrite(&len, sizeof(len), 1, record);
+			fwrite(row[i].s, 1, len, record);
+		}
+	}
+	if (!results_dir)
+		return 0;
+	return results_append(tables[table].r, row);
+}
+
+static void write_results(struct time_simulator *s, const char *testname,
+			  struct worker_class *classes, int nr_classes,
+			  struct fs_state *t, struct run_result *res)
+{
+	union result_value row[NR_RUN_COLS];
+	uint64_t run = results_dir ? results_rows(&run_results) : 0;
+	double max_ops = 0;
+	int nr_workers = 0;
+	int i, j, ret;
+
+	for (i = 0; i < nr_classes; i++) {
+		nr_workers += classes[i].nr_workers * nr_filesystems;
+		max_ops += (double)classes[i].nr_workers * nr_filesystems *
+			NSEC_PER_SEC / classes[i].run_period;
+	}
+
+	row[RUN_COL_RUN].u = run;
+	row[RUN_COL_TEST].s = testname;
+	row[RUN_COL_POLICY].s = run_policy_name(classes, nr_classes);
+	row[RUN_COL_SEED].u = cur_seed;
+	row[RUN_COL_WORKERS].u = nr_workers;
+	row[RUN_COL_CLASSES].u = nr_classes;
+	row[RUN_COL_FILESYSTEMS].u = nr_filesystems;
+	row[RUN_COL_FLUSHERS].u = t->nr_async_workers;
+	row[RUN_COL_HORIZON].u = commit_interval;
+	row[RUN_COL_FLUSH_THRESH].u = flush_thresh;
+	row[RUN_COL_KICK_THRESH].u = kick_thresh ?:
+		(class_flags(classes, nr_classes) & RUN_TEST ?
+		 NSEC_PER_SEC >> 2 : NSEC_PER_SEC >> 1);
+	row[RUN_COL_FLUSH_MAX].u = flush_max;
+	row[RUN_COL_QUEUE_DEPTH].u = queue_depth;
+	row[RUN_COL_QUANTUM].u = quantum;
+	row[RUN_COL_OPS].f = res->ops_per_sec;
+	row[RUN_COL_MAX_OPS].f = max_ops;
+	row[RUN_COL_TOTAL_TIME].u = res->total_time;
+	row[RUN_COL_ASYNC_TIME].u = async_time();
+	row[RUN_COL_COMMIT_TIME].u = commit_time();
+	row[RUN_COL_THROTTLES].u = t->throttle_events;
+	row[RUN_COL_THROTTLE_AVG].u = res->throttle_avg;
+	row[RUN_COL_THROTTLE_P99].u = res->throttle_p99;
+	row[RUN_COL_FLUSH_P50].u = quantile_get(&t->flush_p50);
+	row[RUN_COL_FLUSH_P90].u = quantile_get(&t->flush_p90);
+	row[RUN_COL_FLUSH_P99].u = quantile_get(&t->flush_p99);
+	row[RUN_COL_DEVICE_BUSY].u = queue_depth ? device.stats.busy_time : 0;
+	row[RUN_COL_DEVICE_QUEUE_AVG].u = queue_depth ? device_queue_avg() : 0;
+	row[RUN_COL_DEVICE_MERGED].u = queue_depth ? device.stats.merged : 0;
+	row[RUN_COL_DIRTY_PER_OP].u = dirty_per_op;
+	row[RUN_COL_DIRTY_THROTTLES].u = t->dirty_throttle_events;
+	row[RUN_COL_DIRTY_THROTTLE_AVG].u = t->dirty_throttle_events ?
+		t->dirty_throttle_time / t->dirty_throttle_events : 0;
+	row[RUN_COL_DIRTY_THROTTLE_P99].u =
+		quantile_get(&t->dirty_throttle_p99);
+	ret = emit_row(TABLE_RUNS, row);
+
+	for (i = 0; i < nr_classes && !ret; i++) {
+		struct worker_class *wc = &classes[i];
+		union result_value crow[NR_CLASS_COLS] = {
+			[CLASS_COL_RUN].u = run,
+			[CLASS_COL_CLASS].s = wc->name,
+			[CLASS_COL_POLICY].s = policy_name(wc),
+			[CLASS_COL_WORKERS].u = wc->nr_workers * nr_filesystems,
+			[CLASS_COL_PERIOD].u = wc->run_period,
+			[CLASS_COL_MIN_REFS].u = wc->min_refs,
+			[CLASS_COL_MAX_REFS].u = wc->max_refs,
+			[CLASS_COL_OPS].f = (double)wc->ops * NSEC_PER_SEC /
+				s->time / wc->nr_workers / nr_filesystems,
+			[CLASS_COL_THROTTLES].u = wc->throttle_events,
+			[CLASS_COL_THROTTLE_AVG].u = wc->throttle_events ?
+				wc->throttle_time / wc->throttle_events : 0,
+			[CLASS_COL_THROTTLE_P99].u =
+				quantile_get(&wc->throttle_p99),
+		};
+
+		ret = emit_row(TABLE_CLASSES, crow);
+	}
+
+	for (i = 0; i < nr_filesystems && !ret; i++) {
+		struct fs_state *fs = &filesystems[i];
+		union result_value frow[NR_FS_COLS] = {
+			[FS_COL_RUN].u = run,
+			[FS_COL_FS].u = fs->id,
+			[FS_COL_OPS].f = (double)fs->entity_ops * NSEC_PER_SEC /
+				s->time,
+			[FS_COL_COMMIT_TIME].u = fs->commit_entity.throttled_time,
+			[FS_COL_ASYNC_TIME].u = fs_async_time(fs),
+			[FS_COL_AVG_TIME].u = fs->avg_time_per_run,
+			[FS_COL_THROTTLES].u = fs->throttle_events,
+			[FS_COL_THROTTLE_AVG].u = fs->throttle_events ?
+				fs->throttle_time / fs->throttle_events : 0,
+			[FS_COL_THROTTLE_P99].u =
+				quantile_get(&fs->throttle_p99),
+			[FS_COL_FLUSH_P50].u = quantile_get(&fs->flush_p50),
+			[FS_COL_FLUSH_P90].u = quantile_get(&fs->flush_p90),
+			[FS_COL_FLUSH_P99].u = quantile_get(&fs->flush_p99),
+			[FS_COL_DIRTY_THROTTLES].u = fs->dirty_throttle_events,
+			[FS_COL_DIRTY_THROTTLE_AVG].u =
+				fs->dirty_throttle_events ?
+				fs->dirty_throttle_time /
+				fs->dirty_throttle_events : 0,
+			[FS_COL_WRITTEN].u = fs->written,
+		};
+
+		ret = emit_row(TABLE_FILESYSTEMS, frow);
+		for (j = 0; j < fs->nr_commits && !ret; j++) {
+			struct commit_stat *cs = &fs->commits[j];
+			union result_value crow[NR_COMMIT_COLS] = {
+				[COMMIT_COL_RUN].u = run,
+				[COMMIT_COL_FS].u = fs->id,
+				[COMMIT_COL_COMMIT].u = j,
+				[COMMIT_COL_START].u = cs->start,
+				[COMMIT_COL_REFS].u = cs->refs,
+				[COMMIT_COL_FLUSHED].u = cs->flushed,
+				[COMMIT_COL_DURATION].u = cs->duration,
+			};
+
+			ret = emit_row(TABLE_COMMITS, crow);
+		}
+	}
+	if (ret)
+		fprintf(stderr, "Failed to write results: %s\n",
+			strerror(-ret));
+}
+
+/*
+ * Checkpoints, see checkpoint.h.  Every entity of the model is a
+ * normal_entity and is saved with its device request, its filesystem and
+ * worker class go by index and ->end_io by which one it is.
+ */
+enum {
+	END_IO_NONE,
+	END_IO_FLUSH,
+	END_IO_WRITEBACK,
+};
+
+static void normal_checkpoint(struct checkpoint *c, struct entity *e)
+{
+	struct normal_entity *n = container_of(e, struct normal_entity, e);
+	int64_t fs = -1, wc = -1;
+	int end_io = END_IO_NONE;
+
+	if (!c->load) {
+		if (n->fs)
+			fs = n->fs - filesystems;
+		if (n->wc)
+			wc = n->wc - cur_classes;
+		if (n->rq.end_io == flush_end_io)
+			end_io = END_IO_FLUSH;
+		else if (n->rq.end_io == writeback_end_io)
+			end_io = END_IO_WRITEBACK;
+	}
+	checkpoint_var(c, fs);
+	checkpoint_var(c, wc);
+	checkpoint_var(c, end_io);
+	checkpoint_var(c, n->throttled_time);
+	checkpoint_var(c, n->state);
+	checkpoint_var(c, n->nr_to_flush);
+	checkpoint_var(c, n->flush_time);
+	checkpoint_var(c, n->flushed);
+	checkpoint_var(c, n->claimed);
+	checkpoint_var(c, n->async);
+	checkpoint_var(c, n->running);
+	checkpoint_var(c, n->io_start);
+	checkpoint_var(c, n->dirty_start);
+	checkpoint_var(c, n->phase);
+	checkpoint_var(c, n->phase_start);
+	checkpoint_var(c, n->phase_time);
+	device_request_checkpoint(c, &device, &n->rq);
+	if (!c->load || c->error)
+		return;
+
+	if (fs >= nr_filesystems || wc >= cur_nr_classes) {
+		c->error = -EINVAL;
+		return;
+	}
+	n->fs = fs < 0 ? NULL : &filesystems[fs];
+	n->wc = wc < 0 ? NULL : &cur_classes[wc];
+	n->rq.end_io = end_io == END_IO_FLUSH ? flush_end_io :
+		end_io == END_IO_WRITEBACK ? writeback_end_io : NULL;
+}
+
+static void checkpoint_prelude(struct time_simulator *s, struct checkpoint *c)
+{
+	char args[CHECKPOINT_ARGS_LEN];
+	uint64_t nr = nr_done_runs;
+
+	memcpy(args, checkpoint_args, sizeof(args));
+	checkpoint_var(c, args);
+	if (c->load && !c->error &&
+	    memcmp(args, checkpoint_args, sizeof(args))) {
+		fprintf(stderr, "%s was taken with different arguments\n",
+			checkpoint_file);
+		c->error = -EINVAL;
+	}
+	checkpoint_var(c, nr);
+	if (c->error)
+		return;
+	if (c->load) {
+		done_runs = calloc(nr ?: 1, sizeof(*done_runs));
+		if (!done_runs) {
+			c->error = -ENOMEM;
+			return;
+		}
+		done_runs_size = nr;
+		nr_resume_runs = nr;
+	}
+	checkpoint_bytes(c, done_runs, nr * sizeof(*done_runs));
+	checkpoint_var(c, phase_totals);
+}
+
+static void checkpoint_state(struct time_simulator *s, struct checkpoint *c)
+{
+	int i;
+
+	checkpoint_var(c, refs_stream);
+	checkpoint_var(c, flush_stream);
+	checkpoint_var(c, io_stream);
+	for (i = 0; i < nr_filesystems; i++) {
+		struct fs_state *fs = &filesystems[i];
+
+		/* Everything up to the entities is counters. */
+		checkpoint_bytes(c, fs, offsetof(struct fs_state,
+						 commit_entity));
+		checkpoint_list(c, &fs->sleepers, CHECKPOINT_ENTITY_LIST);
+		checkpoint_list(c, &fs->io_waiters, CHECKPOINT_ENTITY_LIST);
+		checkpoint_list(c, &fs->dirty_waiters, CHECKPOINT_ENTITY_LIST);
+		if (fs->ref_bucket.rate)
+			bucket_checkpoint(c, &fs->ref_bucket);
+	}
+	if (nr_filesystems > 1)
+		checkpoint_bytes(c, &totals, offsetof(struct fs_state,
+						      commit_entity));
+	for (i = 0; i < cur_nr_classes; i++) {
+		struct worker_class *wc = &cur_classes[i];
+
+		checkpoint_var(c, wc->ops);
+		checkpoint_var(c, wc->throttle_time);
+		checkpoint_var(c, wc->throttle_events);
+		checkpoint_var(c, wc->throttle_p99);
+	}
+	if (queue_depth || dirty_per_op)
+		device_checkpoint(c, &device);
+}
+
+static const struct checkpoint_ops checkpoint_ops = {
+	.prelude = checkpoint_prelude,
+	.state = checkpoint_state,
+};
+
+static void save_run_result(struct run_result *res)
+{
+	if (nr_done_runs == done_runs_size) {
+		uint64_t size = done_runs_size ? done_runs_size * 2 : 16;
+		struct run_result *r = realloc(done_runs, size * sizeof(*r));
+
+		if (!r) {
+			fprintf(stderr, "Failed to keep run results for checkpoints\n");
+			exit(1);
+		}
+		done_runs = r;
+		done_runs_size = size;
+	}
+	done_runs[nr_done_runs++] = *res;
+}
+
+/*
+ * The last run was handed back from the checkpoint rather than simulated.
+ * A summary that ends with it was printed before the checkpoint was taken,
+ * so a resume must not print it again.
+ */
+static bool last_run_replayed(void)
+{
+	return nr_done_runs && nr_done_runs <= nr_resume_runs;
+}
+
+/* The run is set up just like it was when the checkpoint was taken. */
+static void resume_run(struct time_simulator *s)
+{
+	int ret = time_simulator_restore(s, &resume, &checkpoint_ops);
+
+	checkpoint_close(&resume);
+	resuming = false;
+	if (ret) {
+		fprintf(stderr, "Failed to resume from %s: %s\n",
+			checkpoint_file, strerror(-ret));
+		exit(1);
+	}
+}
+
+/* Close every worker's current phase and add its times to its policy's. */
+static void fold_phases(struct time_simulator *s)
+{
+	struct entity *e;
+	int i, p;
+
+	list_for_each_entry(e, &s->entity_list, main_list) {
+		struct normal_entity *n =
+			container_of(e, struct normal_entity, e);
+
+		if (e->ops != &normal_ops || !n->wc)
+			continue;
+		i = policy_index(n->wc);
+		if (i < 0)
+			continue;
+		worker_phase(s, n, n->phase);
+		for (p = 0; p < NR_PHASES; p++)
+			phase_totals[i][p] += n->phase_time[p];
+	}
+}
+
+/*
+ * Folded stacks, one "policy;phase microseconds" line each, the input
+ * flamegraph.pl takes.
+ */
+static int write_phases(void)
+{
+	FILE *f = fopen(phase_file, "w");
+	int i, p;
+
+	if (!f) {
+		fprintf(stderr, "Failed to open %s: %s\n", phase_file,
+			strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < NR_POLICIES; i++)
+		for (p = 0; p < NR_PHASES; p++)
+			if (phase_totals[i][p] >= NSEC_PER_USEC)
+				fprintf(f, "%s;%s %llu\n",
+					scenario_policy_name(i),
+					phase_names[p],
+					(unsigned long long)
+					(phase_totals[i][p] / NSEC_PER_USEC));
+	if (fclose(f)) {
+		fprintf(stderr, "Failed to write %s: %s\n", phase_file,
+			strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static struct run_result
+run_classes(struct time_simulator *s, const char *testname,
+	    struct worker_class *classes, int nr_classes)
+{
+	unsigned int flags = class_flags(classes, nr_classes);
+	struct run_result res = {};
+	uint64_t max_delay = flush_max;
+	struct fs_state *t;
+	int nr_workers = 0;
+	int i, j, k;
+
+	if (nr_done_runs < nr_resume_runs)
+		return done_runs[nr_done_runs++];
+	cur_classes = classes;
+	cur_nr_classes = nr_classes;
+	if (alloc_filesystems(nr_filesystems)) {
+		fprintf(stderr, "Failed to allocate %d filesystems\n",
+			nr_filesystems);
+		return res;
+	}
+	/* Workers and flushes are queued at most this far ahead. */
+	for (i = 0; i < nr_classes; i++)
+		if (classes[i].run_period > max_delay)
+			max_delay = classes[i].run_period;
+	if (time_simulator_quantize(s, quantum, max_delay)) {
+		fprintf(stderr, "Failed to quantize time to %lluns\n",
+			(unsigned long long)quantum);
+		return res;
+	}
+	init_device();
+	if (nr_filesystems > 1) {
+		memset(&totals, 0, sizeof(totals));
+		init_quantiles(&totals);
+	}
+	for (i = 0; i < nr_filesystems; i++) {
+		init_fs(s, &filesystems[i], i, flags);
+		init_async_workers(s, &filesystems[i]);
+	}
+	arena_used = 0;
+	if (gauge_dir || stats_file)
+		init_gauges(s);
+	for (i = 0; i < nr_classes; i++) {
+		struct worker_class *wc = &classes[i];
+
+		wc->ops = 0;
+		wc->throttle_time = 0;
+		wc->throttle_events = 0;
+		quantile_init(&wc->throttle_p99, 0.99);
+	}
+	for (k = 0; k < nr_filesystems; k++) {
+		for (i = 0; i < nr_classes; i++) {
+			struct worker_class *wc = &classes[i];
+
+			for (j = 0; j < wc->nr_workers; j++) {
+				struct normal_entity *n = alloc_entity(s);
+				if (!n) {
+					fprintf(stderr, "Could only allocate %d workers\n",
+						nr_workers + j);
+					break;
+				}
+				n->fs = &filesystems[k];
+				n->wc = wc;
+				n->e.run = wc->run;
+				entity_enqueue(s, &n->e, 0);
+			}
+			nr_workers += wc->nr_workers;
+		}
+	}
+
+	if (recorder_dir) {
+		char label[64];
+
+		snprintf(label, sizeof(label), "%s-%d", testname, nr_workers);
+		time_simulator_recorder_label(s, label);
+	}
+	if (!quiet)
+		printf("starting %s run %d workers\n", testname, nr_workers);
+	if (resuming)
+		resume_run(s);
+	time_simulator_run(s, run_limit);
+
+	t = sum_filesystems();
+	res.ops_per_sec = (double)t->entity_ops / (s->time / NSEC_PER_SEC);
+	res.total_time = s->time;
+	if (t->throttle_events) {
+		res.throttle_avg = t->throttle_time / t->throttle_events;
+		res.throttle_p99 = quantile_get(&t->throttle_p99);
+	}
+
+	if (!quiet)
+		print_run(s, classes, nr_classes, t, &res);
+	if (gauge_dir)
+		write_gauges(s, testname, nr_workers);
+	if (results_dir || record)
+		write_results(s, testname, classes, nr_classes, t, &res);
+	if (phase_file)
+		fold_phases(s);
+	time_simulator_clear(s);
+	if (checkpoint_file)
+		save_run_result(&res);
+	return res;
+}
+
+static struct run_result
+run_test(struct time_simulator *s, const char *testname,
+	 void(*run)(struct time_simulator *s, struct entity *e),
+	 int nr_workers, unsigned int flags)
+{
+	struct worker_class wc = {
+		.name = testname,
+		.run = run,
+		.flags = flags,
+		.nr_workers = nr_workers,
+		.run_period = DEFAULT_RUN_PERIOD,
+		.min_refs = 0,
+		.max_refs = DEFAULT_MAX_REFS,
+	};
+
+	return run_classes(s, testname, &wc, 1);
+}
+
+/*
+ * A few metadata heavy writers mixed in with many light workers, to see who
+ * pays for the heavy writers' refs under each class's throttle policy.
+ */
+static void run_mixed(struct time_simulator *s, const char *testname,
+		      enum scenario_policy heavy, enum scenario_policy light)
+{
+	struct worker_class classes[] = {
+		{
+			.name = "heavy",
+			.run = policies[heavy].run,
+			.flags = policies[heavy].flags,
+			.nr_workers = 2,
+			.run_period = NSEC_PER_SEC >> 3,
+			.min_refs = 100,
+			.max_refs = 400,
+		},
+		{
+			.name = "light",
+			.run = policies[light].run,
+			.flags = policies[light].flags,
+			.nr_workers = 16,
+			.run_period = DEFAULT_RUN_PERIOD,
+			.min_refs = 0,
+			.max_refs = 5,
+		},
+	};
+
+	seed_random(1);
+	run_classes(s, testname, classes, ARRAY_SIZE(classes));
+}
+
+/*
+ * Throttling throughput and latency as the async flusher pool grows, every
+ * extra flusher makes the others ASYNC_CONTENTION_PCT slower.
+ */
+static void run_flusher_scaling(struct time_simulator *s, int nr_workers)
+{
+	static const int flushers[] = { 1, 2, 4, 8, 16 };
+	struct run_result res[ARRAY_SIZE(flushers)];
+	int saved = nr_async_flushers;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(flushers); i++) {
+		nr_async_flushers = flushers[i];
+		seed_random(1);
+		res[i] = run_test(s, "flusher scaling", throttle_run,
+				  nr_workers, 0);
+	}
+	nr_async_flushers = saved;
+	if (last_run_replayed())
+		return;
+
+	printf("flusher scaling %d workers\n", nr_workers);
+	printf("%8s %12s %16s %16s\n", "flushers", "ops/sec",
+	       "throttle avg ns", "throttle p99 ns");
+	for (i = 0; i < ARRAY_SIZE(flushers); i++)
+		printf("%8d %12f %16llu %16llu\n", flushers[i],
+		       res[i].ops_per_sec,
+		       (unsigned long long)res[i].throttle_avg,
+		       (unsigned long long)res[i].throttle_p99);
+	printf("\n");
+}
+
+/* Two sided 95% Student's t quantiles, the normal value past 30 degrees. */
+static double t95(int df)
+{
+	static const double table[] = {
+		12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306,
+		2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120,
+		2.110, 2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064,
+		2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+	};
+
+	if (df < 1)
+		return 0;
+	if (df > ARRAY_SIZE(table))
+		return 1.96;
+	return table[df - 1];
+}
+
+static void print_ci(const char *metric, double *v, int nr)
+{
+	double mean = 0, var = 0;
+	int i;
+
+	for (i = 0; i < nr; i++)
+		mean += v[i];
+	mean /= nr;
+	for (i = 0; i < nr; i++)
+		var += (v[i] - mean) * (v[i] - mean);
+	if (nr > 1)
+		var /= nr - 1;
+	printf("%-16s mean %f +/- %f (95%% CI)\n", metric, mean,
+	       t95(nr - 1) * sqrt(var / nr));
+}
+
+static void print_ensemble(const char *testname, int nr_workers,
+			   struct ensemble *ens)
+{
+	int i;
+
+	if (last_run_replayed())
+		return;
+	printf("ensemble %s %d workers %d seeds\n", testname, nr_workers,
+	       ens->nr);
+	printf("%6s %12s %16s %16s\n", "seed", "ops/sec", "throttle avg ns",
+	       "throttle p99 ns");
+	for (i = 0; i < ens->nr; i++)
+		printf("%6u %12f %16.0f %16.0f\n", ens->seed[i],
+		       ens->ops_per_sec[i], ens->throttle_avg[i],
+		       ens->throttle_p99[i]);
+	print_ci("ops/sec", ens->ops_per_sec, ens->nr);
+	print_ci("throttle avg ns", ens->throttle_avg, ens->nr);
+	print_ci("throttle p99 ns", ens->throttle_p99, ens->nr);
+	printf("\n");
+}
+
+static void ensemble_add(struct ensemble *ens, unsigned int seed,
+			 struct run_result *res)
+{
+	ens->seed[ens->nr] = seed;
+	ens->ops_per_sec[ens->nr] = res->ops_per_sec;
+	ens->throttle_avg[ens->nr] = res->throttle_avg;
+	ens->throttle_p99[ens->nr] = res->throttle_p99;
+	ens->nr++;
+}
+
+/*
+ * Replications share no state, but checkpoints, result tables, phases,
+ * gauges, recorder dumps, stats and the cache are all written per run by
+ * this process, so with any of those they run here one after another.
+ */
+static long ensemble_jobs(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (checkpoint_file || results_dir || phase_file || gauge_dir ||
+	    recorder_dir || stats_file || cache_dir)
+		return 1;
+	return cpus > 1 ? cpus : 1;
+}
+
+/* Run one replication in a child that sends its result back on *fd. */
+static pid_t start_replica(struct time_simulator *s, unsigned int seed,
+			   struct run_result (*run)(struct time_simulator *s,
+						    unsigned int seed,
+						    void *priv),
+			   void *priv, int *fd)
+{
+	int fds[2];
+	pid_t pid;
+
+	if (pipe(fds))
+		return -1;
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	if (!pid) {
+		struct run_result res;
+
+		close(fds[0]);
+		res = run(s, seed, priv);
+		_exit(write(fds[1], &res, sizeof(res)) == sizeof(res) ? 0 : 1);
+	}
+	close(fds[1]);
+	*fd = fds[0];
+	return pid;
+}
+
+static int finish_replica(pid_t pid, int fd, struct run_result *res)
+{
+	ssize_t ret = read(fd, res, sizeof(*res));
+	int status;
+
+	close(fd);
+	if (waitpid(pid, &status, 0) < 0)
+		return -errno;
+	if (ret != sizeof(*res) || !WIFEXITED(status) || WEXITSTATUS(status))
+		return -EIO;
+	return 0;
+}
+
+/*
+ * Run @run for each of @seeds into @ens, in seed order.  With more than one
+ * job replications run in forked children, up to a job per CPU at once.  A
+ * child is a copy of this process from before any of them ran, so each
+ * replication sees the same state it would have run from here, and one
+ * whose child failed is simply run here instead.
+ */
+static void run_replicas(struct time_simulator *s, struct ensemble *ens,
+			 const unsigned int *seeds, int nr,
+			 struct run_result (*run)(struct time_simulator *s,
+						  unsigned int seed,
+						  void *priv),
+			 void *priv)
+{
+	pid_t pids[MAX_ENSEMBLE];
+	int fds[MAX_ENSEMBLE];
+	long jobs = ensemble_jobs();
+	int started = 0;
+	int i;
+
+	memset(ens, 0, sizeof(*ens));
+	for (i = 0; i < nr; i++) {
+		struct run_result res;
+
+		while (jobs > 1 && started < nr && started < i + jobs) {
+			pids[started] = start_replica(s, seeds[started], run,
+						      priv, &fds[started]);
+			started++;
+		}
+		if (i >= started || pids[i] < 0 ||
+		    finish_replica(pids[i], fds[i], &res))
+			res = run(s, seeds[i], priv);
+		ensemble_add(ens, seeds[i], &res);
+	}
+}
+
+struct ensemble_test {
+	const char *testname;
+	void (*run)(struct time_simulator *s, struct entity *e);
+	int nr_workers;
+	unsigned int flags;
+};
+
+static struct run_result ensemble_test_run(struct time_simulator *s,
+					   unsigned int seed, void *priv)
+{
+	struct ensemble_test *t = priv;
+
+	seed_random(seed);
+	return run_test(s, t->testname, t->run, t->nr_workers, t->flags);
+}
+
+/*
+ * Replicate one scenario over seeds 1..nr_seeds.  Replication i is exactly
+ * the run_test() after seed_random(i), only the per-run output is dropped.
+ * Replications are separate scalar runs, in parallel where run_replicas()
+ * can, there is no batched or SIMD lockstep evaluation of them.
+ */
+static void run_ensemble(struct time_simulator *s, const char *testname,
+			 void(*run)(struct time_simulator *s, struct entity *e),
+			 int nr_workers, unsigned int flags, int nr_seeds)
+{
+	struct ensemble *ens = calloc(1, sizeof(struct ensemble));
+	struct ensemble_test t = { testname, run, nr_workers, flags };
+	unsigned int seeds[MAX_ENSEMBLE];
+	bool saved = quiet;
+	int i;
+
+	if (!ens) {
+		fprintf(stderr, "Failed to allocate ensemble\n");
+		return;
+	}
+
+	for (i = 0; i < nr_seeds; i++)
+		seeds[i] = i + 1;
+	quiet = true;
+	run_replicas(s, ens, seeds, nr_seeds, ensemble_test_run, &t);
+	quiet = saved;
+	print_ensemble(testname, nr_workers, ens);
+	free(ens);
+}
+
+static void run_ensembles(struct time_simulator *s, int nr_seeds)
+{
+	run_ensemble(s, "nothrottle", nothrottle_run, 10, 0, nr_seeds);
+	run_ensemble(s, "async nothrottle", async_nothrottle_run, 10, 0,
+		     nr_seeds);
+	run_ensemble(s, "inline", inline_refs_run, 10, 0, nr_seeds);
+	run_ensemble(s, "baseline throttle", throttle_run, 10, 0, nr_seeds);
+	run_ensemble(s, "test", test_run, 10, RUN_TEST, nr_seeds);
+	run_ensemble(s, "quantile throttle", throttle_run, 10, RUN_QUANTILE,
+		     nr_seeds);
+}
+
+/* What a scaling point sends back to the parent over the pipe. */
+struct scaling_point {
+	struct run_result res;
+	double max_ops;
+	uint64_t events;
+	double wall;
+};
+
+static double wall_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Run one policy at one size in a child, so the peak RSS wait4() reports is
+ * this point's alone and a million workers' worth of memory goes away with
+ * the child.
+ */
+static int run_scaling_point(struct time_simulator *s, int policy,
+			     int nr_workers, struct scaling_point *pt,
+			     struct rusage *ru)
+{
+	int fds[2], status;
+	pid_t pid;
+	ssize_t ret;
+
+	if (pipe(fds))
+		return -errno;
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -errno;
+	}
+	if (!pid) {
+		struct rlimit rl = { SCALING_BUDGET, SCALING_BUDGET + 1 };
+		uint64_t events = s->nr_dispatched;
+		double start;
+
+		close(fds[0]);
+		setrlimit(RLIMIT_CPU, &rl);
+		run_limit = SCALING_WINDOW;
+		arena = calloc((size_t)nr_workers * nr_filesystems,
+			       sizeof(struct normal_entity));
+		if (arena)
+			arena_size = nr_workers * nr_filesystems;
+		quiet = true;
+		seed_random(1);
+		start = wall_time();
+		pt->res = run_test(s, scenario_policy_name(policy),
+				   policies[policy].run, nr_workers,
+				   policies[policy].flags);
+		pt->wall = wall_time() - start;
+		pt->events = s->nr_dispatched - events;
+		pt->max_ops = (double)nr_workers * nr_filesystems *
+			NSEC_PER_SEC / DEFAULT_RUN_PERIOD;
+		ret = write(fds[1], pt, sizeof(*pt));
+		_exit(ret == sizeof(*pt) ? 0 : 1);
+	}
+	close(fds[1]);
+	ret = read(fds[0], pt, sizeof(*pt));
+	close(fds[0]);
+	if (wait4(pid, &status, 0, ru) < 0)
+		return -errno;
+	if (WIFSIGNALED(status) && (WTERMSIG(status) == SIGXCPU ||
+				    WTERMSIG(status) == SIGKILL))
+		return -ETIME;
+	if (ret != sizeof(*pt) || !WIFEXITED(status) || WEXITSTATUS(status))
+		return -EIO;
+	return 0;
+}
+
+/*
+ * Every policy at 1, 10, 100 ... @max_workers workers, one JSON object per
+ * line with the simulated results next to what they cost to simulate.  The
+ * simulated window is the same at every size, so events per second only
+ * drops where the simulator itself scales badly.  A point that runs out of
+ * budget is reported as such, and once a point takes more than a tenth of
+ * the budget the next, ten times bigger, one would too, so the rest of that
+ * policy's curve is reported as skipped.
+ */
+static int run_scaling(struct time_simulator *s, int max_workers)
+{
+	int policy, ret;
+	/* 64 bits, so the step past an int sized max_workers can't overflow. */
+	int64_t nr_workers;
+
+	for (policy = 0; policy < NR_POLICIES; policy++) {
+		bool skip = false;
+
+		for (nr_workers = 1; nr_workers <= max_workers;
+		     nr_workers *= 10) {
+			struct scaling_point pt = {};
+			struct rusage ru;
+
+			printf("{\"policy\":\"%s\",\"workers\":%lld,",
+			       scenario_policy_name(policy),
+			       (long long)nr_workers);
+			if (skip) {
+				printf("\"skipped\":true}\n");
+				continue;
+			}
+			ret = run_scaling_point(s, policy, nr_workers, &pt, &ru);
+			if (ret == -ETIME) {
+				printf("\"over_budget\":true}\n");
+				skip = true;
+				continue;
+			}
+			if (ret) {
+				printf("\"error\":\"%s\"}\n", strerror(-ret));
+				return ret;
+			}
+			printf("\"ops_per_sec\":%f,\"max_ops_per_sec\":%f,"
+			       "\"throttle_avg\":%llu,\"throttle_p99\":%llu,"
+			       "\"total_time\":%llu,\"wall_sec\":%f,"
+			       "\"events\":%llu,\"events_per_sec\":%f,"
+			       "\"peak_rss_kb\":%ld}\n",
+			       pt.res.ops_per_sec, pt.max_ops,
+			       (unsigned long long)pt.res.throttle_avg,
+			       (unsigned long long)pt.res.throttle_p99,
+			       (unsigned long long)pt.res.total_time, pt.wall,
+			       (unsigned long long)pt.events,
+			       pt.wall > 0 ? pt.events / pt.wall : 0,
+			       ru.ru_maxrss);
+			fflush(stdout);
+			if (pt.wall > SCALING_BUDGET / 10.0)
+				skip = true;
+		}
+	}
+	return 0;
+}
+
+static void run_default_tests(struct time_simulator *s)
+{
+	seed_random(1);
+	run_test(s, "nothrottle", nothrottle_run, 1, 0);
+	run_test(s, "nothrottle", nothrottle_run, 10, 0);
+	run_test(s, "async nothrottle", async_nothrottle_run, 1, 0);
+	run_test(s, "async nothrottle", async_nothrottle_run, 10, 0);
+	run_test(s, "inline", inline_refs_run, 1, 0);
+	run_test(s, "inline", inline_refs_run, 10, 0);
+	seed_random(1);
+	run_test(s, "baseline throttle", throttle_run, 1, 0);
+	run_test(s, "baseline throttle", throttle_run, 10, 0);
+	seed_random(1);
+	run_test(s, "test", test_run, 1, RUN_TEST);
+	run_test(s, "test", test_run, 10, RUN_TEST);
+	seed_random(1);
+	run_test(s, "quantile throttle", throttle_run, 1, RUN_QUANTILE);
+	run_test(s, "quantile throttle", throttle_run, 10, RUN_QUANTILE);
+	run_flusher_scaling(s, 10);
+	run_mixed(s, "mixed baseline throttle", POLICY_THROTTLE,
+		  POLICY_THROTTLE);
+	run_mixed(s, "mixed test", POLICY_TEST, POLICY_TEST);
+	run_mixed(s, "mixed quantile throttle", POLICY_QUANTILE,
+		  POLICY_QUANTILE);
+	run_mixed(s, "mixed heavy throttled", POLICY_QUANTILE,
+		  POLICY_ASYNC_NOTHROTTLE);
+}
+
+/*
+ * A backlog four times the forced flush threshold means flushing fell over,
+ * on any of the filesystems.
+ */
+static bool backlog_runaway(struct time_simulator *s, void *priv)
+{
+	int i;
+
+	for (i = 0; i < nr_filesystems; i++)
+		if (backlog_time(&filesystems[i], filesystems[i].flags) >
+		    4 * flush_thresh)
+			return true;
+	return false;
+}
+
+static int init_recorder(struct time_simulator *s)
+{
+	int ret;
+
+	ret = time_simulator_recorder(s, RECORDER_EVENTS, recorder_dir);
+	if (ret) {
+		fprintf(stderr, "Failed to set up the flight recorder: %s\n",
+			strerror(-ret));
+		return ret;
+	}
+	time_simulator_recorder_triggers(s, RECORDER_MAX_SLEEP, 0,
+					 backlog_runaway, NULL);
+	time_simulator_recorder_names(s, rec_names, ARRAY_SIZE(rec_names));
+	return 0;
+}
+
+static void init_profile_names(struct time_simulator *s)
+{
+	time_simulator_profile_name(s, transaction_run, "transaction_run");
+	time_simulator_profile_name(s, async_flusher_run, "async_flusher_run");
+	time_simulator_profile_name(s, async_flusher_run_test,
+				    "async_flusher_run_test");
+	time_simulator_profile_name(s, nothrottle_run, "nothrottle_run");
+	time_simulator_profile_name(s, async_nothrottle_run,
+				    "async_nothrottle_run");
+	time_simulator_profile_name(s, inline_refs_run, "inline_refs_run");
+	time_simulator_profile_name(s, throttle_run, "throttle_run");
+	time_simulator_profile_name(s, test_run, "test_run");
+	time_simulator_profile_name(s, rate_run, "rate_run");
+	time_simulator_profile_name(s, wake_sleeper, "wake_sleeper");
+	time_simulator_profile_name(s, test_wake_sleeper, "test_wake_sleeper");
+}
+
+static void init_percentile_table(uint64_t *table, uint64_t max)
+{
+	int i = 90;
+	table[99] = max;
+	max >>= 1;
+	for (i = 91; i < 98; i++)
+		table[i] = max;
+	for (i = 90; i >= 0; i--) {
+		if (!(i % 10))
+			max >>= 1;
+		table[i] = max;
+	}
+}
+
+/* Latency tables are built once for every distinct flush-max in the file. */
+struct latency_table {
+	uint64_t max;
+	uint64_t table[100];
+};
+
+static struct latency_table *latency_tables;
+static int nr_latency_tables;
+
+static uint64_t *get_latency_table(uint64_t max)
+{
+	struct latency_table *lt;
+	int i;
+
+	for (i = 0; i < nr_latency_tables; i++)
+		if (latency_tables[i].max == max)
+			return latency_tables[i].table;
+	lt = realloc(latency_tables,
+		     (nr_latency_tables + 1) * sizeof(*latency_tables));
+	if (!lt)
+		return NULL;
+	latency_tables = lt;
+	lt = &latency_tables[nr_latency_tables++];
+	/* Zeroed like the static table, init doesn't fill every entry. */
+	memset(lt, 0, sizeof(*lt));
+	lt->max = max;
+	init_percentile_table(lt->table, max);
+	return lt->table;
+}
+
+static void scenario_key(struct cache_key *k, struct scenario *sc,
+			 unsigned int seed)
+{
+	int i;
+
+	cache_key_init(k);
+	cache_key_add_str(k, "btrfs-throttle run");
+	cache_key_add_u64(k, cache_build_id());
+	cache_key_add_str(k, sc->name);
+	cache_key_add_u64(k, sc->policy);
+	cache_key_add_u64(k, sc->nr_flushers);
+	cache_key_add_u64(k, sc->horizon);
+	cache_key_add_u64(k, sc->flush_thresh);
+	cache_key_add_u64(k, sc->kick_thresh);
+	cache_key_add_u64(k, sc->flush_max);
+	cache_key_add_u64(k, sc->queue_depth);
+	cache_key_add_u64(k, sc->quantum);
+	cache_key_add_u64(k, sc->max_merge);
+	cache_key_add_u64(k, sc->read_cost);
+	cache_key_add_u64(k, sc->write_cost);
+	cache_key_add_u64(k, sc->dirty_per_op);
+	cache_key_add_u64(k, sc->dirty_background);
+	cache_key_add_u64(k, sc->dirty_limit);
+	cache_key_add_u64(k, sc->writeback_batch);
+	cache_key_add_u64(k, sc->nr_filesystems);
+	cache_key_add_u64(k, sc->nr_classes);
+	for (i = 0; i < sc->nr_classes; i++) {
+		struct scenario_class *c = &sc->classes[i];
+
+		cache_key_add_str(k, c->name);
+		cache_key_add_u64(k, c->nr_workers);
+		cache_key_add_u64(k, c->run_period);
+		cache_key_add_u64(k, c->min_refs);
+		cache_key_add_u64(k, c->max_refs);
+		cache_key_add_u64(k, c->policy);
+	}
+	cache_key_add_u64(k, seed);
+	cache_key_add_u64(k, quiet);
+}
+
+/*
+ * Walk the rows recorded by emit_row(), checking them or appending them to
+ * the results under the current run number.
+ */
+static int replay_rows(const char *p, const char *end, bool apply)
+{
+	union result_value row[NR_RUN_COLS];
+	uint64_t run = results_dir ? results_rows(&run_results) : 0;
+	int i, ret;
+
+	while (p < end) {
+		int table = (unsigned char)*p++;
+
+		if (table >= NR_TABLES ||
+		    tables[table].nr_columns > ARRAY_SIZE(row))
+			return -EINVAL;
+		for (i = 0; i < tables[table].nr_columns; i++) {
+			uint32_t len;
+
+			if (tables[table].columns[i].type != RESULT_STR) {
+				if (end - p < sizeof(uint64_t))
+					return -EINVAL;
+				memcpy(&row[i], p, sizeof(uint64_t));
+				p += sizeof(uint64_t);
+				continue;
+			}
+			if (end - p < sizeof(len))
+				return -EINVAL;
+			memcpy(&len, p, sizeof(len));
+			p += sizeof(len);
+			if (!len || len > end - p || p[len - 1])
+				return -EINVAL;
+			row[i].s = p;
+			p += len;
+		}
+		if (!apply)
+			continue;
+		row[0].u = run;
+		ret = emit_row(table, row);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * A cache entry is the run_result, the length and text of everything the
+ * run printed, then its result rows.
+ */
+static int replay_entry(const char *data, size_t len,
+			struct run_result *res)
+{
+	const char *end = data + len;
+	uint64_t text_len;
+	int ret;
+
+	if (len < sizeof(*res) + sizeof(text_len))
+		return -EINVAL;
+	memcpy(res, data, sizeof(*res));
+	data += sizeof(*res);
+	memcpy(&text_len, data, sizeof(text_len));
+	data += sizeof(text_len);
+	if (text_len > end - data)
+		return -EINVAL;
+	ret = replay_rows(data + text_len, end, false);
+	if (ret)
+		return ret;
+	fwrite(data, 1, text_len, stdout);
+	return replay_rows(data + text_len, end, true);
+}
+
+/* Point stdout at a temporary file so a run's output can be cached. */
+static FILE *capture_start(int *saved)
+{
+	FILE *tmp;
+
+	fflush(stdout);
+	tmp = tmpfile();
+	if (!tmp)
+		return NULL;
+	*saved = dup(STDOUT_FILENO);
+	if (*saved < 0 || dup2(fileno(tmp), STDOUT_FILENO) < 0) {
+		if (*saved >= 0)
+			close(*saved);
+		fclose(tmp);
+		return NULL;
+	}
+	return tmp;
+}
+
+static char *capture_stop(FILE *tmp, int saved, size_t *len)
+{
+	char *text = NULL;
+	long size;
+
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+	size = ftell(tmp);
+	if (size >= 0) {
+		text = malloc(size + 1);
+		rewind(tmp);
+		if (text && fread(text, 1, size, tmp) != size) {
+			free(text);
+			text = NULL;
+		}
+	}
+	fclose(tmp);
+	*len = text ? size : 0;
+	return text;
+}
+
+static void store_entry(struct cache_key *k, struct run_result *res,
+			const char *text, size_t text_len, const char *rows,
+			size_t rows_len)
+{
+	static bool warned;
+	uint64_t tlen = text_len;
+	char *buf;
+	size_t len = sizeof(*res) + sizeof(tlen) + text_len + rows_len;
+	int ret;
+
+	buf = malloc(len);
+	if (!buf)
+		return;
+	memcpy(buf, res, sizeof(*res));
+	memcpy(buf + sizeof(*res), &tlen, sizeof(tlen));
+	memcpy(buf + sizeof(*res) + sizeof(tlen), text, text_len);
+	memcpy(buf + sizeof(*res) + sizeof(tlen) + text_len, rows, rows_len);
+	ret = cache_store(cache_dir, k, buf, len);
+	if (ret && !warned) {
+		fprintf(stderr, "Failed to write to cache %s: %s\n",
+			cache_dir, strerror(-ret));
+		warned = true;
+	}
+	free(buf);
+}
+
+/*
+ * Run one seed of a scenario.  With a cache directory the run is looked up
+ * by its full configuration, the seed and the build id first, and a hit
+ * replays the stored output and result rows instead of simulating.
+ */
+static struct run_result run_seed(struct time_simulator *s,
+				  struct scenario *sc,
+				  struct worker_class *classes,
+				  unsigned int seed)
+{
+	struct run_result res;
+	struct cache_key key;
+	char *rows = NULL, *text = NULL;
+	size_t rows_len = 0, text_len = 0;
+	FILE *tmp = NULL;
+	void *data;
+	size_t len;
+	int saved;
+
+	seed_random(seed);
+	if (!cache_dir)
+		return run_classes(s, sc->name, classes, sc->nr_classes);
+
+	scenario_key(&key, sc, seed);
+	if (!cache_load(cache_dir, &key, &data, &len)) {
+		int ret = replay_entry(data, len, &res);
+
+		free(data);
+		if (!ret) {
+			cache_hits++;
+			cache_key_free(&key);
+			return res;
+		}
+	}
+	cache_misses++;
+
+	record = open_memstream(&rows, &rows_len);
+	if (!quiet)
+		tmp = capture_start(&saved);
+	res = run_classes(s, sc->name, classes, sc->nr_classes);
+	if (tmp) {
+		text = capture_stop(tmp, saved, &text_len);
+		fwrite(text, 1, text_len, stdout);
+	}
+	if (record && !fclose(record) && (quiet || text))
+		store_entry(&key, &res, text, text_len, rows, rows_len);
+	record = NULL;
+	free(rows);
+	free(text);
+	cache_key_free(&key);
+	return res;
+}
+
+struct ensemble_scenario {
+	struct scenario *sc;
+	struct worker_class *classes;
+};
+
+static struct run_result scenario_seed_run(struct time_simulator *s,
+					   unsigned int seed, void *priv)
+{
+	struct ensemble_scenario *r = priv;
+
+	return run_seed(s, r->sc, r->classes, seed);
+}
+
+static void run_scenario(struct time_simulator *s, struct scenario *sc,
+			 struct ensemble *ens)
+{
+	struct worker_class classes[SCENARIO_MAX_CLASSES];
+	struct ensemble_scenario r = { sc, classes };
+	bool saved = quiet;
+	int nr_workers = 0;
+	int i;
+
+	for (i = 0; i < sc->nr_classes; i++) {
+		struct scenario_class *c = &sc->classes[i];
+
+		classes[i] = (struct worker_class) {
+			.name = c->name,
+			.run = policies[c->policy].run,
+			.flags = policies[c->policy].flags,
+			.nr_workers = c->nr_workers,
+			.run_period = c->run_period,
+			.min_refs = c->min_refs,
+			.max_refs = c->max_refs,
+		};
+		nr_workers += c->nr_workers * sc->nr_filesystems;
+	}
+	nr_async_flushers = sc->nr_flushers;
+	commit_interval = sc->horizon;
+	flush_thresh = sc->flush_thresh;
+	kick_thresh = sc->kick_thresh;
+	flush_max = sc->flush_max;
+	flush_table = get_latency_table(flush_max);
+	queue_depth = sc->queue_depth;
+	quantum = sc->quantum;
+	max_merge = sc->max_merge;
+	read_cost = sc->read_cost;
+	write_cost = sc->write_cost;
+	dirty_per_op = sc->dirty_per_op;
+	dirty_background = sc->dirty_background;
+	dirty_limit = sc->dirty_limit;
+	writeback_batch = sc->writeback_batch;
+	nr_filesystems = sc->nr_filesystems;
+
+	if (sc->nr_seeds == 1) {
+		run_seed(s, sc, classes, sc->seeds[0]);
+		return;
+	}
+
+	quiet = true;
+	run_replicas(s, ens, sc->seeds, sc->nr_seeds, scenario_seed_run, &r);
+	quiet = saved;
+	print_ensemble(sc->name, nr_workers, ens);
+}
+
+/*
+ * Run every scenario in @path.  The whole file is validated before the first
+ * run, and the latency tables and worker arena are set up once up front.
+ */
+static int run_scenarios(struct time_simulator *s, const char *path,
+			 int nr_seeds)
+{
+	struct scenario defaults = {
+		.policy = POLICY_THROTTLE,
+		.nr_flushers = nr_async_flushers,
+		.horizon = DEFAULT_COMMIT_INTERVAL,
+		.flush_thresh = NSEC_PER_SEC,
+		.flush_max = DEFAULT_FLUSH_MAX,
+		.queue_depth = queue_depth,
+		.quantum = quantum,
+		.read_cost = DEFAULT_IO_COST,
+		.write_cost = DEFAULT_IO_COST,
+		.dirty_per_op = dirty_per_op,
+		.dirty_background = DEFAULT_DIRTY_BACKGROUND,
+		.dirty_limit = DEFAULT_DIRTY_LIMIT,
+		.writeback_batch = DEFAULT_WRITEBACK_BATCH,
+		.nr_filesystems = nr_filesystems,
+		.run_period = DEFAULT_RUN_PERIOD,
+		.max_refs = DEFAULT_MAX_REFS,
+		.nr_seeds = 1,
+		.seeds = { 1 },
+	};
+	struct scenario_file f;
+	struct ensemble *ens;
+	int i, ret;
+
+	if (nr_seeds) {
+		defaults.nr_seeds = nr_seeds;
+		for (i = 0; i < nr_seeds; i++)
+			defaults.seeds[i] = i + 1;
+	}
+	ret = scenario_load(path, &defaults, MAX_ASYNC_WORKERS, &f);
+	if (ret) {
+		if (ret != -EINVAL)
+			fprintf(stderr, "Failed to load %s: %s\n", path,
+				strerror(-ret));
+		return ret;
+	}
+
+	ens = malloc(sizeof(*ens));
+	arena = calloc(f.max_workers, sizeof(*arena));
+	if (!ens || !arena) {
+		fprintf(stderr, "Failed to allocate %d workers\n",
+			f.max_workers);
+		ret = -ENOMEM;
+		goto out;
+	}
+	arena_size = f.max_workers;
+	for (i = 0; i < f.nr; i++) {
+		if (!get_latency_table(f.scenarios[i].flush_max)) {
+			fprintf(stderr, "Failed to allocate latency tables\n");
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < f.nr; i++)
+		run_scenario(s, &f.scenarios[i], ens);
+	if (cache_dir)
+		fprintf(stderr, "cache: %llu hits %llu misses\n",
+			(unsigned long long)cache_hits,
+			(unsigned long long)cache_misses);
+out:
+	free(arena);
+	arena = NULL;
+	arena_size = 0;
+	free(latency_tables);
+	latency_tables = NULL;
+	nr_latency_tables = 0;
+	free(ens);
+	scenario_free(&f);
+	return ret;
+}
+
+/*
+ * An existing checkpoint file is resumed from, so a run that was killed is
+ * picked up again by running the same command line.
+ */
+static int init_checkpoints(struct time_simulator *s, int argc, char **argv)
+{
+	size_t len = 0;
+	int i, ret;
+
+	for (i = 1; i < argc; i++)
+		len += snprintf(checkpoint_args + len,
+				len < sizeof(checkpoint_args) ?
+				sizeof(checkpoint_args) - len : 0,
+				"%s ", argv[i]);
+	if (len >= sizeof(checkpoint_args)) {
+		fprintf(stderr, "Command line too long to checkpoint\n");
+		return -1;
+	}
+
+	ret = checkpoint_open(&resume, checkpoint_file);
+	if (!ret) {
+		checkpoint_prelude(s, &resume);
+		ret = resume.error;
+		if (ret) {
+			checkpoint_close(&resume);
+			fprintf(stderr, "Failed to resume from %s: %s\n",
+				checkpoint_file, strerror(-ret));
+			return -1;
+		}
+		resuming = true;
+		fprintf(stderr, "resuming from %s at run %llu, %.3fs\n",
+			checkpoint_file, (unsigned long long)nr_resume_runs,
+			(double)resume.time / NSEC_PER_SEC);
+	} else if (ret != -ENOENT) {
+		fprintf(stderr, "Failed to open %s: %s\n", checkpoint_file,
+			strerror(-ret));
+		return -1;
+	}
+
+	ret = time_simulator_checkpoint(s, checkpoint_file,
+					checkpoint_interval, &checkpoint_ops);
+	if (ret) {
+		fprintf(stderr, "Failed to set up checkpoints: %s\n",
+			strerror(-ret));
+		return -1;
+	}
+	return 0;
+}
+
+/* Everything ran, so the checkpoint has nothing left to resume. */
+static void finish_checkpoints(struct time_simulator *s)
+{
+	char tmp[PATH_MAX];
+
+	if (time_simulator_checkpoint_wait(s))
+		fprintf(stderr, "%llu of %llu checkpoints failed to write\n",
+			(unsigned long long)s->ckpt->failed,
+			(unsigned long long)s->ckpt->taken);
+	if (resuming) {
+		fprintf(stderr, "%s is from further than these runs go\n",
+			checkpoint_file);
+		checkpoint_close(&resume);
+		return;
+	}
+	unlink(checkpoint_file);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", checkpoint_file);
+	unlink(tmp);
+}
+
+int main(int argc, char **argv)
+{
+	struct time_simulator *s;
+	const char *scenario_file = NULL;
+	int nr_seeds = 0, max_workers = 0;
+	int opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "a:c:d:e:f:g:i:k:m:n:p:q:r:s:u:w:")) != -1) {
+		switch (opt) {
+		case 'a':
+			nr_async_flushers = atoi(optarg);
+			if (nr_async_flushers < 1 ||
+			    nr_async_flushers > MAX_ASYNC_WORKERS) {
+				fprintf(stderr, "Async flushers must be 1-%d\n",
+					MAX_ASYNC_WORKERS);
+				return -1;
+			}
+			break;
+		case 'c':
+			cache_dir = optarg;
+			break;
+		case 'd':
+			recorder_dir = optarg;
+			break;
+		case 'e':
+			nr_seeds = atoi(optarg);
+			if (nr_seeds < 1 || nr_seeds > MAX_ENSEMBLE) {
+				fprintf(stderr, "Ensemble size must be 1-%d\n",
+					MAX_ENSEMBLE);
+				return -1;
+			}
+			break;
+		case 'f':
+			scenario_file = optarg;
+			break;
+		case 'g':
+			gauge_dir = optarg;
+			break;
+		case 'i':
+			checkpoint_interval = strtoull(optarg, NULL, 0) *
+				NSEC_PER_SEC;
+			if (!checkpoint_interval) {
+				fprintf(stderr, "Checkpoint interval must be at least 1s\n");
+				return -1;
+			}
+			break;
+		case 'k':
+			checkpoint_file = optarg;
+			break;
+		case 'm':
+			stats_file = optarg;
+			break;
+		case 'n':
+			nr_filesystems = atoi(optarg);
+			if (nr_filesystems < 1 ||
+			    nr_filesystems > SCENARIO_MAX_FILESYSTEMS) {
+				fprintf(stderr, "Filesystems must be 1-%d\n",
+					SCENARIO_MAX_FILESYSTEMS);
+				return -1;
+			}
+			break;
+		case 'p':
+			phase_file = optarg;
+			break;
+		case 'q':
+			queue_depth = atoi(optarg);
+			if (queue_depth > SCENARIO_MAX_QUEUE_DEPTH) {
+				fprintf(stderr, "Queue depth must be 0-%d\n",
+					SCENARIO_MAX_QUEUE_DEPTH);
+				return -1;
+			}
+			break;
+		case 'r':
+			results_dir = optarg;
+			break;
+		case 's':
+			max_workers = atoi(optarg);
+			if (max_workers < 1) {
+				fprintf(stderr, "Scaling needs at least 1 worker\n");
+				return -1;
+			}
+			break;
+		case 'u':
+			quantum = strtoull(optarg, NULL, 0);
+			break;
+		case 'w':
+			dirty_per_op = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-a async-flushers] [-c cache-dir] [-d dump-dir] [-e seeds] [-f scenario-file] [-g gauge-dir] [-i checkpoint-interval] [-k checkpoint-file] [-m stats-file] [-n filesystems] [-p phase-file] [-q queue-depth] [-r results-dir] [-s max-workers] [-u quantum-ns] [-w dirty-pages-per-op]\n",
+				argv[0]);
+			return -1;
+		}
+	}
+
+	if (cache_dir && (!scenario_file || gauge_dir || recorder_dir ||
+			  phase_file)) {
+		fprintf(stderr, "The cache needs -f and can't be used with -d, -g or -p\n");
+		return -1;
+	}
+	if (max_workers && (scenario_file || nr_seeds || cache_dir ||
+			    gauge_dir || results_dir || recorder_dir ||
+			    phase_file)) {
+		fprintf(stderr, "Scaling runs on its own, only -a, -m, -n, -q, -u and -w go with -s\n");
+		return -1;
+	}
+	if (checkpoint_file && (max_workers || cache_dir || gauge_dir ||
+				results_dir || recorder_dir)) {
+		fprintf(stderr, "Checkpoints can't be used with -c, -d, -g, -r or -s\n");
+		return -1;
+	}
+
+	init_percentile_table(percentile_table, DEFAULT_FLUSH_MAX);
+
+	s = time_simulator_alloc(free_entity);
+	if (!s) {
+		perror("Error allocating time simulator\n");
+		return -1;
+	}
+	init_profile_names(s);
+	if (recorder_dir && init_recorder(s)) {
+		time_simulator_free(s);
+		return -1;
+	}
+	if (stats_file) {
+		ret = time_simulator_stats(s, stats_file);
+		if (ret) {
+			fprintf(stderr, "Failed to set up %s: %s\n",
+				stats_file, strerror(-ret));
+			time_simulator_free(s);
+			return -1;
+		}
+	}
+	if (results_dir && open_results()) {
+		time_simulator_free(s);
+		return -1;
+	}
+	if (checkpoint_file && init_checkpoints(s, argc, argv)) {
+		time_simulator_free(s);
+		return -1;
+	}
+
+	if (max_workers)
+		ret = run_scaling(s, max_workers);
+	else if (scenario_file)
+		ret = run_scenarios(s, scenario_file, nr_seeds);
+	else if (nr_seeds)
+		run_ensembles(s, nr_seeds);
+	else
+		run_default_tests(s);
+	if (results_dir)
+		close_results();
+	if (phase_file && write_phases())
+		ret = -1;
+	if (checkpoint_file)
+		finish_checkpoints(s);
+	/* Keep the scaling output pure JSON lines. */
+	if (!max_workers)
+		time_simulator_profile_print(s);
+	time_simulator_free(s);
+	free(filesystems);
+	free(done_runs);
+	return ret ? -1 : 0;
 }
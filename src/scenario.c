@@ -0,0 +1,441 @@
+#include "scenario.h"
+#include <time-simulator.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NSEC_PER_MSEC (NSEC_PER_USEC * 1000)
+
+static const char *policy_names[NR_POLICIES] = {
+	[POLICY_NOTHROTTLE] = "nothrottle",
+	[POLICY_ASYNC_NOTHROTTLE] = "async-nothrottle",
+	[POLICY_INLINE] = "inline",
+	[POLICY_THROTTLE] = "throttle",
+	[POLICY_TEST] = "test",
+	[POLICY_QUANTILE] = "quantile",
+	[POLICY_RATE] = "rate",
+};
+
+struct parser {
+	const char *path;
+	int line;
+	int errors;
+	int max_flushers;
+	struct scenario defaults;
+	struct scenario *cur;
+	bool cur_workers;
+	struct scenario_file *f;
+};
+
+static void parse_error(struct parser *p, const char *fmt, ...)
+{
+	va_list args;
+
+	fprintf(stderr, "%s:%d: ", p->path, p->line);
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fprintf(stderr, "\n");
+	p->errors++;
+}
+
+const char *scenario_policy_name(enum scenario_policy policy)
+{
+	return policy_names[policy];
+}
+
+static bool parse_u64(const char *str, uint64_t *v)
+{
+	char *end;
+
+	if (!isdigit((unsigned char)*str))
+		return false;
+	errno = 0;
+	*v = strtoull(str, &end, 0);
+	return !errno && *end == '\0';
+}
+
+static bool parse_time(const char *str, uint64_t *v)
+{
+	static const struct {
+		const char *suffix;
+		uint64_t mult;
+	} units[] = {
+		{ "ns", 1 },
+		{ "us", NSEC_PER_USEC },
+		{ "ms", NSEC_PER_MSEC },
+		{ "s", NSEC_PER_SEC },
+		{ "", 1 },
+	};
+	char *end;
+	int i;
+
+	if (!isdigit((unsigned char)*str))
+		return false;
+	errno = 0;
+	*v = strtoull(str, &end, 10);
+	if (errno)
+		return false;
+	for (i = 0; i < sizeof(units) / sizeof(units[0]); i++) {
+		if (strcmp(end, units[i].suffix))
+			continue;
+		if (*v > UINT64_MAX / units[i].mult)
+			return false;
+		*v *= units[i].mult;
+		return true;
+	}
+	return false;
+}
+
+/* "a-b" or just "a", which is the range a-a. */
+static bool parse_range(char *str, uint64_t *lo, uint64_t *hi)
+{
+	char *dash = strchr(str, '-');
+	bool ret;
+
+	if (!dash)
+		return parse_u64(str, lo) && parse_u64(str, hi);
+	*dash = '\0';
+	ret = parse_u64(str, lo) && parse_u64(dash + 1, hi) && *lo <= *hi;
+	*dash = '-';
+	return ret;
+}
+
+static void parse_seeds(struct parser *p, struct scenario *sc, char *val)
+{
+	char *tok, *save;
+
+	sc->nr_seeds = 0;
+	for (tok = strtok_r(val, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		uint64_t lo, hi;
+
+		if (!parse_range(tok, &lo, &hi) || hi > UINT32_MAX) {
+			parse_error(p, "bad seed range '%s'", tok);
+			return;
+		}
+		for (; lo <= hi; lo++) {
+			if (sc->nr_seeds == SCENARIO_MAX_SEEDS) {
+				parse_error(p, "more than %d seeds",
+					    SCENARIO_MAX_SEEDS);
+				return;
+			}
+			sc->seeds[sc->nr_seeds++] = lo;
+		}
+	}
+	if (!sc->nr_seeds)
+		parse_error(p, "no seeds given");
+}
+
+static bool parse_policy(const char *str, enum scenario_policy *policy)
+{
+	int i;
+
+	for (i = 0; i < NR_POLICIES; i++) {
+		if (!strcmp(str, policy_names[i])) {
+			*policy = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* class NAME WORKERS PERIOD MIN-MAX [POLICY] */
+static void parse_class(struct parser *p, struct scenario *sc, char *val)
+{
+	struct scenario_class *c;
+	char *name, *workers, *period, *refs, *policy, *save;
+	uint64_t nr;
+
+	if (!sc) {
+		parse_error(p, "class outside of a scenario");
+		return;
+	}
+	if (sc->nr_classes == SCENARIO_MAX_CLASSES) {
+		parse_error(p, "more than %d classes", SCENARIO_MAX_CLASSES);
+		return;
+	}
+	name = strtok_r(val, " \t", &save);
+	workers = strtok_r(NULL, " \t", &save);
+	period = strtok_r(NULL, " \t", &save);
+	refs = strtok_r(NULL, " \t", &save);
+	policy = strtok_r(NULL, " \t", &save);
+	if (!refs || (policy && strtok_r(NULL, " \t", &save))) {
+		parse_error(p, "class needs a name, workers, period and refs");
+		return;
+	}
+
+	c = &sc->classes[sc->nr_classes];
+	if (!parse_u64(workers, &nr) || !nr || nr > INT32_MAX) {
+		parse_error(p, "bad worker count '%s'", workers);
+		return;
+	}
+	c->nr_workers = nr;
+	if (!parse_time(period, &c->run_period) || !c->run_period) {
+		parse_error(p, "bad period '%s'", period);
+		return;
+	}
+	if (!parse_range(refs, &c->min_refs, &c->max_refs) || !c->max_refs) {
+		parse_error(p, "bad refs range '%s'", refs);
+		return;
+	}
+	/* Classes without one are given the scenario's when it ends. */
+	c->policy = NR_POLICIES;
+	if (policy && !parse_policy(policy, &c->policy)) {
+		parse_error(p, "unknown policy '%s'", policy);
+		return;
+	}
+	c->name = strdup(name);
+	if (!c->name) {
+		parse_error(p, "out of memory");
+		return;
+	}
+	sc->nr_classes++;
+}
+
+static void parse_setting(struct parser *p, char *key, char *val)
+{
+	struct scenario *sc = p->cur ? p->cur : &p->defaults;
+	uint64_t v;
+
+	if (!strcmp(key, "class")) {
+		parse_class(p, p->cur, val);
+	} else if (!strcmp(key, "policy")) {
+		if (!parse_policy(val, &sc->policy))
+			parse_error(p, "unknown policy '%s'", val);
+	} else if (!strcmp(key, "flushers")) {
+		if (!parse_u64(val, &v) || !v || v > p->max_flushers)
+			parse_error(p, "flushers must be 1-%d", p->max_flushers);
+		else
+			sc->nr_flushers = v;
+	} else if (!strcmp(key, "workers")) {
+		if (!parse_u64(val, &v) || !v || v > INT32_MAX)
+			parse_error(p, "bad worker count '%s'", val);
+		else
+			sc->nr_workers = v;
+		p->cur_workers = !!p->cur;
+	} else if (!strcmp(key, "horizon")) {
+		if (!parse_time(val, &sc->horizon) ||
+		    sc->horizon < NSEC_PER_SEC)
+			parse_error(p, "horizon must be at least 1s");
+	} else if (!strcmp(key, "flush-threshold")) {
+		if (!parse_time(val, &sc->flush_thresh) || !sc->flush_thresh)
+			parse_error(p, "bad flush threshold '%s'", val);
+	} else if (!strcmp(key, "kick-threshold")) {
+		if (!parse_time(val, &sc->kick_thresh) || !sc->kick_thresh)
+			parse_error(p, "bad kick threshold '%s'", val);
+	} else if (!strcmp(key, "flush-max")) {
+		if (!parse_time(val, &sc->flush_max) || sc->flush_max < 1024)
+			parse_error(p, "flush-max must be at least 1024ns");
+	} else if (!strcmp(key, "queue-depth")) {
+		if (!parse_u64(val, &v) || v > SCENARIO_MAX_QUEUE_DEPTH)
+			parse_error(p, "queue-depth must be 0-%d",
+				    SCENARIO_MAX_QUEUE_DEPTH);
+		else
+			sc->queue_depth = v;
+	} else if (!strcmp(key, "quantum")) {
+		if (!parse_time(val, &sc->quantum))
+			parse_error(p, "bad quantum '%s'", val);
+	} else if (!strcmp(key, "merge")) {
+		if (!parse_u64(val, &v) || v > UINT32_MAX)
+			parse_error(p, "bad merge size '%s'", val);
+		else
+			sc->max_merge = v;
+	} else if (!strcmp(key, "read-cost") || !strcmp(key, "write-cost")) {
+		if (!parse_u64(val, &v) || !v || v > 1000)
+			parse_error(p, "%s must be 1-1000%%", key);
+		else if (key[0] == 'r')
+			sc->read_cost = v;
+		else
+			sc->write_cost = v;
+	} else if (!strcmp(key, "dirty")) {
+		if (!parse_u64(val, &sc->dirty_per_op))
+			parse_error(p, "bad dirty pages '%s'", val);
+	} else if (!strcmp(key, "dirty-background")) {
+		if (!parse_u64(val, &sc->dirty_background))
+			parse_error(p, "bad dirty-background '%s'", val);
+	} else if (!strcmp(key, "dirty-limit")) {
+		if (!parse_u64(val, &sc->dirty_limit) || !sc->dirty_limit)
+			parse_error(p, "bad dirty-limit '%s'", val);
+	} else if (!strcmp(key, "writeback-batch")) {
+		if (!parse_u64(val, &sc->writeback_batch) ||
+		    !sc->writeback_batch)
+			parse_error(p, "bad writeback-batch '%s'", val);
+	} else if (!strcmp(key, "filesystems")) {
+		if (!parse_u64(val, &v) || !v || v > SCENARIO_MAX_FILESYSTEMS)
+			parse_error(p, "filesystems must be 1-%d",
+				    SCENARIO_MAX_FILESYSTEMS);
+		else
+			sc->nr_filesystems = v;
+	} else if (!strcmp(key, "seeds")) {
+		parse_seeds(p, sc, val);
+	} else {
+		parse_error(p, "unknown setting '%s'", key);
+	}
+}
+
+/* Fill in the shorthand class and check the scenario is runnable. */
+static void finish_scenario(struct parser *p)
+{
+	struct scenario *sc = p->cur;
+	int line = p->line;
+	int i, total = 0;
+
+	if (!sc)
+		return;
+	p->line = sc->line;
+	if (sc->dirty_background >= sc->dirty_limit)
+		parse_error(p, "'%s' dirty-background must be below dirty-limit",
+			    sc->name);
+	if (sc->nr_classes && p->cur_workers) {
+		parse_error(p, "'%s' has both workers and classes", sc->name);
+	} else if (!sc->nr_classes && !sc->nr_workers) {
+		parse_error(p, "'%s' has no workers", sc->name);
+	} else if (!sc->nr_classes) {
+		struct scenario_class *c = &sc->classes[0];
+
+		c->name = strdup(sc->name);
+		if (!c->name)
+			parse_error(p, "out of memory");
+		c->nr_workers = sc->nr_workers;
+		c->run_period = sc->run_period;
+		c->min_refs = 0;
+		c->max_refs = sc->max_refs;
+		c->policy = NR_POLICIES;
+		sc->nr_classes = 1;
+	}
+	for (i = 0; i < sc->nr_classes; i++)
+		if (sc->classes[i].policy == NR_POLICIES)
+			sc->classes[i].policy = sc->policy;
+	for (i = 0; i < sc->nr_classes; i++) {
+		if (total > INT32_MAX - sc->classes[i].nr_workers) {
+			parse_error(p, "'%s' has too many workers", sc->name);
+			break;
+		}
+		total += sc->classes[i].nr_workers;
+	}
+	if (total > INT32_MAX / sc->nr_filesystems)
+		parse_error(p, "'%s' has too many workers", sc->name);
+	else
+		total *= sc->nr_filesystems;
+	if (total > p->f->max_workers)
+		p->f->max_workers = total;
+	p->line = line;
+	p->cur = NULL;
+}
+
+static void start_scenario(struct parser *p, const char *name)
+{
+	struct scenario_file *f = p->f;
+	struct scenario *sc;
+
+	finish_scenario(p);
+	if (!*name) {
+		parse_error(p, "scenario needs a name");
+		name = "?";
+	}
+	sc = realloc(f->scenarios, (f->nr + 1) * sizeof(*sc));
+	if (!sc) {
+		parse_error(p, "out of memory");
+		return;
+	}
+	f->scenarios = sc;
+	sc = &f->scenarios[f->nr++];
+	*sc = p->defaults;
+	sc->nr_classes = 0;
+	sc->line = p->line;
+	p->cur_workers = false;
+	sc->name = strdup(name);
+	if (!sc->name)
+		parse_error(p, "out of memory");
+	p->cur = sc;
+}
+
+static char *trim(char *str)
+{
+	char *end;
+
+	while (isspace((unsigned char)*str))
+		str++;
+	end = str + strlen(str);
+	while (end > str && isspace((unsigned char)end[-1]))
+		*--end = '\0';
+	return str;
+}
+
+int scenario_load(const char *path, const struct scenario *defaults,
+		  int max_flushers, struct scenario_file *f)
+{
+	struct parser p = {
+		.path = path,
+		.max_flushers = max_flushers,
+		.defaults = *defaults,
+		.f = f,
+	};
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *fp;
+	int ret = 0;
+
+	memset(f, 0, sizeof(*f));
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+
+	while (getline(&buf, &len, fp) != -1) {
+		char *line, *key, *val;
+
+		p.line++;
+		line = buf;
+		line[strcspn(line, "#")] = '\0';
+		line = trim(line);
+		if (!*line)
+			continue;
+		key = line;
+		val = line + strcspn(line, " \t");
+		if (*val)
+			*val++ = '\0';
+		val = trim(val);
+
+		if (!strcmp(key, "scenario"))
+			start_scenario(&p, val);
+		else if (!*val)
+			parse_error(&p, "'%s' needs a value", key);
+		else
+			parse_setting(&p, key, val);
+	}
+	if (ferror(fp))
+		ret = -EIO;
+	finish_scenario(&p);
+	free(buf);
+	fclose(fp);
+
+	if (!ret && !f->nr) {
+		fprintf(stderr, "%s: no scenarios\n", path);
+		p.errors++;
+	}
+	if (!ret && p.errors)
+		ret = -EINVAL;
+	if (ret)
+		scenario_free(f);
+	return ret;
+}
+
+void scenario_free(struct scenario_file *f)
+{
+	int i, j;
+
+	for (i = 0; i < f->nr; i++) {
+		struct scenario *sc = &f->scenarios[i];
+
+		for (j = 0; j < sc->nr_classes; j++)
+			free(sc->classes[j].name);
+		free(sc->name);
+	}
+	free(f->scenarios);
+	memset(f, 0, sizeof(*f));
+}
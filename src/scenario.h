@@ -0,0 +1,110 @@
+#ifndef _SCENARIO_H
+#define _SCENARIO_H
+
+#include <stdint.h>
+
+/*
+ * Scenario files describe btrfs-throttle runs so sweeps don't need a
+ * recompile.  One setting per line, '#' starts a comment.  Settings before
+ * the first "scenario" line are defaults for every scenario after them.
+ *
+ *	horizon 30s			time until the transaction commit
+ *	flush-max 500ms			slowest flush in the latency table
+ *	queue-depth 32			flush through a device, 0 doesn't
+ *	merge 64			blocks one device write may merge
+ *	read-cost 50			% of a latency draw a read costs
+ *	write-cost 50			% of a latency draw a write costs
+ *	dirty 4				pages every op dirties, 0 doesn't
+ *	dirty-background 1024		dirty pages that start writeback
+ *	dirty-limit 2048		dirty pages that block workers
+ *	writeback-batch 64		pages written back per request
+ *	filesystems 4			copies of the fs sharing the device
+ *	quantum 100us			round wake times up to this, 0 doesn't
+ *
+ *	scenario baseline throttle
+ *	policy throttle
+ *	flushers 4
+ *	kick-threshold 250ms		backlog that kicks the async flushers
+ *	flush-threshold 1s		backlog that forces throttling
+ *	seeds 1-8,42
+ *	workers 10
+ *
+ *	scenario mixed test
+ *	policy test
+ *	class heavy 2 125ms 100-400	name, workers, period, refs range
+ *	class light 16 62500us 0-5 async-nothrottle
+ *
+ * Times take an ns, us, ms or s suffix and default to ns.  "workers N" is
+ * shorthand for a single class with the default period and refs.  A class
+ * may end in its own policy, otherwise it takes the scenario's.  Policies
+ * are nothrottle, async-nothrottle, inline, throttle, test, quantile and
+ * rate.
+ */
+#define SCENARIO_MAX_CLASSES 16
+#define SCENARIO_MAX_SEEDS 256
+#define SCENARIO_MAX_QUEUE_DEPTH 65536
+#define SCENARIO_MAX_FILESYSTEMS 1024
+
+enum scenario_policy {
+	POLICY_NOTHROTTLE,
+	POLICY_ASYNC_NOTHROTTLE,
+	POLICY_INLINE,
+	POLICY_THROTTLE,
+	POLICY_TEST,
+	POLICY_QUANTILE,
+	POLICY_RATE,
+	NR_POLICIES,
+};
+
+struct scenario_class {
+	char *name;
+	int nr_workers;
+	uint64_t run_period;
+	uint64_t min_refs;
+	uint64_t max_refs;
+	enum scenario_policy policy;
+};
+
+struct scenario {
+	char *name;
+	int line;
+	enum scenario_policy policy;
+	int nr_flushers;
+	int nr_workers;
+	uint64_t horizon;
+	uint64_t flush_thresh;
+	uint64_t kick_thresh;		/* 0 picks the policy default */
+	uint64_t flush_max;
+	unsigned int queue_depth;	/* 0 flushes off the latency table */
+	uint64_t quantum;		/* 0 keeps wake times exact */
+	unsigned int max_merge;
+	unsigned int read_cost;
+	unsigned int write_cost;
+	uint64_t dirty_per_op;		/* 0 models no page cache */
+	uint64_t dirty_background;
+	uint64_t dirty_limit;
+	uint64_t writeback_batch;
+	int nr_filesystems;		/* every class runs on each of them */
+	uint64_t run_period;
+	uint64_t max_refs;
+	int nr_seeds;
+	unsigned int seeds[SCENARIO_MAX_SEEDS];
+	int nr_classes;
+	struct scenario_class classes[SCENARIO_MAX_CLASSES];
+};
+
+struct scenario_file {
+	struct scenario *scenarios;
+	int nr;
+	int max_workers;		/* over all filesystems */
+};
+
+/*
+ * Parse and validate all of @path before anything runs.  Every problem is
+ * reported as file:line on stderr, returns -EINVAL if there were any.
+ */
+int scenario_load(const char *path, const struct scenario *defaults,
+		  int max_flushers, struct scenario_file *f);
+void scenario_free(struct scenario_file *f);
+const char *scenario_policy_name(enum scenario_policy policy);
+#endif /* _SCENARIO_H */
@@ -0,0 +1,219 @@
+#include <time-simulator.hpp>
+#include <sampler.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <unistd.h>
+
+/*
+ * Dispatch overhead of the C and C++ front ends on the same workload: fixed
+ * period tickers mixed with jittery entities, each event doing a tiny bit of
+ * work and requeueing itself.
+ */
+#define TICK_PERIOD (NSEC_PER_SEC >> 4)
+#define JITTER_MAX (NSEC_PER_SEC >> 3)
+#define JITTER_CLASS 1
+#define NR_QUERIES 1000000
+
+static struct sampler stream;
+static uint64_t events;
+static uint64_t quantum;
+static bool lookahead;
+
+struct c_ticker {
+	struct entity e;
+	uint64_t work;
+};
+
+static void c_ticker_run(struct time_simulator *s, struct entity *e)
+{
+	struct c_ticker *t = container_of(e, struct c_ticker, e);
+
+	events++;
+	t->work += s->time & 0xff;
+	entity_enqueue(s, e, TICK_PERIOD);
+}
+
+static void c_jitter_run(struct time_simulator *s, struct entity *e)
+{
+	struct c_ticker *t = container_of(e, struct c_ticker, e);
+
+	events++;
+	t->work += s->time & 0xff;
+	entity_enqueue(s, e, 1 + sampler_bounded(&stream, JITTER_MAX));
+}
+
+struct ticker : ts::entity<ticker> {
+	uint64_t work = 0;
+
+	void run(struct time_simulator *s)
+	{
+		events++;
+		work += s->time & 0xff;
+		enqueue(s, TICK_PERIOD);
+	}
+};
+
+struct jitter : ts::entity<jitter> {
+	uint64_t work = 0;
+
+	void run(struct time_simulator *s)
+	{
+		events++;
+		work += s->time & 0xff;
+		enqueue(s, 1 + sampler_bounded(&stream, JITTER_MAX));
+	}
+};
+
+static void free_nothing(struct entity *e)
+{
+}
+
+static void report(const char *name, double secs, uint64_t work)
+{
+	printf("%-6s %12llu events %8.3fs %14.0f events/sec (work %llu)\n",
+	       name, (unsigned long long)events, secs, events / secs,
+	       (unsigned long long)work);
+}
+
+/* Look a tick ahead from the end of the run, as a predictive policy would. */
+static void bench_queries(struct time_simulator *s)
+{
+	uint64_t found = 0;
+	int i;
+
+	auto start = std::chrono::steady_clock::now();
+	for (i = 0; i < NR_QUERIES; i++) {
+		found += time_simulator_nr_due(s, s->time + (i & 0xff) *
+					       (TICK_PERIOD >> 8));
+		found += !!time_simulator_earliest(s, JITTER_CLASS);
+	}
+	std::chrono::duration<double> secs =
+		std::chrono::steady_clock::now() - start;
+
+	printf("%-6s %12d pairs %9.3fs %14.0f queries/sec (found %llu)\n",
+	       "query", NR_QUERIES, secs.count(),
+	       2 * NR_QUERIES / secs.count(), (unsigned long long)found);
+}
+
+static void bench_c(int nr, uint64_t horizon)
+{
+	std::unique_ptr<c_ticker[]> ents(new c_ticker[nr]());
+	struct time_simulator *s = time_simulator_alloc(free_nothing);
+	uint64_t work = 0;
+	int i;
+
+	if (!s || time_simulator_quantize(s, quantum, JITTER_MAX) ||
+	    time_simulator_lookahead(s, lookahead)) {
+		perror("Error allocating time simulator");
+		exit(1);
+	}
+	sampler_init(&stream, 1, 0);
+	events = 0;
+	for (i = 0; i < nr; i++) {
+		entity_init(s, &ents[i].e);
+		ents[i].e.run = (i & 1) ? c_jitter_run : c_ticker_run;
+		ents[i].e.event_class = (i & 1) ? JITTER_CLASS : 0;
+		entity_enqueue(s, &ents[i].e, 0);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	time_simulator_run(s, horizon);
+	std::chrono::duration<double> secs =
+		std::chrono::steady_clock::now() - start;
+
+	for (i = 0; i < nr; i++)
+		work += ents[i].work;
+	report("C", secs.count(), work);
+	time_simulator_print_quantum(s);
+	if (lookahead)
+		bench_queries(s);
+	time_simulator_clear(s);
+	time_simulator_free(s);
+}
+
+static void bench_cxx(int nr, uint64_t horizon)
+{
+	std::unique_ptr<ticker[]> tickers(new ticker[nr / 2 + 1]);
+	std::unique_ptr<jitter[]> jitters(new jitter[nr / 2 + 1]);
+	ts::simulator<ticker, jitter> sim;
+	uint64_t work = 0;
+	int i;
+
+	if (time_simulator_quantize(sim.get(), quantum, JITTER_MAX) ||
+	    time_simulator_lookahead(sim.get(), lookahead)) {
+		perror("Error allocating time simulator");
+		exit(1);
+	}
+	sampler_init(&stream, 1, 0);
+	events = 0;
+	for (i = 0; i < nr; i++) {
+		struct entity *e;
+
+		if (i & 1) {
+			sim.add(jitters[i / 2]);
+			e = &jitters[i / 2];
+		} else {
+			sim.add(tickers[i / 2]);
+			e = &tickers[i / 2];
+		}
+		entity_enqueue(sim.get(), e, 0);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	sim.run(horizon);
+	std::chrono::duration<double> secs =
+		std::chrono::steady_clock::now() - start;
+
+	for (i = 0; i < nr / 2 + 1; i++)
+		work += tickers[i].work + jitters[i].work;
+	report("C++", secs.count(), work);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t horizon = 600ULL * NSEC_PER_SEC;
+	int nr = 1000;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "ln:q:t:")) != -1) {
+		switch (opt) {
+		case 'l':
+			lookahead = true;
+			break;
+		case 'n':
+			nr = atoi(optarg);
+			break;
+		case 'q':
+			quantum = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			horizon = strtoull(optarg, NULL, 0) * NSEC_PER_SEC;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-l] [-n entities] [-q quantum-ns] [-t seconds]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (nr < 1) {
+		fprintf(stderr, "Need at least one entity\n");
+		return 1;
+	}
+	if (lookahead && quantum > 1) {
+		fprintf(stderr, "Lookahead doesn't work with a quantum\n");
+		return 1;
+	}
+
+	printf("%d entities, %llu simulated seconds", nr,
+	       (unsigned long long)(horizon / NSEC_PER_SEC));
+	if (quantum)
+		printf(", %lluns quantum", (unsigned long long)quantum);
+	if (lookahead)
+		printf(", lookahead");
+	printf("\n");
+	bench_c(nr, horizon);
+	bench_cxx(nr, horizon);
+	return 0;
+}
@@ -0,0 +1,101 @@
+#include <time-simulator.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Watch the stats page of a running simulation, see stats.h.  Redraws the
+ * screen every interval when stdout is a terminal and appends a snapshot
+ * otherwise.
+ */
+#define DEFAULT_INTERVAL_MS 1000
+
+static uint64_t realtime_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * (uint64_t)NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void print_page(const char *path, struct stats_page *p, bool tty)
+{
+	uint64_t now = realtime_ns();
+	bool alive = !kill(p->pid, 0) || errno == EPERM;
+	uint32_t i;
+
+	if (tty)
+		printf("\033[H\033[2J");
+	printf("%s: pid %u %s, updated %.1fs ago\n", path, p->pid,
+	       alive ? "running" : "gone",
+	       now > p->wall ? (double)(now - p->wall) / NSEC_PER_SEC : 0);
+	printf("run %llu at %.6fs simulated\n", (unsigned long long)p->runs,
+	       (double)p->time / NSEC_PER_SEC);
+	printf("events %llu, %llu per second\n",
+	       (unsigned long long)p->events,
+	       (unsigned long long)p->events_per_sec);
+	printf("queued %llu sleeping %llu\n", (unsigned long long)p->queued,
+	       (unsigned long long)p->sleepers);
+	for (i = 0; i < p->nr_gauges && i < STATS_MAX_GAUGES; i++)
+		printf("  %-*.*s %llu\n", STATS_NAME_LEN, STATS_NAME_LEN,
+		       p->gauges[i].name,
+		       (unsigned long long)p->gauges[i].value);
+	if (!tty)
+		printf("\n");
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	struct stats_page *page, copy;
+	unsigned int interval = DEFAULT_INTERVAL_MS;
+	int count = 0, opt, i;
+	bool tty = isatty(STDOUT_FILENO);
+
+	while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval = atoi(optarg);
+			if (!interval) {
+				fprintf(stderr, "Interval must be at least 1ms\n");
+				return -1;
+			}
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1)
+		goto usage;
+
+	page = stats_page_map(argv[optind]);
+	if (!page) {
+		fprintf(stderr, "Failed to map %s: %s\n", argv[optind],
+			strerror(errno));
+		return -1;
+	}
+	for (i = 0; !count || i < count; i++) {
+		if (i)
+			usleep(interval * 1000);
+		if (stats_page_read(page, &copy)) {
+			fprintf(stderr, "%s is stuck mid update\n",
+				argv[optind]);
+			stats_page_unmap(page);
+			return -1;
+		}
+		print_page(argv[optind], &copy, tty);
+	}
+	stats_page_unmap(page);
+	return 0;
+usage:
+	fprintf(stderr, "Usage: %s [-i interval-ms] [-n count] stats-file\n",
+		argv[0]);
+	return -1;
+}
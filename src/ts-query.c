@@ -0,0 +1,399 @@
+#include <results.h>
+#include <errno.h>
+#include <float.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Filter and aggregate a results file without reading it into memory.  The
+ * file is mapped and walked a chunk at a time, only the columns named in
+ * filters, the group and the output are ever touched.
+ */
+#define MAX_FILTERS 16
+#define MAX_OUTPUTS 32
+
+enum filter_op {
+	OP_EQ,
+	OP_NE,
+	OP_LT,
+	OP_LE,
+	OP_GT,
+	OP_GE,
+};
+
+struct filter {
+	int col;
+	enum filter_op op;
+	const char *str;
+	double value;
+};
+
+struct agg {
+	uint64_t count;
+	double sum;
+	double min;
+	double max;
+};
+
+struct group {
+	char *key;
+	uint64_t rows;
+	struct agg stats[MAX_OUTPUTS];
+};
+
+static struct filter filters[MAX_FILTERS];
+static int nr_filters;
+static int outputs[MAX_OUTPUTS];
+static int nr_outputs;
+static struct group *groups;
+static int nr_groups;
+
+static double value(struct results_map *m, struct results_chunk *c, int col,
+		    uint64_t row)
+{
+	if (m->columns[col].type == RESULT_F64)
+		return results_f64(c, col, row);
+	return results_u64(c, col, row);
+}
+
+static int parse_filter(struct results_map *m, char *arg)
+{
+	static const struct {
+		const char *str;
+		enum filter_op op;
+	} ops[] = {
+		{ "!=", OP_NE }, { "<=", OP_LE }, { ">=", OP_GE },
+		{ "=", OP_EQ }, { "<", OP_LT }, { ">", OP_GT },
+	};
+	struct filter *f = &filters[nr_filters];
+	char *pos = NULL, *end;
+	int i;
+
+	if (nr_filters == MAX_FILTERS) {
+		fprintf(stderr, "At most %d filters\n", MAX_FILTERS);
+		return -1;
+	}
+	for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+		pos = strstr(arg, ops[i].str);
+		if (pos)
+			break;
+	}
+	if (!pos || pos == arg) {
+		fprintf(stderr, "Bad filter '%s'\n", arg);
+		return -1;
+	}
+	f->op = ops[i].op;
+	f->str = pos + strlen(ops[i].str);
+	*pos = '\0';
+	f->col = results_map_column(m, arg);
+	if (f->col < 0) {
+		fprintf(stderr, "No column '%s'\n", arg);
+		return -1;
+	}
+	if (m->columns[f->col].type == RESULT_STR) {
+		if (f->op != OP_EQ && f->op != OP_NE) {
+			fprintf(stderr, "Only = and != work on '%s'\n", arg);
+			return -1;
+		}
+	} else {
+		f->value = strtod(f->str, &end);
+		if (end == f->str || *end) {
+			fprintf(stderr, "Bad number '%s'\n", f->str);
+			return -1;
+		}
+	}
+	nr_filters++;
+	return 0;
+}
+
+static bool op_match(enum filter_op op, int cmp)
+{
+	switch (op) {
+	case OP_EQ:
+		return cmp == 0;
+	case OP_NE:
+		return cmp != 0;
+	case OP_LT:
+		return cmp < 0;
+	case OP_LE:
+		return cmp <= 0;
+	case OP_GT:
+		return cmp > 0;
+	case OP_GE:
+		return cmp >= 0;
+	}
+	return false;
+}
+
+static bool match(struct results_map *m, struct results_chunk *c,
+		  uint64_t row)
+{
+	int i;
+
+	for (i = 0; i < nr_filters; i++) {
+		struct filter *f = &filters[i];
+		int cmp;
+
+		if (m->columns[f->col].type == RESULT_STR) {
+			cmp = strcmp(results_str(c, f->col, row), f->str);
+		} else {
+			double v = value(m, c, f->col, row);
+
+			cmp = v < f->value ? -1 : v > f->value;
+		}
+		if (!op_match(f->op, cmp))
+			return false;
+	}
+	return true;
+}
+
+/* Rows come in runs of the same key, so check the last group first. */
+static struct group *find_group(const char *key)
+{
+	static int last;
+	struct group *g;
+	int i;
+
+	if (last < nr_groups && !strcmp(groups[last].key, key))
+		return &groups[last];
+	for (i = 0; i < nr_groups; i++) {
+		if (!strcmp(groups[i].key, key)) {
+			last = i;
+			return &groups[i];
+		}
+	}
+	g = realloc(groups, (nr_groups + 1) * sizeof(*groups));
+	if (!g)
+		return NULL;
+	groups = g;
+	g = &groups[nr_groups];
+	memset(g, 0, sizeof(*g));
+	g->key = strdup(key);
+	if (!g->key)
+		return NULL;
+	for (i = 0; i < MAX_OUTPUTS; i++) {
+		g->stats[i].min = DBL_MAX;
+		g->stats[i].max = -DBL_MAX;
+	}
+	last = nr_groups++;
+	return g;
+}
+
+static void print_row(struct results_map *m, struct results_chunk *c,
+		      uint64_t row)
+{
+	int i;
+
+	for (i = 0; i < nr_outputs; i++) {
+		int col = outputs[i];
+
+		if (i)
+			printf("\t");
+		switch (m->columns[col].type) {
+		case RESULT_U64:
+			printf("%llu",
+			       (unsigned long long)results_u64(c, col, row));
+			break;
+		case RESULT_F64:
+			printf("%f", results_f64(c, col, row));
+			break;
+		case RESULT_STR:
+			printf("%s", results_str(c, col, row));
+			break;
+		}
+	}
+	printf("\n");
+}
+
+static void print_schema(struct results_map *m)
+{
+	static const char *types[] = { "u64", "f64", "str" };
+	struct results_chunk c = {};
+	uint64_t rows = 0, chunks = 0;
+	int i;
+
+	while (results_map_chunk(m, &c)) {
+		rows += c.nr_rows;
+		chunks++;
+	}
+	printf("%llu rows in %llu chunks\n", (unsigned long long)rows,
+	       (unsigned long long)chunks);
+	for (i = 0; i < m->nr_columns; i++)
+		printf("%-24s %s\n", m->columns[i].name,
+		       m->columns[i].type <= RESULT_STR ?
+		       types[m->columns[i].type] : "?");
+}
+
+static void print_groups(struct results_map *m, int group_col)
+{
+	int i, j;
+
+	for (i = 0; i < nr_groups; i++) {
+		struct group *g = &groups[i];
+
+		if (group_col >= 0)
+			printf("%s=%s ", m->columns[group_col].name, g->key);
+		printf("rows %llu\n", (unsigned long long)g->rows);
+		for (j = 0; j < nr_outputs; j++) {
+			struct agg *st = &g->stats[j];
+
+			if (!st->count)
+				continue;
+			printf("\t%-24s mean %f min %f max %f\n",
+			       m->columns[outputs[j]].name,
+			       st->sum / st->count, st->min, st->max);
+		}
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-s] [-l] [-w column<op>value]... [-g column] file [column...]\n"
+		"  -s  print the columns and row count\n"
+		"  -l  list the matching rows instead of aggregating\n"
+		"  -w  only rows matching, op is one of = != < <= > >=\n"
+		"  -g  aggregate per distinct value of column\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct results_map m;
+	struct results_chunk c = {};
+	const char *group_name = NULL;
+	char *filter_args[MAX_FILTERS];
+	int nr_filter_args = 0, group_col = -1;
+	bool schema = false, list = false;
+	int opt, i, ret;
+
+	while ((opt = getopt(argc, argv, "g:lsw:")) != -1) {
+		switch (opt) {
+		case 'g':
+			group_name = optarg;
+			break;
+		case 'l':
+			list = true;
+			break;
+		case 's':
+			schema = true;
+			break;
+		case 'w':
+			if (nr_filter_args == MAX_FILTERS) {
+				fprintf(stderr, "At most %d filters\n",
+					MAX_FILTERS);
+				return 1;
+			}
+			filter_args[nr_filter_args++] = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	ret = results_map_open(&m, argv[optind]);
+	if (ret) {
+		fprintf(stderr, "Failed to open %s: %s\n", argv[optind],
+			strerror(-ret));
+		return 1;
+	}
+	if (schema) {
+		print_schema(&m);
+		goto out;
+	}
+
+	ret = 1;
+	for (i = 0; i < nr_filter_args; i++)
+		if (parse_filter(&m, filter_args[i]))
+			goto out;
+	if (group_name) {
+		group_col = results_map_column(&m, group_name);
+		if (group_col < 0) {
+			fprintf(stderr, "No column '%s'\n", group_name);
+			goto out;
+		}
+	}
+	for (i = optind + 1; i < argc; i++) {
+		int col = results_map_column(&m, argv[i]);
+
+		if (col < 0) {
+			fprintf(stderr, "No column '%s'\n", argv[i]);
+			goto out;
+		}
+		if (nr_outputs == MAX_OUTPUTS) {
+			fprintf(stderr, "At most %d columns\n", MAX_OUTPUTS);
+			goto out;
+		}
+		if (!list && m.columns[col].type == RESULT_STR) {
+			fprintf(stderr, "Can't aggregate '%s', use -g\n",
+				argv[i]);
+			goto out;
+		}
+		outputs[nr_outputs++] = col;
+	}
+
+	while (results_map_chunk(&m, &c)) {
+		uint64_t row;
+
+		for (row = 0; row < c.nr_rows; row++) {
+			char buf[32];
+			const char *key = "";
+			struct group *g;
+
+			if (!match(&m, &c, row))
+				continue;
+			if (list) {
+				print_row(&m, &c, row);
+				continue;
+			}
+			if (group_col >= 0 &&
+			    m.columns[group_col].type == RESULT_STR) {
+				key = results_str(&c, group_col, row);
+			} else if (group_col >= 0 &&
+				   m.columns[group_col].type == RESULT_U64) {
+				snprintf(buf, sizeof(buf), "%llu",
+					 (unsigned long long)
+					 results_u64(&c, group_col, row));
+				key = buf;
+			} else if (group_col >= 0) {
+				/* Enough digits that distinct doubles stay apart. */
+				snprintf(buf, sizeof(buf), "%.17g",
+					 results_f64(&c, group_col, row));
+				key = buf;
+			}
+			g = find_group(key);
+			if (!g) {
+				fprintf(stderr, "Out of memory\n");
+				goto out;
+			}
+			g->rows++;
+			for (i = 0; i < nr_outputs; i++) {
+				struct agg *st = &g->stats[i];
+				double v = value(&m, &c, outputs[i], row);
+
+				st->count++;
+				st->sum += v;
+				if (v < st->min)
+					st->min = v;
+				if (v > st->max)
+					st->max = v;
+			}
+		}
+	}
+	if (!list)
+		print_groups(&m, group_col);
+	ret = 0;
+out:
+	for (i = 0; i < nr_groups; i++)
+		free(groups[i].key);
+	free(groups);
+	results_map_close(&m);
+	return ret;
+}